@@ -0,0 +1,64 @@
+// The solvers of mf.cpp for the most common numbers of factors, which
+// mf.cpp includes after mf-solver.h in the namespace of an instruction set.
+// RECO_DIM fixes model.k in these kernels, so that the compiler unrolls the
+// loops over the factors completely. Like mf-solver.h, it has no include
+// guard
+
+namespace k16
+{
+#define RECO_DIM 16
+#include "mf-solver.h"
+#undef RECO_DIM
+}
+
+namespace k32
+{
+#define RECO_DIM 32
+#include "mf-solver.h"
+#undef RECO_DIM
+}
+
+namespace k64
+{
+#define RECO_DIM 64
+#include "mf-solver.h"
+#undef RECO_DIM
+}
+
+namespace k128
+{
+#define RECO_DIM 128
+#include "mf-solver.h"
+#undef RECO_DIM
+}
+
+// The solver of param.fun with the kernels for model.k, or the generic ones
+// for the other numbers of factors
+shared_ptr<Solver> make_solver_dim(
+    Scheduler &scheduler,
+    vector<BlockBase*> &blocks,
+    mf_float *PG,
+    mf_float *QG,
+    mf_model &model,
+    mf_parameter param,
+    atomic<bool> &slow_only)
+{
+    switch(model.k)
+    {
+        case 16:
+            return k16::make_solver(scheduler, blocks, PG, QG,
+                                    model, param, slow_only);
+        case 32:
+            return k32::make_solver(scheduler, blocks, PG, QG,
+                                    model, param, slow_only);
+        case 64:
+            return k64::make_solver(scheduler, blocks, PG, QG,
+                                    model, param, slow_only);
+        case 128:
+            return k128::make_solver(scheduler, blocks, PG, QG,
+                                     model, param, slow_only);
+        default:
+            return make_solver(scheduler, blocks, PG, QG,
+                               model, param, slow_only);
+    }
+}
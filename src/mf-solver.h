@@ -0,0 +1,2110 @@
+// The solvers of mf.cpp, which includes this file once for each instruction
+// set in its own namespace, with USESSE or USEAVX defined for the SSE and
+// AVX kernels and neither of them for the scalar ones. It is not a header
+// of its own and has no include guard. USEFMA adds fused multiply-add to
+// the AVX kernels, and USEAVX512 selects the AVX-512 ones, which use it
+// always. mf-solver-dims.h includes it again for fixed values of model.k
+// with RECO_DIM
+
+// The loops over the factors are unrolled completely when their number is
+// fixed
+#undef UNROLL_DIM
+#if defined RECO_DIM
+#define UNROLL_DIM RECO_UNROLL
+#else
+#define UNROLL_DIM
+#endif
+
+// The update of L1 regularization in the solvers: each element is moved
+// toward zero by t, or set to zero if it is closer than that. The vector
+// versions subtract the element clipped to [-t, t]
+#if defined USESSE
+inline __m128 shrink(__m128 XMM, __m128 XMMt)
+{
+    __m128 XMMclip = _mm_min_ps(_mm_max_ps(XMM,
+                     _mm_sub_ps(_mm_setzero_ps(), XMMt)), XMMt);
+    return _mm_sub_ps(XMM, XMMclip);
+}
+#elif defined USEAVX
+inline __m256 shrink(__m256 XMM, __m256 XMMt)
+{
+    __m256 XMMclip = _mm256_min_ps(_mm256_max_ps(XMM,
+                     _mm256_sub_ps(_mm256_setzero_ps(), XMMt)), XMMt);
+    return _mm256_sub_ps(XMM, XMMclip);
+}
+
+// a*b+c and c-a*b
+inline __m256 mul_add(__m256 a, __m256 b, __m256 c)
+{
+#if defined USEFMA
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+inline __m256 neg_mul_add(__m256 a, __m256 b, __m256 c)
+{
+#if defined USEFMA
+    return _mm256_fnmadd_ps(a, b, c);
+#else
+    return _mm256_sub_ps(c, _mm256_mul_ps(a, b));
+#endif
+}
+#elif defined USEAVX512
+// The first element of a vector
+inline mf_float first_lane(__m512 XMM)
+{
+    return _mm_cvtss_f32(_mm512_castps512_ps128(XMM));
+}
+
+// The lanes of the first vector of an update of [d_begin, d_end), which
+// starts in the middle of it after the slow part of kSLOW factors
+inline __mmask16 first_mask(mf_int d_begin, mf_int d_end)
+{
+    mf_int lo = d_begin%16;
+    mf_int hi = min(d_end-d_begin+lo, 16);
+    return (__mmask16)(((1<<hi)-1) & ~((1<<lo)-1));
+}
+
+inline __m512 shrink(__m512 XMM, __m512 XMMt)
+{
+    __m512 XMMclip = _mm512_min_ps(_mm512_max_ps(XMM,
+                     _mm512_sub_ps(_mm512_setzero_ps(), XMMt)), XMMt);
+    return _mm512_sub_ps(XMM, XMMclip);
+}
+#else
+inline mf_float shrink(mf_float x, mf_float t)
+{
+    mf_float x1 = max(abs(x)-t, 0.0f);
+    return x >= 0? x1: -x1;
+}
+#endif
+
+//--------------------------------------
+//-----The base class of all solvers----
+//--------------------------------------
+
+class SolverBase: public Solver
+{
+public:
+    SolverBase(Scheduler &scheduler, vector<BlockBase*> &blocks,
+               mf_float *PG, mf_float *QG, mf_model &model, mf_parameter param,
+               atomic<bool> &slow_only)
+        : scheduler(scheduler), blocks(blocks), PG(PG), QG(QG),
+          model(model), param(param), slow_only(slow_only),
+          worker(Reco::r_seed(), param.nr_iters, param.stats != nullptr) {}
+    vector<mf_thread_stats> const &get_stats() const override { return worker.iters; }
+    void set_node(mf_int node) override { worker.node = node; }
+    SolverBase(const SolverBase&) = delete;
+    SolverBase& operator=(const SolverBase&) = delete;
+    // Solver is stateless functor, so default destructor should be
+    // good enough.
+    virtual ~SolverBase() = default;
+
+protected:
+#if defined USESSE
+    static void calc_z(__m128 &XMMz, mf_int k, mf_float *p, mf_float *q);
+    void load_fixed_variables(
+        __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
+        __m128 &XMMlambda_p2, __m128 &XMMlabmda_q2,
+        __m128 &XMMeta, __m128 &XMMrk_slow,
+        __m128 &XMMrk_fast);
+    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
+    void finalize(__m128d XMMloss, __m128d XMMerror);
+#elif defined USEAVX
+    static void calc_z(__m256 &XMMz, mf_int k, mf_float *p, mf_float *q);
+    void load_fixed_variables(
+        __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
+        __m256 &XMMlambda_p2, __m256 &XMMlabmda_q2,
+        __m256 &XMMeta, __m256 &XMMrk_slow,
+        __m256 &XMMrk_fast);
+    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
+    void finalize(__m128d XMMloss, __m128d XMMerror);
+#elif defined USEAVX512
+    static void calc_z(__m512 &XMMz, mf_int k, mf_float *p, mf_float *q);
+    void load_fixed_variables(
+        __m512 &XMMlambda_p1, __m512 &XMMlambda_q1,
+        __m512 &XMMlambda_p2, __m512 &XMMlabmda_q2,
+        __m512 &XMMeta, __m512 &XMMrk_slow,
+        __m512 &XMMrk_fast);
+    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
+    void finalize(__m128d XMMloss, __m128d XMMerror);
+#else
+    static void calc_z(mf_float &z, mf_int k, mf_float *p, mf_float *q);
+    void load_fixed_variables();
+    void arrange_block();
+    void finalize();
+    static float qrsqrt(float x);
+#endif
+    void prepare_negative() {}
+    void update() { ++pG; ++qG; };
+    // The training loop of run() for the solver S, which calls the member
+    // functions of S directly, so that they are all inlined. L1 and NMF fix
+    // whether sg_update() applies L1 regularization and non-negativity
+    template<typename S, bool L1, bool NMF> void loop();
+    // The number of factors, a constant in the kernels for one value of k
+    mf_int dim() const
+    {
+#if defined RECO_DIM
+        return RECO_DIM;
+#else
+        return model.k;
+#endif
+    }
+    // The number of factors after the slow part, counted with the padding
+    // to kSLOW factors so that the step sizes do not depend on the width of
+    // the vectors
+    mf_int fast_dim() const
+    {
+        return max((param.k+kSLOW-1)/kSLOW*kSLOW-kSLOW, 1);
+    }
+
+    Scheduler &scheduler;
+    vector<BlockBase*> &blocks;
+    BlockBase *block;
+    mf_float *PG;
+    mf_float *QG;
+    mf_model &model;
+    mf_parameter param;
+    atomic<bool> &slow_only;
+    // Solvers are created by the master thread one after another, so the
+    // seeds follow set.seed() for a fixed number of threads
+    Worker worker;
+
+    mf_node *N;
+    mf_float z;
+    mf_double loss;
+    mf_double error;
+    mf_float *p;
+    mf_float *q;
+    mf_float *pG;
+    mf_float *qG;
+    mf_int bid;
+
+    mf_float lambda_p1;
+    mf_float lambda_q1;
+    mf_float lambda_p2;
+    mf_float lambda_q2;
+    mf_float rk_slow;
+    mf_float rk_fast;
+};
+
+#if defined USESSE
+template<typename S, bool L1, bool NMF>
+inline void SolverBase::loop()
+{
+    S &solver = static_cast<S&>(*this);
+    __m128d XMMloss;
+    __m128d XMMerror;
+    __m128 XMMz;
+    __m128 XMMlambda_p1;
+    __m128 XMMlambda_q1;
+    __m128 XMMlambda_p2;
+    __m128 XMMlambda_q2;
+    __m128 XMMeta;
+    __m128 XMMrk_slow;
+    __m128 XMMrk_fast;
+    solver.S::load_fixed_variables(XMMlambda_p1, XMMlambda_q1,
+                                   XMMlambda_p2, XMMlambda_q2,
+                                   XMMeta, XMMrk_slow,
+                                   XMMrk_fast);
+    while(!scheduler.is_terminated())
+    {
+        solver.S::arrange_block(XMMloss, XMMerror);
+        mf_node *last = block->data()+block->get_nnz();
+        for(N = block->data(); N != last; N++)
+        {
+            p = model.P+(mf_long)N->u*dim();
+            q = model.Q+(mf_long)N->v*dim();
+            pG = PG+N->u*2;
+            qG = QG+N->v*2;
+            solver.S::prepare_negative();
+            solver.S::prepare_for_sg_update(XMMz, XMMloss, XMMerror);
+            solver.S::template sg_update<L1, NMF>(0, kSLOW, XMMz,
+                    XMMlambda_p1, XMMlambda_q1, XMMlambda_p2, XMMlambda_q2,
+                    XMMeta, XMMrk_slow);
+            if(slow_only.load(memory_order_relaxed))
+                continue;
+            solver.S::update();
+            solver.S::template sg_update<L1, NMF>(kSLOW, dim(), XMMz,
+                    XMMlambda_p1, XMMlambda_q1, XMMlambda_p2, XMMlambda_q2,
+                    XMMeta, XMMrk_fast);
+        }
+        solver.S::finalize(XMMloss, XMMerror);
+    }
+}
+
+void SolverBase::load_fixed_variables(
+    __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
+    __m128 &XMMlambda_p2, __m128 &XMMlambda_q2,
+    __m128 &XMMeta, __m128 &XMMrk_slow,
+    __m128 &XMMrk_fast)
+{
+    XMMlambda_p1 = _mm_set1_ps(param.lambda_p1);
+    XMMlambda_q1 = _mm_set1_ps(param.lambda_q1);
+    XMMlambda_p2 = _mm_set1_ps(param.lambda_p2);
+    XMMlambda_q2 = _mm_set1_ps(param.lambda_q2);
+    XMMeta = _mm_set1_ps(param.eta);
+    XMMrk_slow = _mm_set1_ps((mf_float)1.0/kSLOW);
+    XMMrk_fast = _mm_set1_ps((mf_float)1.0/fast_dim());
+}
+
+void SolverBase::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
+{
+    XMMloss = _mm_setzero_pd();
+    XMMerror = _mm_setzero_pd();
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+}
+
+inline void SolverBase::calc_z(
+    __m128 &XMMz, mf_int k, mf_float *p, mf_float *q)
+{
+    XMMz = _mm_setzero_ps();
+    for(mf_int d = 0; d < k; d += 4)
+        XMMz = _mm_add_ps(XMMz, _mm_mul_ps(
+               _mm_load_ps(p+d), _mm_load_ps(q+d)));
+    // Bit-wise representation of 177 is {1,0}+{1,1}+{0,0}+{0,1} from
+    // high-bit to low-bit, where "+" means concatenating two arrays.
+    __m128 XMMtmp = _mm_add_ps(XMMz, _mm_shuffle_ps(XMMz, XMMz, 177));
+    // Bit-wise representation of 78 is {0,1}+{0,0}+{1,1}+{1,0} from
+    // high-bit to low-bit, where "+" means concatenating two arrays.
+    XMMz = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 78));
+}
+
+void SolverBase::finalize(__m128d XMMloss, __m128d XMMerror)
+{
+    _mm_store_sd(&loss, XMMloss);
+    _mm_store_sd(&error, XMMerror);
+    block->free();
+    scheduler.put_job(bid, loss, error, worker);
+}
+#elif defined USEAVX
+template<typename S, bool L1, bool NMF>
+inline void SolverBase::loop()
+{
+    S &solver = static_cast<S&>(*this);
+    __m128d XMMloss;
+    __m128d XMMerror;
+    __m256 XMMz;
+    __m256 XMMlambda_p1;
+    __m256 XMMlambda_q1;
+    __m256 XMMlambda_p2;
+    __m256 XMMlambda_q2;
+    __m256 XMMeta;
+    __m256 XMMrk_slow;
+    __m256 XMMrk_fast;
+    solver.S::load_fixed_variables(XMMlambda_p1, XMMlambda_q1,
+                                   XMMlambda_p2, XMMlambda_q2,
+                                   XMMeta, XMMrk_slow, XMMrk_fast);
+    while(!scheduler.is_terminated())
+    {
+        solver.S::arrange_block(XMMloss, XMMerror);
+        mf_node *last = block->data()+block->get_nnz();
+        for(N = block->data(); N != last; N++)
+        {
+            p = model.P+(mf_long)N->u*dim();
+            q = model.Q+(mf_long)N->v*dim();
+            pG = PG+N->u*2;
+            qG = QG+N->v*2;
+            solver.S::prepare_negative();
+            solver.S::prepare_for_sg_update(XMMz, XMMloss, XMMerror);
+            solver.S::template sg_update<L1, NMF>(0, kSLOW, XMMz,
+                    XMMlambda_p1, XMMlambda_q1, XMMlambda_p2, XMMlambda_q2,
+                    XMMeta, XMMrk_slow);
+            if(slow_only.load(memory_order_relaxed))
+                continue;
+            solver.S::update();
+            solver.S::template sg_update<L1, NMF>(kSLOW, dim(), XMMz,
+                    XMMlambda_p1, XMMlambda_q1, XMMlambda_p2, XMMlambda_q2,
+                    XMMeta, XMMrk_fast);
+        }
+        solver.S::finalize(XMMloss, XMMerror);
+    }
+}
+
+void SolverBase::load_fixed_variables(
+    __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
+    __m256 &XMMlambda_p2, __m256 &XMMlambda_q2,
+    __m256 &XMMeta, __m256 &XMMrk_slow,
+    __m256 &XMMrk_fast)
+{
+    XMMlambda_p1 = _mm256_set1_ps(param.lambda_p1);
+    XMMlambda_q1 = _mm256_set1_ps(param.lambda_q1);
+    XMMlambda_p2 = _mm256_set1_ps(param.lambda_p2);
+    XMMlambda_q2 = _mm256_set1_ps(param.lambda_q2);
+    XMMeta = _mm256_set1_ps(param.eta);
+    XMMrk_slow = _mm256_set1_ps((mf_float)1.0/kSLOW);
+    XMMrk_fast = _mm256_set1_ps((mf_float)1.0/fast_dim());
+}
+
+void SolverBase::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
+{
+    XMMloss = _mm_setzero_pd();
+    XMMerror = _mm_setzero_pd();
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+}
+
+inline void SolverBase::calc_z(
+    __m256 &XMMz, mf_int k, mf_float *p, mf_float *q)
+{
+    XMMz = _mm256_setzero_ps();
+    UNROLL_DIM
+    for(mf_int d = 0; d < k; d += 8)
+        XMMz = mul_add(_mm256_load_ps(p+d), _mm256_load_ps(q+d), XMMz);
+    XMMz = _mm256_add_ps(XMMz, _mm256_permute2f128_ps(XMMz, XMMz, 0x1));
+    XMMz = _mm256_hadd_ps(XMMz, XMMz);
+    XMMz = _mm256_hadd_ps(XMMz, XMMz);
+}
+
+void SolverBase::finalize(__m128d XMMloss, __m128d XMMerror)
+{
+    _mm_store_sd(&loss, XMMloss);
+    _mm_store_sd(&error, XMMerror);
+    block->free();
+    scheduler.put_job(bid, loss, error, worker);
+}
+#elif defined USEAVX512
+template<typename S, bool L1, bool NMF>
+inline void SolverBase::loop()
+{
+    S &solver = static_cast<S&>(*this);
+    __m128d XMMloss;
+    __m128d XMMerror;
+    __m512 XMMz;
+    __m512 XMMlambda_p1;
+    __m512 XMMlambda_q1;
+    __m512 XMMlambda_p2;
+    __m512 XMMlambda_q2;
+    __m512 XMMeta;
+    __m512 XMMrk_slow;
+    __m512 XMMrk_fast;
+    solver.S::load_fixed_variables(XMMlambda_p1, XMMlambda_q1,
+                                   XMMlambda_p2, XMMlambda_q2,
+                                   XMMeta, XMMrk_slow, XMMrk_fast);
+    while(!scheduler.is_terminated())
+    {
+        solver.S::arrange_block(XMMloss, XMMerror);
+        mf_node *last = block->data()+block->get_nnz();
+        for(N = block->data(); N != last; N++)
+        {
+            p = model.P+(mf_long)N->u*dim();
+            q = model.Q+(mf_long)N->v*dim();
+            pG = PG+N->u*2;
+            qG = QG+N->v*2;
+            solver.S::prepare_negative();
+            solver.S::prepare_for_sg_update(XMMz, XMMloss, XMMerror);
+            solver.S::template sg_update<L1, NMF>(0, kSLOW, XMMz,
+                    XMMlambda_p1, XMMlambda_q1, XMMlambda_p2, XMMlambda_q2,
+                    XMMeta, XMMrk_slow);
+            if(slow_only.load(memory_order_relaxed))
+                continue;
+            solver.S::update();
+            solver.S::template sg_update<L1, NMF>(kSLOW, dim(), XMMz,
+                    XMMlambda_p1, XMMlambda_q1, XMMlambda_p2, XMMlambda_q2,
+                    XMMeta, XMMrk_fast);
+        }
+        solver.S::finalize(XMMloss, XMMerror);
+    }
+}
+
+void SolverBase::load_fixed_variables(
+    __m512 &XMMlambda_p1, __m512 &XMMlambda_q1,
+    __m512 &XMMlambda_p2, __m512 &XMMlambda_q2,
+    __m512 &XMMeta, __m512 &XMMrk_slow,
+    __m512 &XMMrk_fast)
+{
+    XMMlambda_p1 = _mm512_set1_ps(param.lambda_p1);
+    XMMlambda_q1 = _mm512_set1_ps(param.lambda_q1);
+    XMMlambda_p2 = _mm512_set1_ps(param.lambda_p2);
+    XMMlambda_q2 = _mm512_set1_ps(param.lambda_q2);
+    XMMeta = _mm512_set1_ps(param.eta);
+    XMMrk_slow = _mm512_set1_ps((mf_float)1.0/kSLOW);
+    XMMrk_fast = _mm512_set1_ps((mf_float)1.0/fast_dim());
+}
+
+void SolverBase::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
+{
+    XMMloss = _mm_setzero_pd();
+    XMMerror = _mm_setzero_pd();
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+}
+
+inline void SolverBase::calc_z(
+    __m512 &XMMz, mf_int k, mf_float *p, mf_float *q)
+{
+    XMMz = _mm512_setzero_ps();
+    UNROLL_DIM
+    for(mf_int d = 0; d < k; d += 16)
+        XMMz = _mm512_fmadd_ps(_mm512_load_ps(p+d), _mm512_load_ps(q+d), XMMz);
+    XMMz = _mm512_set1_ps(_mm512_reduce_add_ps(XMMz));
+}
+
+void SolverBase::finalize(__m128d XMMloss, __m128d XMMerror)
+{
+    _mm_store_sd(&loss, XMMloss);
+    _mm_store_sd(&error, XMMerror);
+    block->free();
+    scheduler.put_job(bid, loss, error, worker);
+}
+#else
+template<typename S, bool L1, bool NMF>
+inline void SolverBase::loop()
+{
+    S &solver = static_cast<S&>(*this);
+    solver.S::load_fixed_variables();
+    while(!scheduler.is_terminated())
+    {
+        solver.S::arrange_block();
+        mf_node *last = block->data()+block->get_nnz();
+        for(N = block->data(); N != last; N++)
+        {
+            p = model.P+(mf_long)N->u*dim();
+            q = model.Q+(mf_long)N->v*dim();
+            pG = PG+N->u*2;
+            qG = QG+N->v*2;
+            solver.S::prepare_negative();
+            solver.S::prepare_for_sg_update();
+            solver.S::template sg_update<L1, NMF>(0, kSLOW, rk_slow);
+            if(slow_only.load(memory_order_relaxed))
+                continue;
+            solver.S::update();
+            solver.S::template sg_update<L1, NMF>(kSLOW, dim(), rk_fast);
+        }
+        solver.S::finalize();
+    }
+}
+
+inline float SolverBase::qrsqrt(float x)
+{
+    float xhalf = 0.5f*x;
+    uint32_t i;
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5f375a86 - (i>>1);
+    memcpy(&x, &i, sizeof(i));
+    x = x*(1.5f - xhalf*x*x);
+    return x;
+}
+
+void SolverBase::load_fixed_variables()
+{
+    lambda_p1 = param.lambda_p1;
+    lambda_q1 = param.lambda_q1;
+    lambda_p2 = param.lambda_p2;
+    lambda_q2 = param.lambda_q2;
+    rk_slow = (mf_float)1.0/kSLOW;
+    rk_fast = (mf_float)1.0/fast_dim();
+}
+
+void SolverBase::arrange_block()
+{
+    loss = 0.0;
+    error = 0.0;
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+}
+
+inline void SolverBase::calc_z(mf_float &z, mf_int k, mf_float *p, mf_float *q)
+{
+    z = 0;
+    for(mf_int d = 0; d < k; ++d)
+        z += p[d]*q[d];
+}
+
+void SolverBase::finalize()
+{
+    block->free();
+    scheduler.put_job(bid, loss, error, worker);
+}
+#endif
+
+//--------------------------------------
+//-----Real-valued MF and binary MF-----
+//--------------------------------------
+
+class MFSolver: public SolverBase
+{
+public:
+    MFSolver(Scheduler &scheduler, vector<BlockBase*> &blocks,
+             mf_float *PG, mf_float *QG, mf_model &model,
+             mf_parameter param, atomic<bool> &slow_only)
+        : SolverBase(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
+                   __m128 XMMlambda_p1, __m128 XMMlambda_q1,
+                   __m128 XMMlambda_p2, __m128 XMMlambda_q2,
+                   __m128 XMMeta, __m128 XMMrk);
+#elif defined USEAVX
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
+                   __m256 XMMlambda_p1, __m256 XMMlambda_q1,
+                   __m256 XMMlambda_p2, __m256 XMMlambda_q2,
+                   __m256 XMMeta, __m256 XMMrk);
+#elif defined USEAVX512
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, __m512 XMMz,
+                   __m512 XMMlambda_p1, __m512 XMMlambda_q1,
+                   __m512 XMMlambda_p2, __m512 XMMlambda_q2,
+                   __m512 XMMeta, __m512 XMMrk);
+#else
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, mf_float rk);
+#endif
+};
+
+#if defined USESSE
+template<bool L1, bool NMF>
+inline void MFSolver::sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
+                                __m128 XMMlambda_p1, __m128 XMMlambda_q1,
+                                __m128 XMMlambda_p2, __m128 XMMlambda_q2,
+                                __m128 XMMeta, __m128 XMMrk)
+{
+    __m128 XMMpG = _mm_load1_ps(pG);
+    __m128 XMMqG = _mm_load1_ps(qG);
+    __m128 XMMeta_p = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMpG));
+    __m128 XMMeta_q = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMqG));
+    __m128 XMMpG1 = _mm_setzero_ps();
+    __m128 XMMqG1 = _mm_setzero_ps();
+
+    for(mf_int d = d_begin; d < d_end; d += 4)
+    {
+        __m128 XMMp = _mm_load_ps(p+d);
+        __m128 XMMq = _mm_load_ps(q+d);
+
+        __m128 XMMpg = _mm_sub_ps(_mm_mul_ps(XMMlambda_p2, XMMp),
+                       _mm_mul_ps(XMMz, XMMq));
+        __m128 XMMqg = _mm_sub_ps(_mm_mul_ps(XMMlambda_q2, XMMq),
+                       _mm_mul_ps(XMMz, XMMp));
+
+        XMMpG1 = _mm_add_ps(XMMpG1, _mm_mul_ps(XMMpg, XMMpg));
+        XMMqG1 = _mm_add_ps(XMMqG1, _mm_mul_ps(XMMqg, XMMqg));
+
+        XMMp = _mm_sub_ps(XMMp, _mm_mul_ps(XMMeta_p, XMMpg));
+        XMMq = _mm_sub_ps(XMMq, _mm_mul_ps(XMMeta_q, XMMqg));
+
+        if(L1)
+        {
+            XMMp = shrink(XMMp, _mm_mul_ps(XMMeta_p, XMMlambda_p1));
+            XMMq = shrink(XMMq, _mm_mul_ps(XMMeta_q, XMMlambda_q1));
+        }
+        if(NMF)
+        {
+            XMMp = _mm_max_ps(XMMp, _mm_setzero_ps());
+            XMMq = _mm_max_ps(XMMq, _mm_setzero_ps());
+        }
+
+        _mm_store_ps(p+d, XMMp);
+        _mm_store_ps(q+d, XMMq);
+    }
+
+    __m128 XMMtmp = _mm_add_ps(XMMpG1, _mm_movehl_ps(XMMpG1, XMMpG1));
+    XMMpG1 = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
+    XMMpG = _mm_add_ps(XMMpG, _mm_mul_ps(XMMpG1, XMMrk));
+    _mm_store_ss(pG, XMMpG);
+
+    XMMtmp = _mm_add_ps(XMMqG1, _mm_movehl_ps(XMMqG1, XMMqG1));
+    XMMqG1 = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
+    XMMqG = _mm_add_ps(XMMqG, _mm_mul_ps(XMMqG1, XMMrk));
+    _mm_store_ss(qG, XMMqG);
+}
+#elif defined USEAVX
+template<bool L1, bool NMF>
+RECO_INLINE
+void MFSolver::sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
+                                __m256 XMMlambda_p1, __m256 XMMlambda_q1,
+                                __m256 XMMlambda_p2, __m256 XMMlambda_q2,
+                                __m256 XMMeta, __m256 XMMrk)
+{
+    __m256 XMMpG = _mm256_broadcast_ss(pG);
+    __m256 XMMqG = _mm256_broadcast_ss(qG);
+    __m256 XMMeta_p = _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMpG));
+    __m256 XMMeta_q = _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMqG));
+    __m256 XMMpG1 = _mm256_setzero_ps();
+    __m256 XMMqG1 = _mm256_setzero_ps();
+
+    UNROLL_DIM
+    for(mf_int d = d_begin; d < d_end; d += 8)
+    {
+        __m256 XMMp = _mm256_load_ps(p+d);
+        __m256 XMMq = _mm256_load_ps(q+d);
+
+        __m256 XMMpg = neg_mul_add(XMMz, XMMq,
+                                   _mm256_mul_ps(XMMlambda_p2, XMMp));
+        __m256 XMMqg = neg_mul_add(XMMz, XMMp,
+                                   _mm256_mul_ps(XMMlambda_q2, XMMq));
+
+        XMMpG1 = mul_add(XMMpg, XMMpg, XMMpG1);
+        XMMqG1 = mul_add(XMMqg, XMMqg, XMMqG1);
+
+        XMMp = neg_mul_add(XMMeta_p, XMMpg, XMMp);
+        XMMq = neg_mul_add(XMMeta_q, XMMqg, XMMq);
+
+        if(L1)
+        {
+            XMMp = shrink(XMMp, _mm256_mul_ps(XMMeta_p, XMMlambda_p1));
+            XMMq = shrink(XMMq, _mm256_mul_ps(XMMeta_q, XMMlambda_q1));
+        }
+        if(NMF)
+        {
+            XMMp = _mm256_max_ps(XMMp, _mm256_setzero_ps());
+            XMMq = _mm256_max_ps(XMMq, _mm256_setzero_ps());
+        }
+
+        _mm256_store_ps(p+d, XMMp);
+        _mm256_store_ps(q+d, XMMq);
+    }
+
+    XMMpG1 = _mm256_add_ps(XMMpG1,
+             _mm256_permute2f128_ps(XMMpG1, XMMpG1, 0x1));
+    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
+    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
+
+    XMMqG1 = _mm256_add_ps(XMMqG1,
+             _mm256_permute2f128_ps(XMMqG1, XMMqG1, 0x1));
+    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
+    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
+
+    XMMpG = _mm256_add_ps(XMMpG, _mm256_mul_ps(XMMpG1, XMMrk));
+    XMMqG = _mm256_add_ps(XMMqG, _mm256_mul_ps(XMMqG1, XMMrk));
+
+    _mm_store_ss(pG, _mm256_castps256_ps128(XMMpG));
+    _mm_store_ss(qG, _mm256_castps256_ps128(XMMqG));
+}
+#elif defined USEAVX512
+template<bool L1, bool NMF>
+RECO_INLINE
+void MFSolver::sg_update(mf_int d_begin, mf_int d_end, __m512 XMMz,
+                                __m512 XMMlambda_p1, __m512 XMMlambda_q1,
+                                __m512 XMMlambda_p2, __m512 XMMlambda_q2,
+                                __m512 XMMeta, __m512 XMMrk)
+{
+    __m512 XMMpG = _mm512_set1_ps(*pG);
+    __m512 XMMqG = _mm512_set1_ps(*qG);
+    __m512 XMMeta_p = _mm512_mul_ps(XMMeta, _mm512_rsqrt14_ps(XMMpG));
+    __m512 XMMeta_q = _mm512_mul_ps(XMMeta, _mm512_rsqrt14_ps(XMMqG));
+    __m512 XMMpG1 = _mm512_setzero_ps();
+    __m512 XMMqG1 = _mm512_setzero_ps();
+
+    __mmask16 mask = first_mask(d_begin, d_end);
+    UNROLL_DIM
+    for(mf_int d = d_begin-d_begin%16; d < d_end; d += 16)
+    {
+        __m512 XMMp = _mm512_maskz_load_ps(mask, p+d);
+        __m512 XMMq = _mm512_maskz_load_ps(mask, q+d);
+
+        __m512 XMMpg = _mm512_fnmadd_ps(XMMz, XMMq,
+                                        _mm512_mul_ps(XMMlambda_p2, XMMp));
+        __m512 XMMqg = _mm512_fnmadd_ps(XMMz, XMMp,
+                                        _mm512_mul_ps(XMMlambda_q2, XMMq));
+
+        XMMpG1 = _mm512_fmadd_ps(XMMpg, XMMpg, XMMpG1);
+        XMMqG1 = _mm512_fmadd_ps(XMMqg, XMMqg, XMMqG1);
+
+        XMMp = _mm512_fnmadd_ps(XMMeta_p, XMMpg, XMMp);
+        XMMq = _mm512_fnmadd_ps(XMMeta_q, XMMqg, XMMq);
+
+        if(L1)
+        {
+            XMMp = shrink(XMMp, _mm512_mul_ps(XMMeta_p, XMMlambda_p1));
+            XMMq = shrink(XMMq, _mm512_mul_ps(XMMeta_q, XMMlambda_q1));
+        }
+        if(NMF)
+        {
+            XMMp = _mm512_max_ps(XMMp, _mm512_setzero_ps());
+            XMMq = _mm512_max_ps(XMMq, _mm512_setzero_ps());
+        }
+
+        _mm512_mask_store_ps(p+d, mask, XMMp);
+        _mm512_mask_store_ps(q+d, mask, XMMq);
+        mask = 0xFFFF;
+    }
+
+    XMMpG = _mm512_fmadd_ps(_mm512_set1_ps(_mm512_reduce_add_ps(XMMpG1)),
+                            XMMrk, XMMpG);
+    XMMqG = _mm512_fmadd_ps(_mm512_set1_ps(_mm512_reduce_add_ps(XMMqG1)),
+                            XMMrk, XMMqG);
+
+    *pG = first_lane(XMMpG);
+    *qG = first_lane(XMMqG);
+}
+#else
+template<bool L1, bool NMF>
+inline void MFSolver::sg_update(mf_int d_begin, mf_int d_end, mf_float rk)
+{
+    mf_float eta_p = param.eta*qrsqrt(*pG);
+    mf_float eta_q = param.eta*qrsqrt(*qG);
+
+    mf_float pG1 = 0;
+    mf_float qG1 = 0;
+
+    for(mf_int d = d_begin; d < d_end; ++d)
+    {
+        mf_float gp = -z*q[d]+lambda_p2*p[d];
+        mf_float gq = -z*p[d]+lambda_q2*q[d];
+
+        pG1 += gp*gp;
+        qG1 += gq*gq;
+
+        mf_float p1 = p[d]-eta_p*gp;
+        mf_float q1 = q[d]-eta_q*gq;
+        if(L1)
+        {
+            p1 = shrink(p1, lambda_p1*eta_p);
+            q1 = shrink(q1, lambda_q1*eta_q);
+        }
+        if(NMF)
+        {
+            p1 = max(p1, (mf_float)0.0);
+            q1 = max(q1, (mf_float)0.0);
+        }
+        p[d] = p1;
+        q[d] = q1;
+    }
+
+    *pG += pG1*rk;
+    *qG += qG1*rk;
+}
+#endif
+
+class L2_MFR : public MFSolver
+{
+public:
+    L2_MFR(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
+           mf_model &model, mf_parameter param, atomic<bool> &slow_only)
+        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX512
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#else
+    void prepare_for_sg_update();
+#endif
+};
+
+#if defined USESSE
+inline void L2_MFR::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm_sub_ps(_mm_set1_ps(N->r), XMMz);
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_mul_ps(XMMz, XMMz)));
+    XMMerror = XMMloss;
+}
+#elif defined USEAVX
+inline void L2_MFR::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm256_sub_ps(_mm256_set1_ps(N->r), XMMz);
+    XMMloss = _mm_add_pd(XMMloss,
+              _mm_cvtps_pd(_mm256_castps256_ps128(
+              _mm256_mul_ps(XMMz, XMMz))));
+    XMMerror = XMMloss;
+}
+#elif defined USEAVX512
+inline void L2_MFR::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm512_sub_ps(_mm512_set1_ps(N->r), XMMz);
+    XMMloss = _mm_add_pd(XMMloss,
+              _mm_cvtps_pd(_mm512_castps512_ps128(
+              _mm512_mul_ps(XMMz, XMMz))));
+    XMMerror = XMMloss;
+}
+#else
+inline void L2_MFR::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q);
+    z = N->r-z;
+    loss += z*z;
+    error = loss;
+}
+#endif
+class L1_MFR : public MFSolver
+{
+public:
+    L1_MFR(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
+           mf_model &model, mf_parameter param, atomic<bool> &slow_only)
+        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX512
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#else
+    void prepare_for_sg_update();
+#endif
+};
+
+#if defined USESSE
+inline void L1_MFR::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm_sub_ps(_mm_set1_ps(N->r), XMMz);
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_andnot_ps(_mm_set1_ps(-0.0f), XMMz)));
+    XMMerror = XMMloss;
+    XMMz = _mm_add_ps(_mm_and_ps(_mm_cmpgt_ps(XMMz, _mm_set1_ps(0.0f)),
+           _mm_set1_ps(1.0f)),
+           _mm_and_ps(_mm_cmplt_ps(XMMz, _mm_set1_ps(0.0f)),
+           _mm_set1_ps(-1.0f)));
+}
+#elif defined USEAVX
+inline void L1_MFR::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm256_sub_ps(_mm256_set1_ps(N->r), XMMz);
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm256_castps256_ps128(
+              _mm256_andnot_ps(_mm256_set1_ps(-0.0f), XMMz))));
+    XMMerror = XMMloss;
+    XMMz = _mm256_add_ps(_mm256_and_ps(_mm256_cmp_ps(XMMz,
+           _mm256_set1_ps(0.0f), _CMP_GT_OS), _mm256_set1_ps(1.0f)),
+           _mm256_and_ps(_mm256_cmp_ps(XMMz,
+           _mm256_set1_ps(0.0f), _CMP_LT_OS), _mm256_set1_ps(-1.0f)));
+}
+#elif defined USEAVX512
+inline void L1_MFR::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm512_sub_ps(_mm512_set1_ps(N->r), XMMz);
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm512_castps512_ps128(
+              _mm512_abs_ps(XMMz))));
+    XMMerror = XMMloss;
+    XMMz = _mm512_mask_mov_ps(_mm512_maskz_mov_ps(
+           _mm512_cmp_ps_mask(XMMz, _mm512_setzero_ps(), _CMP_GT_OS),
+           _mm512_set1_ps(1.0f)),
+           _mm512_cmp_ps_mask(XMMz, _mm512_setzero_ps(), _CMP_LT_OS),
+           _mm512_set1_ps(-1.0f));
+}
+#else
+inline void L1_MFR::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q);
+    z = N->r-z;
+    loss += abs(z);
+    error = loss;
+    if(z > 0)
+        z = 1;
+    else if(z < 0)
+        z = -1;
+}
+#endif
+
+class KL_MFR : public MFSolver
+{
+public:
+    KL_MFR(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
+           mf_model &model, mf_parameter param, atomic<bool> &slow_only)
+        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX512
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#else
+    void prepare_for_sg_update();
+#endif
+};
+
+#if defined USESSE
+inline void KL_MFR::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm_div_ps(_mm_set1_ps(N->r), XMMz);
+    _mm_store_ss(&z, XMMz);
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_set1_ps(N->r*(log(z)-1+1/z))));
+    XMMerror = XMMloss;
+    XMMz = _mm_sub_ps(XMMz, _mm_set1_ps(1.0f));
+}
+#elif defined USEAVX
+inline void KL_MFR::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm256_div_ps(_mm256_set1_ps(N->r), XMMz);
+    _mm_store_ss(&z, _mm256_castps256_ps128(XMMz));
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_set1_ps(N->r*(log(z)-1+1/z))));
+    XMMerror = XMMloss;
+    XMMz = _mm256_sub_ps(XMMz, _mm256_set1_ps(1.0f));
+}
+#elif defined USEAVX512
+inline void KL_MFR::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    XMMz = _mm512_div_ps(_mm512_set1_ps(N->r), XMMz);
+    z = first_lane(XMMz);
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_set1_ps(N->r*(log(z)-1+1/z))));
+    XMMerror = XMMloss;
+    XMMz = _mm512_sub_ps(XMMz, _mm512_set1_ps(1.0f));
+}
+#else
+inline void KL_MFR::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q);
+    z = N->r/z;
+    loss += N->r*(log(z)-1+1/z);
+    error = loss;
+    z -= 1;
+}
+#endif
+
+class LR_MFC : public MFSolver
+{
+public:
+    LR_MFC(Scheduler &scheduler, vector<BlockBase*> &blocks,
+           mf_float *PG, mf_float *QG, mf_model &model,
+           mf_parameter param, atomic<bool> &slow_only)
+        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX512
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#else
+    void prepare_for_sg_update();
+#endif
+};
+
+#if defined USESSE
+inline void LR_MFC::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    _mm_store_ss(&z, XMMz);
+    if(N->r > 0)
+    {
+        z = exp(-z);
+        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
+        XMMz = _mm_set1_ps(z/(1+z));
+    }
+    else
+    {
+        z = exp(z);
+        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
+        XMMz = _mm_set1_ps(-z/(1+z));
+    }
+    XMMerror = XMMloss;
+}
+#elif defined USEAVX
+inline void LR_MFC::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    _mm_store_ss(&z, _mm256_castps256_ps128(XMMz));
+    if(N->r > 0)
+    {
+        z = exp(-z);
+        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1.0+z)));
+        XMMz = _mm256_set1_ps(z/(1+z));
+    }
+    else
+    {
+        z = exp(z);
+        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1.0+z)));
+        XMMz = _mm256_set1_ps(-z/(1+z));
+    }
+    XMMerror = XMMloss;
+}
+#elif defined USEAVX512
+inline void LR_MFC::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    z = first_lane(XMMz);
+    if(N->r > 0)
+    {
+        z = exp(-z);
+        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1.0+z)));
+        XMMz = _mm512_set1_ps(z/(1+z));
+    }
+    else
+    {
+        z = exp(z);
+        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1.0+z)));
+        XMMz = _mm512_set1_ps(-z/(1+z));
+    }
+    XMMerror = XMMloss;
+}
+#else
+inline void LR_MFC::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q);
+    if(N->r > 0)
+    {
+        z = exp(-z);
+        loss += log(1+z);
+        error = loss;
+        z = z/(1+z);
+    }
+    else
+    {
+        z = exp(z);
+        loss += log(1+z);
+        error = loss;
+        z = -z/(1+z);
+    }
+}
+#endif
+
+class L2_MFC : public MFSolver
+{
+public:
+    L2_MFC(Scheduler &scheduler, vector<BlockBase*> &blocks,
+           mf_float *PG, mf_float *QG, mf_model &model,
+           mf_parameter param, atomic<bool> &slow_only)
+        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX512
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#else
+    void prepare_for_sg_update();
+#endif
+};
+
+#if defined USESSE
+inline void L2_MFC::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    if(N->r > 0)
+    {
+        __m128 mask = _mm_cmpgt_ps(XMMz, _mm_set1_ps(0.0f));
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
+        XMMz = _mm_max_ps(_mm_set1_ps(0.0f), _mm_sub_ps(
+               _mm_set1_ps(1.0f), XMMz));
+    }
+    else
+    {
+        __m128 mask = _mm_cmplt_ps(XMMz, _mm_set1_ps(0.0f));
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
+        XMMz = _mm_min_ps(_mm_set1_ps(0.0f), _mm_sub_ps(
+               _mm_set1_ps(-1.0f), XMMz));
+    }
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_mul_ps(XMMz, XMMz)));
+}
+#elif defined USEAVX
+inline void L2_MFC::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    if(N->r > 0)
+    {
+        __m128 mask = _mm_cmpgt_ps(_mm256_castps256_ps128(XMMz),
+                      _mm_set1_ps(0.0f));
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
+        XMMz = _mm256_max_ps(_mm256_set1_ps(0.0f),
+               _mm256_sub_ps(_mm256_set1_ps(1.0f), XMMz));
+    }
+    else
+    {
+        __m128 mask = _mm_cmplt_ps(_mm256_castps256_ps128(XMMz),
+                      _mm_set1_ps(0.0f));
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
+        XMMz = _mm256_min_ps(_mm256_set1_ps(0.0f),
+               _mm256_sub_ps(_mm256_set1_ps(-1.0f), XMMz));
+    }
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_mul_ps(_mm256_castps256_ps128(XMMz),
+              _mm256_castps256_ps128(XMMz))));
+}
+#elif defined USEAVX512
+inline void L2_MFC::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    if(N->r > 0)
+    {
+        __m128 mask = _mm_cmpgt_ps(_mm512_castps512_ps128(XMMz),
+                      _mm_set1_ps(0.0f));
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
+        XMMz = _mm512_max_ps(_mm512_setzero_ps(),
+               _mm512_sub_ps(_mm512_set1_ps(1.0f), XMMz));
+    }
+    else
+    {
+        __m128 mask = _mm_cmplt_ps(_mm512_castps512_ps128(XMMz),
+                      _mm_set1_ps(0.0f));
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
+        XMMz = _mm512_min_ps(_mm512_setzero_ps(),
+               _mm512_sub_ps(_mm512_set1_ps(-1.0f), XMMz));
+    }
+    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+              _mm_mul_ps(_mm512_castps512_ps128(XMMz),
+              _mm512_castps512_ps128(XMMz))));
+}
+#else
+inline void L2_MFC::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q);
+    if(N->r > 0)
+    {
+        error += z > 0? 1: 0;
+        z = max(0.0f, 1-z);
+    }
+    else
+    {
+        error += z < 0? 1: 0;
+        z = min(0.0f, -1-z);
+    }
+    loss += z*z;
+}
+#endif
+
+class L1_MFC : public MFSolver
+{
+public:
+    L1_MFC(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
+           mf_model &model, mf_parameter param, atomic<bool> &slow_only)
+        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#elif defined USEAVX512
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+#else
+    void prepare_for_sg_update();
+#endif
+};
+
+#if defined USESSE
+inline void L1_MFC::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    if(N->r > 0)
+    {
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_cmpge_ps(XMMz, _mm_set1_ps(0.0f)),
+                   _mm_set1_ps(1.0f))));
+        XMMz = _mm_sub_ps(_mm_set1_ps(1.0f), XMMz);
+        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+                  _mm_max_ps(_mm_set1_ps(0.0f), XMMz)));
+        XMMz = _mm_and_ps(_mm_cmpge_ps(XMMz, _mm_set1_ps(0.0f)),
+               _mm_set1_ps(1.0f));
+    }
+    else
+    {
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
+                   _mm_and_ps(_mm_cmplt_ps(XMMz, _mm_set1_ps(0.0f)),
+                   _mm_set1_ps(1.0f))));
+        XMMz = _mm_add_ps(_mm_set1_ps(1.0f), XMMz);
+        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
+                  _mm_max_ps(_mm_set1_ps(0.0f), XMMz)));
+        XMMz = _mm_and_ps(_mm_cmpge_ps(XMMz, _mm_set1_ps(0.0f)),
+               _mm_set1_ps(-1.0f));
+    }
+}
+#elif defined USEAVX
+inline void L1_MFC::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    if(N->r > 0)
+    {
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(_mm_and_ps(
+                   _mm_cmpge_ps(_mm256_castps256_ps128(XMMz),
+                   _mm_set1_ps(0.0f)), _mm_set1_ps(1.0f))));
+        XMMz = _mm256_sub_ps(_mm256_set1_ps(1.0f), XMMz);
+        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm_max_ps(
+                  _mm_set1_ps(0.0f), _mm256_castps256_ps128(XMMz))));
+        XMMz = _mm256_and_ps(_mm256_cmp_ps(XMMz, _mm256_set1_ps(0.0f),
+               _CMP_GE_OS), _mm256_set1_ps(1.0f));
+    }
+    else
+    {
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(_mm_and_ps(
+                   _mm_cmplt_ps(_mm256_castps256_ps128(XMMz),
+                   _mm_set1_ps(0.0f)), _mm_set1_ps(1.0f))));
+        XMMz = _mm256_add_ps(_mm256_set1_ps(1.0f), XMMz);
+        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm_max_ps(
+                  _mm_set1_ps(0.0f), _mm256_castps256_ps128(XMMz))));
+        XMMz = _mm256_and_ps(_mm256_cmp_ps(XMMz, _mm256_set1_ps(0.0f),
+               _CMP_GE_OS), _mm256_set1_ps(-1.0f));
+    }
+}
+#elif defined USEAVX512
+inline void L1_MFC::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q);
+    if(N->r > 0)
+    {
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(_mm_and_ps(
+                   _mm_cmpge_ps(_mm512_castps512_ps128(XMMz),
+                   _mm_set1_ps(0.0f)), _mm_set1_ps(1.0f))));
+        XMMz = _mm512_sub_ps(_mm512_set1_ps(1.0f), XMMz);
+        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm_max_ps(
+                  _mm_set1_ps(0.0f), _mm512_castps512_ps128(XMMz))));
+        XMMz = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(XMMz,
+               _mm512_setzero_ps(), _CMP_GE_OS), _mm512_set1_ps(1.0f));
+    }
+    else
+    {
+        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(_mm_and_ps(
+                   _mm_cmplt_ps(_mm512_castps512_ps128(XMMz),
+                   _mm_set1_ps(0.0f)), _mm_set1_ps(1.0f))));
+        XMMz = _mm512_add_ps(_mm512_set1_ps(1.0f), XMMz);
+        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm_max_ps(
+                  _mm_set1_ps(0.0f), _mm512_castps512_ps128(XMMz))));
+        XMMz = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(XMMz,
+               _mm512_setzero_ps(), _CMP_GE_OS), _mm512_set1_ps(-1.0f));
+    }
+}
+#else
+inline void L1_MFC::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q);
+    if(N->r > 0)
+    {
+        loss += max(0.0f, 1-z);
+        error += z > 0? 1.0f: 0.0f;
+        z = z > 1? 0.0f: 1.0f;
+    }
+    else
+    {
+        loss += max(0.0f, 1+z);
+        error += z < 0? 1.0f: 0.0f;
+        z = z < -1? 0.0f: -1.0f;
+    }
+}
+#endif
+//--------------------------------------
+//------------One-class MF--------------
+//--------------------------------------
+
+class BPRSolver : public SolverBase
+{
+public:
+    BPRSolver(Scheduler &scheduler, vector<BlockBase*> &blocks,
+              mf_float *PG, mf_float *QG, mf_model &model, mf_parameter param,
+              atomic<bool> &slow_only, bool is_column_oriented)
+        : SolverBase(scheduler, blocks, PG, QG, model, param, slow_only),
+                     is_column_oriented(is_column_oriented) {}
+
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    static void calc_z(__m128 &XMMz, mf_int k,
+                       mf_float *p, mf_float *q, mf_float *w);
+    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
+    void prepare_for_sg_update(
+        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
+                   __m128 XMMlambda_p1, __m128 XMMlambda_q1,
+                   __m128 XMMlambda_p2, __m128 XMMlamdba_q2,
+                   __m128 XMMeta, __m128 XMMrk);
+    void finalize(__m128d XMMloss, __m128d XMMerror);
+#elif defined USEAVX
+    static void calc_z(__m256 &XMMz, mf_int k,
+                       mf_float *p, mf_float *q, mf_float *w);
+    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
+    void prepare_for_sg_update(
+        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
+                   __m256 XMMlambda_p1, __m256 XMMlambda_q1,
+                   __m256 XMMlambda_p2, __m256 XMMlamdba_q2,
+                   __m256 XMMeta, __m256 XMMrk);
+    void finalize(__m128d XMMloss, __m128d XMMerror);
+#elif defined USEAVX512
+    static void calc_z(__m512 &XMMz, mf_int k,
+                       mf_float *p, mf_float *q, mf_float *w);
+    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
+    void prepare_for_sg_update(
+        __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, __m512 XMMz,
+                   __m512 XMMlambda_p1, __m512 XMMlambda_q1,
+                   __m512 XMMlambda_p2, __m512 XMMlamdba_q2,
+                   __m512 XMMeta, __m512 XMMrk);
+    void finalize(__m128d XMMloss, __m128d XMMerror);
+#else
+    static void calc_z(mf_float &z, mf_int k,
+                       mf_float *p, mf_float *q, mf_float *w);
+    void arrange_block();
+    void prepare_for_sg_update();
+    template<bool L1, bool NMF>
+    void sg_update(mf_int d_begin, mf_int d_end, mf_float rk);
+    void finalize();
+#endif
+    void update() { ++pG; ++qG; ++wG; };
+
+    bool is_column_oriented;
+    mf_int bpr_bid;
+    mf_float *w;
+    mf_float *wG;
+};
+
+
+#if defined USESSE
+inline void BPRSolver::calc_z(
+    __m128 &XMMz, mf_int k, mf_float *p, mf_float *q, mf_float *w)
+{
+    XMMz = _mm_setzero_ps();
+    for(mf_int d = 0; d < k; d += 4)
+        XMMz = _mm_add_ps(XMMz, _mm_mul_ps(_mm_load_ps(p+d),
+               _mm_sub_ps(_mm_load_ps(q+d), _mm_load_ps(w+d))));
+    // Bit-wise representation of 177 is {1,0}+{1,1}+{0,0}+{0,1} from
+    // high-bit to low-bit, where "+" means concatenating two arrays.
+    __m128 XMMtmp = _mm_add_ps(XMMz, _mm_shuffle_ps(XMMz, XMMz, 177));
+    // Bit-wise representation of 78 is {0,1}+{0,0}+{1,1}+{1,0} from
+    // high-bit to low-bit, where "+" means concatenating two arrays.
+    XMMz = _mm_add_ps(XMMz, _mm_shuffle_ps(XMMtmp, XMMtmp, 78));
+}
+
+void BPRSolver::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
+{
+    XMMloss = _mm_setzero_pd();
+    XMMerror = _mm_setzero_pd();
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented, worker);
+}
+
+void BPRSolver::finalize(__m128d XMMloss, __m128d XMMerror)
+{
+    _mm_store_sd(&loss, XMMloss);
+    _mm_store_sd(&error, XMMerror);
+    scheduler.put_job(bid, loss, error, worker);
+    scheduler.put_bpr_job(bid, bpr_bid, worker);
+}
+
+template<bool L1, bool NMF>
+inline void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
+                                 __m128 XMMlambda_p1, __m128 XMMlambda_q1,
+                                 __m128 XMMlambda_p2, __m128 XMMlambda_q2,
+                                 __m128 XMMeta, __m128 XMMrk)
+{
+    __m128 XMMpG = _mm_load1_ps(pG);
+    __m128 XMMqG = _mm_load1_ps(qG);
+    __m128 XMMwG = _mm_load1_ps(wG);
+    __m128 XMMeta_p = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMpG));
+    __m128 XMMeta_q = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMqG));
+    __m128 XMMeta_w = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMwG));
+
+    __m128 XMMpG1 = _mm_setzero_ps();
+    __m128 XMMqG1 = _mm_setzero_ps();
+    __m128 XMMwG1 = _mm_setzero_ps();
+
+    for(mf_int d = d_begin; d < d_end; d += 4)
+    {
+        __m128 XMMp = _mm_load_ps(p+d);
+        __m128 XMMq = _mm_load_ps(q+d);
+        __m128 XMMw = _mm_load_ps(w+d);
+
+        __m128 XMMpg = _mm_add_ps(_mm_mul_ps(XMMlambda_p2, XMMp),
+                       _mm_mul_ps(XMMz, _mm_sub_ps(XMMw, XMMq)));
+        __m128 XMMqg = _mm_sub_ps(_mm_mul_ps(XMMlambda_q2, XMMq),
+                       _mm_mul_ps(XMMz, XMMp));
+        __m128 XMMwg = _mm_add_ps(_mm_mul_ps(XMMlambda_q2, XMMw),
+                       _mm_mul_ps(XMMz, XMMp));
+
+        XMMpG1 = _mm_add_ps(XMMpG1, _mm_mul_ps(XMMpg, XMMpg));
+        XMMqG1 = _mm_add_ps(XMMqG1, _mm_mul_ps(XMMqg, XMMqg));
+        XMMwG1 = _mm_add_ps(XMMwG1, _mm_mul_ps(XMMwg, XMMwg));
+
+        XMMp = _mm_sub_ps(XMMp, _mm_mul_ps(XMMeta_p, XMMpg));
+        XMMq = _mm_sub_ps(XMMq, _mm_mul_ps(XMMeta_q, XMMqg));
+        XMMw = _mm_sub_ps(XMMw, _mm_mul_ps(XMMeta_w, XMMwg));
+
+        if(L1)
+        {
+            XMMp = shrink(XMMp, _mm_mul_ps(XMMeta_p, XMMlambda_p1));
+            XMMq = shrink(XMMq, _mm_mul_ps(XMMeta_q, XMMlambda_q1));
+            XMMw = shrink(XMMw, _mm_mul_ps(XMMeta_w, XMMlambda_q1));
+        }
+        if(NMF)
+        {
+            XMMp = _mm_max_ps(XMMp, _mm_setzero_ps());
+            XMMq = _mm_max_ps(XMMq, _mm_setzero_ps());
+            XMMw = _mm_max_ps(XMMw, _mm_setzero_ps());
+        }
+
+        _mm_store_ps(p+d, XMMp);
+        _mm_store_ps(q+d, XMMq);
+        _mm_store_ps(w+d, XMMw);
+    }
+
+    // Update learning rate of latent vector p. Squared derivatives along all
+    // latent dimensions will be computed above. Here their average will be
+    // added into the associated squared-gradient sum.
+    __m128 XMMtmp = _mm_add_ps(XMMpG1, _mm_movehl_ps(XMMpG1, XMMpG1));
+    XMMpG1 = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
+    XMMpG = _mm_add_ps(XMMpG, _mm_mul_ps(XMMpG1, XMMrk));
+    _mm_store_ss(pG, XMMpG);
+
+    // Similar code is used to update learning rate of latent vector q.
+    XMMtmp = _mm_add_ps(XMMqG1, _mm_movehl_ps(XMMqG1, XMMqG1));
+    XMMqG1 = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
+    XMMqG = _mm_add_ps(XMMqG, _mm_mul_ps(XMMqG1, XMMrk));
+    _mm_store_ss(qG, XMMqG);
+
+    // Similar code is used to update learning rate of latent vector w.
+    XMMtmp = _mm_add_ps(XMMwG1, _mm_movehl_ps(XMMwG1, XMMwG1));
+    XMMwG1 = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
+    XMMwG = _mm_add_ps(XMMwG, _mm_mul_ps(XMMwG1, XMMrk));
+    _mm_store_ss(wG, XMMwG);
+}
+
+inline void BPRSolver::prepare_for_sg_update(
+    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q, w);
+    _mm_store_ss(&z, XMMz);
+    z = exp(-z);
+    XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
+    XMMerror = XMMloss;
+    XMMz = _mm_set1_ps(z/(1+z));
+}
+#elif defined USEAVX
+inline void BPRSolver::calc_z(
+    __m256 &XMMz, mf_int k, mf_float *p, mf_float *q, mf_float *w)
+{
+    XMMz = _mm256_setzero_ps();
+    UNROLL_DIM
+    for(mf_int d = 0; d < k; d += 8)
+        XMMz = mul_add(_mm256_load_ps(p+d), _mm256_sub_ps(
+               _mm256_load_ps(q+d), _mm256_load_ps(w+d)), XMMz);
+    XMMz = _mm256_add_ps(XMMz, _mm256_permute2f128_ps(XMMz, XMMz, 0x1));
+    XMMz = _mm256_hadd_ps(XMMz, XMMz);
+    XMMz = _mm256_hadd_ps(XMMz, XMMz);
+}
+
+void BPRSolver::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
+{
+    XMMloss = _mm_setzero_pd();
+    XMMerror = _mm_setzero_pd();
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented, worker);
+}
+
+void BPRSolver::finalize(__m128d XMMloss, __m128d XMMerror)
+{
+    _mm_store_sd(&loss, XMMloss);
+    _mm_store_sd(&error, XMMerror);
+    scheduler.put_job(bid, loss, error, worker);
+    scheduler.put_bpr_job(bid, bpr_bid, worker);
+}
+
+template<bool L1, bool NMF>
+RECO_INLINE
+void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
+                                 __m256 XMMlambda_p1, __m256 XMMlambda_q1,
+                                 __m256 XMMlambda_p2, __m256 XMMlambda_q2,
+                                 __m256 XMMeta, __m256 XMMrk)
+{
+    __m256 XMMpG = _mm256_broadcast_ss(pG);
+    __m256 XMMqG = _mm256_broadcast_ss(qG);
+    __m256 XMMwG = _mm256_broadcast_ss(wG);
+    __m256 XMMeta_p =
+        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMpG));
+    __m256 XMMeta_q =
+        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMqG));
+    __m256 XMMeta_w =
+        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMwG));
+
+    __m256 XMMpG1 = _mm256_setzero_ps();
+    __m256 XMMqG1 = _mm256_setzero_ps();
+    __m256 XMMwG1 = _mm256_setzero_ps();
+
+    UNROLL_DIM
+    for(mf_int d = d_begin; d < d_end; d += 8)
+    {
+        __m256 XMMp = _mm256_load_ps(p+d);
+        __m256 XMMq = _mm256_load_ps(q+d);
+        __m256 XMMw = _mm256_load_ps(w+d);
+        __m256 XMMpg = mul_add(XMMz, _mm256_sub_ps(XMMw, XMMq),
+                       _mm256_mul_ps(XMMlambda_p2, XMMp));
+        __m256 XMMqg = neg_mul_add(XMMz, XMMp,
+                       _mm256_mul_ps(XMMlambda_q2, XMMq));
+        __m256 XMMwg = mul_add(XMMz, XMMp,
+                       _mm256_mul_ps(XMMlambda_q2, XMMw));
+
+        XMMpG1 = mul_add(XMMpg, XMMpg, XMMpG1);
+        XMMqG1 = mul_add(XMMqg, XMMqg, XMMqG1);
+        XMMwG1 = mul_add(XMMwg, XMMwg, XMMwG1);
+
+        XMMp = neg_mul_add(XMMeta_p, XMMpg, XMMp);
+        XMMq = neg_mul_add(XMMeta_q, XMMqg, XMMq);
+        XMMw = neg_mul_add(XMMeta_w, XMMwg, XMMw);
+
+        if(L1)
+        {
+            XMMp = shrink(XMMp, _mm256_mul_ps(XMMeta_p, XMMlambda_p1));
+            XMMq = shrink(XMMq, _mm256_mul_ps(XMMeta_q, XMMlambda_q1));
+            XMMw = shrink(XMMw, _mm256_mul_ps(XMMeta_w, XMMlambda_q1));
+        }
+        if(NMF)
+        {
+            XMMp = _mm256_max_ps(XMMp, _mm256_setzero_ps());
+            XMMq = _mm256_max_ps(XMMq, _mm256_setzero_ps());
+            XMMw = _mm256_max_ps(XMMw, _mm256_setzero_ps());
+        }
+
+        _mm256_store_ps(p+d, XMMp);
+        _mm256_store_ps(q+d, XMMq);
+        _mm256_store_ps(w+d, XMMw);
+    }
+
+    XMMpG1 = _mm256_add_ps(XMMpG1,
+             _mm256_permute2f128_ps(XMMpG1, XMMpG1, 0x1));
+    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
+    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
+
+    XMMqG1 = _mm256_add_ps(XMMqG1,
+             _mm256_permute2f128_ps(XMMqG1, XMMqG1, 0x1));
+    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
+    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
+
+    XMMwG1 = _mm256_add_ps(XMMwG1,
+             _mm256_permute2f128_ps(XMMwG1, XMMwG1, 0x1));
+    XMMwG1 = _mm256_hadd_ps(XMMwG1, XMMwG1);
+    XMMwG1 = _mm256_hadd_ps(XMMwG1, XMMwG1);
+
+    XMMpG = _mm256_add_ps(XMMpG, _mm256_mul_ps(XMMpG1, XMMrk));
+    XMMqG = _mm256_add_ps(XMMqG, _mm256_mul_ps(XMMqG1, XMMrk));
+    XMMwG = _mm256_add_ps(XMMwG, _mm256_mul_ps(XMMwG1, XMMrk));
+
+    _mm_store_ss(pG, _mm256_castps256_ps128(XMMpG));
+    _mm_store_ss(qG, _mm256_castps256_ps128(XMMqG));
+    _mm_store_ss(wG, _mm256_castps256_ps128(XMMwG));
+}
+
+inline void BPRSolver::prepare_for_sg_update(
+    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q, w);
+    _mm_store_ss(&z, _mm256_castps256_ps128(XMMz));
+    z = exp(-z);
+    XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
+    XMMerror = XMMloss;
+    XMMz = _mm256_set1_ps(z/(1+z));
+}
+#elif defined USEAVX512
+inline void BPRSolver::calc_z(
+    __m512 &XMMz, mf_int k, mf_float *p, mf_float *q, mf_float *w)
+{
+    XMMz = _mm512_setzero_ps();
+    UNROLL_DIM
+    for(mf_int d = 0; d < k; d += 16)
+        XMMz = _mm512_fmadd_ps(_mm512_load_ps(p+d), _mm512_sub_ps(
+               _mm512_load_ps(q+d), _mm512_load_ps(w+d)), XMMz);
+    XMMz = _mm512_set1_ps(_mm512_reduce_add_ps(XMMz));
+}
+
+void BPRSolver::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
+{
+    XMMloss = _mm_setzero_pd();
+    XMMerror = _mm_setzero_pd();
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented, worker);
+}
+
+void BPRSolver::finalize(__m128d XMMloss, __m128d XMMerror)
+{
+    _mm_store_sd(&loss, XMMloss);
+    _mm_store_sd(&error, XMMerror);
+    scheduler.put_job(bid, loss, error, worker);
+    scheduler.put_bpr_job(bid, bpr_bid, worker);
+}
+
+template<bool L1, bool NMF>
+RECO_INLINE
+void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, __m512 XMMz,
+                                 __m512 XMMlambda_p1, __m512 XMMlambda_q1,
+                                 __m512 XMMlambda_p2, __m512 XMMlambda_q2,
+                                 __m512 XMMeta, __m512 XMMrk)
+{
+    __m512 XMMpG = _mm512_set1_ps(*pG);
+    __m512 XMMqG = _mm512_set1_ps(*qG);
+    __m512 XMMwG = _mm512_set1_ps(*wG);
+    __m512 XMMeta_p = _mm512_mul_ps(XMMeta, _mm512_rsqrt14_ps(XMMpG));
+    __m512 XMMeta_q = _mm512_mul_ps(XMMeta, _mm512_rsqrt14_ps(XMMqG));
+    __m512 XMMeta_w = _mm512_mul_ps(XMMeta, _mm512_rsqrt14_ps(XMMwG));
+
+    __m512 XMMpG1 = _mm512_setzero_ps();
+    __m512 XMMqG1 = _mm512_setzero_ps();
+    __m512 XMMwG1 = _mm512_setzero_ps();
+
+    __mmask16 mask = first_mask(d_begin, d_end);
+    UNROLL_DIM
+    for(mf_int d = d_begin-d_begin%16; d < d_end; d += 16)
+    {
+        __m512 XMMp = _mm512_maskz_load_ps(mask, p+d);
+        __m512 XMMq = _mm512_maskz_load_ps(mask, q+d);
+        __m512 XMMw = _mm512_maskz_load_ps(mask, w+d);
+        __m512 XMMpg = _mm512_fmadd_ps(XMMz, _mm512_sub_ps(XMMw, XMMq),
+                       _mm512_mul_ps(XMMlambda_p2, XMMp));
+        __m512 XMMqg = _mm512_fnmadd_ps(XMMz, XMMp,
+                       _mm512_mul_ps(XMMlambda_q2, XMMq));
+        __m512 XMMwg = _mm512_fmadd_ps(XMMz, XMMp,
+                       _mm512_mul_ps(XMMlambda_q2, XMMw));
+
+        XMMpG1 = _mm512_fmadd_ps(XMMpg, XMMpg, XMMpG1);
+        XMMqG1 = _mm512_fmadd_ps(XMMqg, XMMqg, XMMqG1);
+        XMMwG1 = _mm512_fmadd_ps(XMMwg, XMMwg, XMMwG1);
+
+        XMMp = _mm512_fnmadd_ps(XMMeta_p, XMMpg, XMMp);
+        XMMq = _mm512_fnmadd_ps(XMMeta_q, XMMqg, XMMq);
+        XMMw = _mm512_fnmadd_ps(XMMeta_w, XMMwg, XMMw);
+
+        if(L1)
+        {
+            XMMp = shrink(XMMp, _mm512_mul_ps(XMMeta_p, XMMlambda_p1));
+            XMMq = shrink(XMMq, _mm512_mul_ps(XMMeta_q, XMMlambda_q1));
+            XMMw = shrink(XMMw, _mm512_mul_ps(XMMeta_w, XMMlambda_q1));
+        }
+        if(NMF)
+        {
+            XMMp = _mm512_max_ps(XMMp, _mm512_setzero_ps());
+            XMMq = _mm512_max_ps(XMMq, _mm512_setzero_ps());
+            XMMw = _mm512_max_ps(XMMw, _mm512_setzero_ps());
+        }
+
+        _mm512_mask_store_ps(p+d, mask, XMMp);
+        _mm512_mask_store_ps(q+d, mask, XMMq);
+        _mm512_mask_store_ps(w+d, mask, XMMw);
+        mask = 0xFFFF;
+    }
+
+    XMMpG = _mm512_fmadd_ps(_mm512_set1_ps(_mm512_reduce_add_ps(XMMpG1)),
+                            XMMrk, XMMpG);
+    XMMqG = _mm512_fmadd_ps(_mm512_set1_ps(_mm512_reduce_add_ps(XMMqG1)),
+                            XMMrk, XMMqG);
+    XMMwG = _mm512_fmadd_ps(_mm512_set1_ps(_mm512_reduce_add_ps(XMMwG1)),
+                            XMMrk, XMMwG);
+
+    *pG = first_lane(XMMpG);
+    *qG = first_lane(XMMqG);
+    *wG = first_lane(XMMwG);
+}
+
+inline void BPRSolver::prepare_for_sg_update(
+    __m512 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+{
+    calc_z(XMMz, dim(), p, q, w);
+    z = first_lane(XMMz);
+    z = exp(-z);
+    XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
+    XMMerror = XMMloss;
+    XMMz = _mm512_set1_ps(z/(1+z));
+}
+#else
+inline void BPRSolver::calc_z(
+    mf_float &z, mf_int k, mf_float *p, mf_float *q, mf_float *w)
+{
+    z = 0;
+    for(mf_int d = 0; d < k; ++d)
+        z += p[d]*(q[d]-w[d]);
+}
+
+void BPRSolver::arrange_block()
+{
+    loss = 0.0;
+    error = 0.0;
+    bid = scheduler.get_job(worker);
+    block = blocks[bid];
+    if(worker.timed)
+        worker.stats->ratings += block->get_nnz();
+    block->reload();
+    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented, worker);
+}
+
+void BPRSolver::finalize()
+{
+    scheduler.put_job(bid, loss, error, worker);
+    scheduler.put_bpr_job(bid, bpr_bid, worker);
+}
+
+template<bool L1, bool NMF>
+inline void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, mf_float rk)
+{
+    mf_float eta_p = param.eta*qrsqrt(*pG);
+    mf_float eta_q = param.eta*qrsqrt(*qG);
+    mf_float eta_w = param.eta*qrsqrt(*wG);
+
+    mf_float pG1 = 0;
+    mf_float qG1 = 0;
+    mf_float wG1 = 0;
+
+    for(mf_int d = d_begin; d < d_end; ++d)
+    {
+        mf_float gp = z*(w[d]-q[d]) + lambda_p2*p[d];
+        mf_float gq = -z*p[d] + lambda_q2*q[d];
+        mf_float gw = z*p[d] + lambda_q2*w[d];
+
+        pG1 += gp*gp;
+        qG1 += gq*gq;
+        wG1 += gw*gw;
+
+        mf_float p1 = p[d]-eta_p*gp;
+        mf_float q1 = q[d]-eta_q*gq;
+        mf_float w1 = w[d]-eta_w*gw;
+        if(L1)
+        {
+            p1 = shrink(p1, lambda_p1*eta_p);
+            q1 = shrink(q1, lambda_q1*eta_q);
+            w1 = shrink(w1, lambda_q1*eta_w);
+        }
+        if(NMF)
+        {
+            p1 = max(p1, (mf_float)0.0);
+            q1 = max(q1, (mf_float)0.0);
+            w1 = max(w1, (mf_float)0.0);
+        }
+        p[d] = p1;
+        q[d] = q1;
+        w[d] = w1;
+    }
+
+    *pG += pG1*rk;
+    *qG += qG1*rk;
+    *wG += wG1*rk;
+}
+
+inline void BPRSolver::prepare_for_sg_update()
+{
+    calc_z(z, dim(), p, q, w);
+    z = exp(-z);
+    loss += log(1+z);
+    error = loss;
+    z = z/(1+z);
+}
+#endif
+
+class COL_BPR_MFOC : public BPRSolver
+{
+public:
+    COL_BPR_MFOC(Scheduler &scheduler, vector<BlockBase*> &blocks,
+                 mf_float *PG, mf_float *QG, mf_model &model,
+                 mf_parameter param, atomic<bool> &slow_only,
+                 bool is_column_oriented=true)
+        : BPRSolver(scheduler, blocks, PG, QG, model, param,
+                    slow_only, is_column_oriented) {}
+protected:
+    friend class SolverBase;
+#if defined USESSE
+    void load_fixed_variables(
+        __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
+        __m128 &XMMlambda_p2, __m128 &XMMlabmda_q2,
+        __m128 &XMMeta, __m128 &XMMrk_slow,
+        __m128 &XMMrk_fast);
+#elif defined USEAVX
+    void load_fixed_variables(
+        __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
+        __m256 &XMMlambda_p2, __m256 &XMMlabmda_q2,
+        __m256 &XMMeta, __m256 &XMMrk_slow,
+        __m256 &XMMrk_fast);
+#elif defined USEAVX512
+    void load_fixed_variables(
+        __m512 &XMMlambda_p1, __m512 &XMMlambda_q1,
+        __m512 &XMMlambda_p2, __m512 &XMMlabmda_q2,
+        __m512 &XMMeta, __m512 &XMMrk_slow,
+        __m512 &XMMrk_fast);
+#else
+    void load_fixed_variables();
+#endif
+    void prepare_negative();
+};
+
+void COL_BPR_MFOC::prepare_negative()
+{
+    mf_int negative = scheduler.get_negative(bid, bpr_bid, model.m, model.n,
+                                             is_column_oriented, worker);
+    w = model.P + negative*dim();
+    wG = PG + negative*2;
+    swap(p, q);
+    swap(pG, qG);
+}
+
+#if defined USESSE
+void COL_BPR_MFOC::load_fixed_variables(
+    __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
+    __m128 &XMMlambda_p2, __m128 &XMMlambda_q2,
+    __m128 &XMMeta, __m128 &XMMrk_slow,
+    __m128 &XMMrk_fast)
+{
+    XMMlambda_p1 = _mm_set1_ps(param.lambda_q1);
+    XMMlambda_q1 = _mm_set1_ps(param.lambda_p1);
+    XMMlambda_p2 = _mm_set1_ps(param.lambda_q2);
+    XMMlambda_q2 = _mm_set1_ps(param.lambda_p2);
+    XMMeta = _mm_set1_ps(param.eta);
+    XMMrk_slow = _mm_set1_ps((mf_float)1.0/kSLOW);
+    XMMrk_fast = _mm_set1_ps((mf_float)1.0/fast_dim());
+}
+#elif defined USEAVX
+void COL_BPR_MFOC::load_fixed_variables(
+    __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
+    __m256 &XMMlambda_p2, __m256 &XMMlambda_q2,
+    __m256 &XMMeta, __m256 &XMMrk_slow,
+    __m256 &XMMrk_fast)
+{
+    XMMlambda_p1 = _mm256_set1_ps(param.lambda_q1);
+    XMMlambda_q1 = _mm256_set1_ps(param.lambda_p1);
+    XMMlambda_p2 = _mm256_set1_ps(param.lambda_q2);
+    XMMlambda_q2 = _mm256_set1_ps(param.lambda_p2);
+    XMMeta = _mm256_set1_ps(param.eta);
+    XMMrk_slow = _mm256_set1_ps((mf_float)1.0/kSLOW);
+    XMMrk_fast = _mm256_set1_ps((mf_float)1.0/fast_dim());
+}
+#elif defined USEAVX512
+void COL_BPR_MFOC::load_fixed_variables(
+    __m512 &XMMlambda_p1, __m512 &XMMlambda_q1,
+    __m512 &XMMlambda_p2, __m512 &XMMlambda_q2,
+    __m512 &XMMeta, __m512 &XMMrk_slow,
+    __m512 &XMMrk_fast)
+{
+    XMMlambda_p1 = _mm512_set1_ps(param.lambda_q1);
+    XMMlambda_q1 = _mm512_set1_ps(param.lambda_p1);
+    XMMlambda_p2 = _mm512_set1_ps(param.lambda_q2);
+    XMMlambda_q2 = _mm512_set1_ps(param.lambda_p2);
+    XMMeta = _mm512_set1_ps(param.eta);
+    XMMrk_slow = _mm512_set1_ps((mf_float)1.0/kSLOW);
+    XMMrk_fast = _mm512_set1_ps((mf_float)1.0/fast_dim());
+}
+#else
+void COL_BPR_MFOC::load_fixed_variables()
+{
+    lambda_p1 = param.lambda_q1;
+    lambda_q1 = param.lambda_p1;
+    lambda_p2 = param.lambda_q2;
+    lambda_q2 = param.lambda_p2;
+    rk_slow = (mf_float)1.0/kSLOW;
+    rk_fast = (mf_float)1.0/fast_dim();
+}
+#endif
+
+class ROW_BPR_MFOC : public BPRSolver
+{
+public:
+    ROW_BPR_MFOC(Scheduler &scheduler, vector<BlockBase*> &blocks,
+                 mf_float *PG, mf_float *QG, mf_model &model,
+                 mf_parameter param, atomic<bool> &slow_only,
+                 bool is_column_oriented = false)
+        : BPRSolver(scheduler, blocks, PG, QG, model, param,
+                    slow_only, is_column_oriented) {}
+protected:
+    friend class SolverBase;
+    void prepare_negative();
+};
+
+void ROW_BPR_MFOC::prepare_negative()
+{
+    mf_int negative = scheduler.get_negative(bid, bpr_bid, model.m, model.n,
+                                             is_column_oriented, worker);
+    w = model.Q + negative*dim();
+    wG = QG + negative*2;
+}
+
+// The solver S with the training loop for the regularization and the
+// constraints in param, so that run() makes no indirect calls and does not
+// check them for each rating
+template<typename S, bool L1, bool NMF>
+class Kernel final : public S
+{
+public:
+    using S::S;
+    void run() override { this->template loop<S, L1, NMF>(); }
+};
+
+template<typename S>
+shared_ptr<Solver> make_kernel(
+    Scheduler &scheduler,
+    vector<BlockBase*> &blocks,
+    mf_float *PG,
+    mf_float *QG,
+    mf_model &model,
+    mf_parameter param,
+    atomic<bool> &slow_only)
+{
+    bool l1 = param.lambda_p1 > 0 || param.lambda_q1 > 0;
+    if(l1 && param.do_nmf)
+        return shared_ptr<Solver>(new Kernel<S, true, true>(scheduler,
+                    blocks, PG, QG, model, param, slow_only));
+    if(l1)
+        return shared_ptr<Solver>(new Kernel<S, true, false>(scheduler,
+                    blocks, PG, QG, model, param, slow_only));
+    if(param.do_nmf)
+        return shared_ptr<Solver>(new Kernel<S, false, true>(scheduler,
+                    blocks, PG, QG, model, param, slow_only));
+    return shared_ptr<Solver>(new Kernel<S, false, false>(scheduler,
+                blocks, PG, QG, model, param, slow_only));
+}
+
+// The solver of param.fun
+shared_ptr<Solver> make_solver(
+    Scheduler &scheduler,
+    vector<BlockBase*> &blocks,
+    mf_float *PG,
+    mf_float *QG,
+    mf_model &model,
+    mf_parameter param,
+    atomic<bool> &slow_only)
+{
+    switch(param.fun)
+    {
+        case P_L2_MFR:
+            return make_kernel<L2_MFR>(scheduler, blocks, PG, QG,
+                                       model, param, slow_only);
+        case P_L1_MFR:
+            return make_kernel<L1_MFR>(scheduler, blocks, PG, QG,
+                                       model, param, slow_only);
+        case P_KL_MFR:
+            return make_kernel<KL_MFR>(scheduler, blocks, PG, QG,
+                                       model, param, slow_only);
+        case P_LR_MFC:
+            return make_kernel<LR_MFC>(scheduler, blocks, PG, QG,
+                                       model, param, slow_only);
+        case P_L2_MFC:
+            return make_kernel<L2_MFC>(scheduler, blocks, PG, QG,
+                                       model, param, slow_only);
+        case P_L1_MFC:
+            return make_kernel<L1_MFC>(scheduler, blocks, PG, QG,
+                                       model, param, slow_only);
+        case P_ROW_BPR_MFOC:
+            return make_kernel<ROW_BPR_MFOC>(scheduler, blocks, PG, QG,
+                                             model, param, slow_only);
+        case P_COL_BPR_MFOC:
+            return make_kernel<COL_BPR_MFOC>(scheduler, blocks, PG, QG,
+                                             model, param, slow_only);
+        default:
+            throw invalid_argument("unknown error function");
+    }
+}
+
+#if !defined RECO_DIM
+// Utility::inner_product() with the kernels of this instruction set
+mf_float inner_product(mf_float *p, mf_float *q, mf_int k)
+{
+#if defined USESSE
+    __m128 XMM = _mm_setzero_ps();
+    for(mf_int d = 0; d < k; d += 4)
+        XMM = _mm_add_ps(XMM, _mm_mul_ps(
+                  _mm_load_ps(p+d), _mm_load_ps(q+d)));
+    __m128 XMMtmp = _mm_add_ps(XMM, _mm_movehl_ps(XMM, XMM));
+    XMM = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
+    mf_float product;
+    _mm_store_ss(&product, XMM);
+    return product;
+#elif defined USEAVX
+    __m256 XMM = _mm256_setzero_ps();
+    for(mf_int d = 0; d < k; d += 8)
+        XMM = mul_add(_mm256_load_ps(p+d), _mm256_load_ps(q+d), XMM);
+    XMM = _mm256_add_ps(XMM, _mm256_permute2f128_ps(XMM, XMM, 1));
+    XMM = _mm256_hadd_ps(XMM, XMM);
+    XMM = _mm256_hadd_ps(XMM, XMM);
+    mf_float product;
+    _mm_store_ss(&product, _mm256_castps256_ps128(XMM));
+    return product;
+#elif defined USEAVX512
+    // The model may be padded for the narrower kernels, so the rows are
+    // only aligned for 8 floats, and the last 8 factors may be masked
+    __m512 XMM = _mm512_setzero_ps();
+    mf_int d = 0;
+    for(; d+16 <= k; d += 16)
+        XMM = _mm512_fmadd_ps(_mm512_loadu_ps(p+d), _mm512_loadu_ps(q+d), XMM);
+    if(d < k)
+    {
+        __mmask16 mask = (__mmask16)((1 << (k-d)) - 1);
+        XMM = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, p+d),
+                              _mm512_maskz_loadu_ps(mask, q+d), XMM);
+    }
+    return _mm512_reduce_add_ps(XMM);
+#else
+    return std::inner_product(p, p+k, q, (mf_float)0.0);
+#endif
+}
+#endif
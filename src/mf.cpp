@@ -1,6 +1,9 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -21,16 +24,58 @@
 #include <Rcpp.h>
 // Additional helper functions
 #include "reco-utils.h"
+#include "reco-io.h"
+#include "reco-sysinfo.h"
+#include "reco-pool.h"
 
 #include "mf.h"
 
-#if defined USESSE
-#include <pmmintrin.h>
+// The solver kernels of x86 instruction sets are compiled with the target
+// pragmas of GCC and Clang, and the one used is chosen at run time. Windows
+// builds leave out the AVX ones, since GCC does not align 32-byte vectors
+// on the stack there
+#undef USESSE
+#undef USEAVX
+#if defined __x86_64__ || defined __i386__
+#if defined __clang__
+#if __has_extension(pragma_clang_attribute)
+#define RECO_SIMD_X86
+#endif
+#elif defined __GNUC__ && __GNUC__ >= 5
+#define RECO_SIMD_X86
+#endif
 #endif
 
-#if defined USEAVX
+#if defined RECO_SIMD_X86
+// GCC 12 warns about the uninitialized vectors that some of the AVX-512
+// intrinsics start from
+#if defined __GNUC__ && !defined __clang__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#else
 #include <immintrin.h>
 #endif
+// The AVX kernels inline sg_update() into the training loop, and the ones
+// for fixed values of k unroll the loops over the factors
+#define RECO_INLINE inline __attribute__((always_inline))
+#if defined __clang__
+#define RECO_UNROLL _Pragma("unroll")
+#elif __GNUC__ >= 8
+#define RECO_UNROLL _Pragma("GCC unroll 16")
+#else
+#define RECO_UNROLL
+#endif
+#if !defined _WIN32
+#define RECO_SIMD_AVX
+// The AVX-512 kernels need the intrinsics of GCC 7
+#if defined __clang__ || __GNUC__ >= 7
+#define RECO_SIMD_AVX512
+#endif
+#endif
+#endif
 
 // _OPENMP will be defined if OpenMP is enabled,
 // so we can detect this automatically
@@ -53,42 +98,140 @@ using Rcpp::Rcout;
 namespace // unnamed namespace
 {
 
-mf_int const kALIGNByte = 32;
-mf_int const kALIGN = kALIGNByte/sizeof(mf_float);
+// The model is aligned for the widest vectors, and its rows are padded to a
+// multiple of kALIGN factors, the width of the vectors of the kernels but
+// at least 8. The first kSLOW factors are the slow part of the solvers for
+// every padding
+mf_int const kALIGNByte = 64;
+mf_int const kALIGN = 8;
+mf_int const kSLOW = 8;
 
 //--------------------------------------
 //---------Scheduler of Blocks----------
 //--------------------------------------
 
+// The part of a solver thread that the scheduler works with: the random
+// number generator of the thread, and its counters in each iteration if
+// they are collected
+class Worker
+{
+public:
+    typedef chrono::steady_clock clock;
+
+    Worker(uint64_t seed, mf_int nr_iters, bool timed)
+        : rng(seed), node(-1), last_block(-1), timed(timed),
+          iters(timed ? nr_iters : 0), stats(nullptr), pending_lock_time(0)
+    {
+        for(mf_int i = 0; i < (mf_int)iters.size(); ++i)
+        {
+            iters[i] = mf_thread_stats();
+            iters[i].iter = i;
+        }
+    }
+
+    // Called when a block is taken in the given iteration. Jobs taken after
+    // the last iteration in the asynchronous mode count towards it
+    void begin_block(mf_int iter, clock::time_point search_start)
+    {
+        iter = max(min(iter, (mf_int)iters.size()-1), 0);
+        stats = &iters[iter];
+        block_start = clock::now();
+        stats->blocks += 1;
+        stats->schedule_time += seconds(search_start, block_start);
+        stats->lock_time += pending_lock_time;
+        pending_lock_time = 0;
+    }
+
+    void end_block()
+    {
+        stats->compute_time += seconds(block_start, clock::now());
+    }
+
+    static mf_double seconds(clock::time_point start, clock::time_point end)
+    {
+        return chrono::duration<mf_double>(end-start).count();
+    }
+
+    Reco::Rng rng;
+    // NUMA node of the thread, or -1 if it has no preference for blocks
+    mf_int node;
+    // The block the thread worked on last, or -1 before the first one
+    mf_int last_block;
+    bool timed;
+    vector<mf_thread_stats> iters;
+    // Counters of the iteration in which the held block was taken
+    mf_thread_stats *stats;
+    clock::time_point block_start;
+    // Lock waits are added to the counters of the next block
+    mf_double pending_lock_time;
+};
+
 class Scheduler
 {
 public:
-    Scheduler(mf_int nr_bins, mf_int nr_threads, vector<mf_int> cv_blocks);
-    mf_int get_job();
-    mf_int get_bpr_job(mf_int first_block, bool is_column_oriented);
-    void put_job(mf_int block, mf_double loss, mf_double error);
-    void put_bpr_job(mf_int first_block, mf_int second_block);
+    Scheduler(mf_int nr_bins, mf_int nr_threads, vector<mf_int> cv_blocks,
+              bool lock_free = false, bool async = false,
+              bool locality = false);
+    // The workers belong to the calling solver threads
+    mf_int get_job(Worker &worker);
+    mf_int get_bpr_job(mf_int first_block, bool is_column_oriented,
+                       Worker &worker);
+    void put_job(mf_int block, mf_double loss, mf_double error,
+                 Worker &worker);
+    void put_bpr_job(mf_int first_block, mf_int second_block, Worker &worker);
     mf_double get_loss();
     mf_double get_error();
     mf_int get_negative(mf_int first_block, mf_int second_block,
-                        mf_int m, mf_int n, bool is_column_oriented);
+                        mf_int m, mf_int n, bool is_column_oriented,
+                        Worker &worker);
+    // Threads prefer the blocks on their NUMA nodes if there are several
+    void set_nr_nodes(mf_int nr_nodes) { this->nr_nodes = nr_nodes; }
+    // In the asynchronous mode, threads take no more blocks once the jobs
+    // of nr_iters epochs are done
+    void set_nr_iters(mf_int nr_iters)
+    {
+        max_jobs = nr_iters*nr_bins*nr_bins;
+    }
     void wait_for_jobs_done();
     void resume();
     void terminate();
     bool is_terminated();
 
 private:
+    mf_int find_job(Worker &worker);
+    mf_int get_job_lock_free(Worker &worker);
+    void put_job_lock_free(mf_int block, mf_double loss, mf_double error,
+                           Worker &worker);
+    void pause(Worker &worker);
+    void acquire(unique_lock<mutex> &lock, Worker &worker);
+    mf_int current_iter();
+    mf_int job_limit();
+    bool is_local(mf_int block, Worker const &worker) const;
+    bool is_reused(mf_int block, Worker const &worker) const;
+    template<typename Func>
+    mf_int find_neighbour(Worker &worker, Func cost, mf_float &best_cost);
+
     mf_int nr_bins;
     mf_int nr_threads;
-    mf_int nr_done_jobs;
-    mf_int target;
+    mf_int nr_nodes;
+    atomic<mf_int> nr_done_jobs;
+    atomic<mf_int> target;
+    mf_int max_jobs;
     mf_int nr_paused_threads;
-    bool terminated;
+    atomic<bool> terminated;
+    bool lock_free;
+    // In the asynchronous mode, threads do not wait for each other at the
+    // end of an epoch, and the main thread reads the statistics while the
+    // next epoch runs. The threads can be at most one epoch ahead of it
+    bool async;
+    // Threads prefer blocks that share a row or a column with their
+    // previous blocks, as long as the blocks have no more updates
+    bool locality;
     vector<mf_int> counts;
     vector<mf_int> busy_p_blocks;
     vector<mf_int> busy_q_blocks;
-    vector<mf_double> block_losses;
-    vector<mf_double> block_errors;
+    vector<atomic<mf_double>> block_losses;
+    vector<atomic<mf_double>> block_errors;
     // vector<minstd_rand0> block_generators;
     unordered_set<mf_int> cv_blocks;
     mutex mtx;
@@ -98,22 +241,39 @@ private:
     priority_queue<pair<mf_float, mf_int>,
                    vector<pair<mf_float, mf_int>>,
                    greater<pair<mf_float, mf_int>>> pq;
+    // Priority of the entry of each block in pq. A block taken without
+    // popping its entry gets -1, and the entry is dropped when popped
+    vector<mf_float> priorities;
+
+    // The lock-free mode does not use mtx and pq while an epoch runs. A
+    // block is taken by setting the busy flags of its row and its column,
+    // and block_counts replaces the priorities of pq
+    unique_ptr<atomic<mf_int>[]> busy_rows;
+    unique_ptr<atomic<mf_int>[]> busy_cols;
+    unique_ptr<atomic<mf_int>[]> block_counts;
+    vector<char> is_cv_block;
 };
 
 Scheduler::Scheduler(mf_int nr_bins, mf_int nr_threads,
-    vector<mf_int> cv_blocks)
+    vector<mf_int> cv_blocks, bool lock_free, bool async, bool locality)
     : nr_bins(nr_bins),
       nr_threads(nr_threads),
+      nr_nodes(1),
       nr_done_jobs(0),
       target(nr_bins*nr_bins),
+      max_jobs(numeric_limits<mf_int>::max()),
       nr_paused_threads(0),
       terminated(false),
+      lock_free(lock_free),
+      async(async),
+      locality(locality),
       counts(nr_bins*nr_bins, 0),
       busy_p_blocks(nr_bins, 0),
       busy_q_blocks(nr_bins, 0),
-      block_losses(nr_bins*nr_bins, 0),
-      block_errors(nr_bins*nr_bins, 0),
-      cv_blocks(cv_blocks.begin(), cv_blocks.end())// ,
+      block_losses(nr_bins*nr_bins),
+      block_errors(nr_bins*nr_bins),
+      cv_blocks(cv_blocks.begin(), cv_blocks.end()),
+      priorities(nr_bins*nr_bins, -1)// ,
       // distribution(0.0, 1.0)
 {
     for(mf_int i = 0; i < nr_bins*nr_bins; ++i)
@@ -125,40 +285,324 @@ Scheduler::Scheduler(mf_int nr_bins, mf_int nr_threads,
         // The constructor of Scheduler will be executed by the master thread,
         // so we can call R RNG safely.
         if(this->cv_blocks.find(i) == this->cv_blocks.end())
-            pq.emplace(mf_float(R::unif_rand()), i);
+        {
+            priorities[i] = mf_float(R::unif_rand());
+            pq.emplace(priorities[i], i);
+        }
+    }
+
+    if(lock_free)
+    {
+        busy_rows.reset(new atomic<mf_int>[nr_bins]);
+        busy_cols.reset(new atomic<mf_int>[nr_bins]);
+        block_counts.reset(new atomic<mf_int>[nr_bins*nr_bins]);
+        for(mf_int i = 0; i < nr_bins; ++i)
+        {
+            busy_rows[i] = 0;
+            busy_cols[i] = 0;
+        }
+        for(mf_int i = 0; i < nr_bins*nr_bins; ++i)
+            block_counts[i] = 0;
+
+        is_cv_block.assign(nr_bins*nr_bins, 0);
+        for(auto block : this->cv_blocks)
+            is_cv_block[block] = 1;
+    }
+}
+
+mf_int Scheduler::get_job_lock_free(Worker &worker)
+{
+    while(true)
+    {
+        // The candidates lie on a wrapped diagonal starting from a random
+        // block, so they cover every row and every column once. The free
+        // candidate with the fewest updates is taken, which approximates
+        // the priority queue of the locked mode. A block on another NUMA node
+        // counts as if it had one more update
+        mf_int start = (mf_int)(worker.rng.next()%(uint64_t)(nr_bins*nr_bins));
+        mf_int p_start = start/nr_bins;
+        mf_int q_start = start%nr_bins;
+        mf_int best = -1;
+        mf_int best_count = numeric_limits<mf_int>::max();
+        for(mf_int i = 0; i < nr_bins; ++i)
+        {
+            mf_int p_block = (p_start+i)%nr_bins;
+            mf_int q_block = (q_start+i)%nr_bins;
+            mf_int block = p_block*nr_bins+q_block;
+            if(is_cv_block[block] ||
+               busy_rows[p_block].load(memory_order_relaxed) ||
+               busy_cols[q_block].load(memory_order_relaxed))
+                continue;
+            mf_int count = block_counts[block].load(memory_order_relaxed)+
+                           (is_local(block, worker) ? 0 : 1);
+            if(count < best_count)
+            {
+                best = block;
+                best_count = count;
+            }
+        }
+
+        // A free neighbour of the previous block of the thread replaces the
+        // candidate if it has no more updates
+        mf_float neighbour_count = 0;
+        mf_int neighbour = find_neighbour(worker, [&] (mf_int block)
+        {
+            if(is_cv_block[block] ||
+               busy_rows[block/nr_bins].load(memory_order_relaxed) ||
+               busy_cols[block%nr_bins].load(memory_order_relaxed))
+                return (mf_float)-1;
+            return (mf_float)(block_counts[block].load(memory_order_relaxed)+
+                              (is_local(block, worker) ? 0 : 1));
+        }, neighbour_count);
+        if(neighbour >= 0 && (best < 0 || neighbour_count <= best_count))
+            best = neighbour;
+
+        if(best < 0)
+        {
+            this_thread::yield();
+            continue;
+        }
+
+        // Another thread may take the row or the column first, in which
+        // case the search starts again
+        mf_int p_block = best/nr_bins;
+        mf_int q_block = best%nr_bins;
+        mf_int expected = 0;
+        if(!busy_rows[p_block].compare_exchange_strong(
+                expected, 1, memory_order_acquire))
+            continue;
+        expected = 0;
+        if(!busy_cols[q_block].compare_exchange_strong(
+                expected, 1, memory_order_acquire))
+        {
+            busy_rows[p_block].store(0, memory_order_release);
+            continue;
+        }
+        block_counts[best].fetch_add(1, memory_order_relaxed);
+        return best;
+    }
+}
+
+void Scheduler::put_job_lock_free(mf_int block_idx, mf_double loss,
+                                  mf_double error, Worker &worker)
+{
+    block_losses[block_idx] = loss;
+    block_errors[block_idx] = error;
+    busy_cols[block_idx%nr_bins].store(0, memory_order_release);
+    busy_rows[block_idx/nr_bins].store(0, memory_order_release);
+
+    // Only the jobs at the end of an epoch take the lock
+    if(nr_done_jobs.fetch_add(1)+1 < target)
+        return;
+    if(async)
+    {
+        {
+            unique_lock<mutex> lock(mtx, defer_lock);
+            acquire(lock, worker);
+            cond_var.notify_all();
+        }
+        if(nr_done_jobs < job_limit())
+            return;
+    }
+    pause(worker);
+}
+
+void Scheduler::pause(Worker &worker)
+{
+    unique_lock<mutex> lock(mtx, defer_lock);
+    acquire(lock, worker);
+    ++nr_paused_threads;
+    cond_var.notify_all();
+    Worker::clock::time_point start;
+    if(worker.timed)
+        start = Worker::clock::now();
+    cond_var.wait(lock, [&] {
+        return nr_done_jobs < job_limit() || terminated;
+    });
+    if(worker.timed)
+        worker.stats->barrier_time +=
+            Worker::seconds(start, Worker::clock::now());
+    --nr_paused_threads;
+}
+
+// Take mtx, and count the time spent waiting for it
+void Scheduler::acquire(unique_lock<mutex> &lock, Worker &worker)
+{
+    if(!worker.timed)
+    {
+        lock.lock();
+        return;
+    }
+    auto start = Worker::clock::now();
+    lock.lock();
+    worker.pending_lock_time += Worker::seconds(start, Worker::clock::now());
+}
+
+bool Scheduler::is_local(mf_int block, Worker const &worker) const
+{
+    return worker.node < 0 || nr_nodes == 1 ||
+           (block/nr_bins)*nr_nodes/nr_bins == worker.node;
+}
+
+// Whether the block shares a row or a column of the grid with the previous
+// block of the thread, so that the thread reuses a segment of P or Q
+bool Scheduler::is_reused(mf_int block, Worker const &worker) const
+{
+    return worker.last_block >= 0 &&
+           (block/nr_bins == worker.last_block/nr_bins ||
+            block%nr_bins == worker.last_block%nr_bins);
+}
+
+// The other blocks in the row and the column of the previous block of the
+// thread are scanned from a random position, and the one with the lowest
+// cost(block) is returned, or -1 if the locality is not preferred or all
+// of them are busy. cost() is negative for busy blocks
+template<typename Func>
+mf_int Scheduler::find_neighbour(Worker &worker, Func cost,
+                                 mf_float &best_cost)
+{
+    mf_int last = worker.last_block;
+    if(!locality || last < 0)
+        return -1;
+
+    mf_int p_block = last/nr_bins;
+    mf_int q_block = last%nr_bins;
+    mf_int offset = (mf_int)(worker.rng.next()%(uint64_t)nr_bins);
+    mf_int best = -1;
+    for(mf_int i = 0; i < nr_bins; ++i)
+    {
+        mf_int j = (offset+i)%nr_bins;
+        for(mf_int block : {p_block*nr_bins+j, j*nr_bins+q_block})
+        {
+            if(block == last)
+                continue;
+            mf_float c = cost(block);
+            if(c >= 0 && (best < 0 || c < best_cost))
+            {
+                best = block;
+                best_cost = c;
+            }
+        }
     }
+    return best;
+}
+
+// The iteration that the solver threads are working on
+mf_int Scheduler::current_iter()
+{
+    if(async)
+        return nr_done_jobs/(nr_bins*nr_bins);
+    return target/(nr_bins*nr_bins)-1;
+}
+
+// The number of done jobs at which the solver threads wait: the end of the
+// epoch, or the end of the next one in the asynchronous mode, but not after
+// the last epoch
+mf_int Scheduler::job_limit()
+{
+    if(!async)
+        return target;
+    return min(target+nr_bins*nr_bins, max_jobs);
+}
+
+mf_int Scheduler::get_job(Worker &worker)
+{
+    if(!worker.timed)
+        return find_job(worker);
+
+    auto start = Worker::clock::now();
+    mf_int block = find_job(worker);
+    worker.begin_block(current_iter(), start);
+    if(is_reused(block, worker))
+        worker.stats->reused += 1;
+    return block;
 }
 
-mf_int Scheduler::get_job()
+mf_int Scheduler::find_job(Worker &worker)
 {
+    if(lock_free)
+        return get_job_lock_free(worker);
+
     bool is_found = false;
     pair<mf_float, mf_int> block;
 
     while(!is_found)
     {
-        lock_guard<mutex> lock(mtx);
+        unique_lock<mutex> lock(mtx, defer_lock);
+        acquire(lock, worker);
         vector<pair<mf_float, mf_int>> locked_blocks;
         mf_int p_block = 0;
         mf_int q_block = 0;
 
-        while(!pq.empty())
+        auto take = [&] (pair<mf_float, mf_int> const &block1)
+        {
+            busy_p_blocks[block1.second/nr_bins] = 1;
+            busy_q_blocks[block1.second%nr_bins] = 1;
+            counts[block1.second] += 1;
+            block = block1;
+            is_found = true;
+        };
+
+        // A block on another NUMA node counts as if it had one more update,
+        // so a free remote block is only taken if no free block on the node
+        // of the thread has a priority below the remote one plus one
+        bool has_local = false;
+        bool has_remote = false;
+        pair<mf_float, mf_int> local, remote;
+        while(!pq.empty() && !has_local &&
+              (!has_remote || pq.top().first < remote.first+1))
         {
             block = pq.top();
             pq.pop();
 
+            if(block.first != priorities[block.second])
+                continue;
+
             p_block = block.second/nr_bins;
             q_block = block.second%nr_bins;
 
             if(busy_p_blocks[p_block] || busy_q_blocks[q_block])
                 locked_blocks.push_back(block);
+            else if(is_local(block.second, worker))
+            {
+                local = block;
+                has_local = true;
+            }
+            else if(!has_remote)
+            {
+                remote = block;
+                has_remote = true;
+            }
             else
+                locked_blocks.push_back(block);
+        }
+        if(has_local && has_remote)
+            locked_blocks.push_back(remote);
+
+        if(has_local || has_remote)
+        {
+            pair<mf_float, mf_int> best = has_local ? local : remote;
+            mf_float best_cost = best.first+(has_local ? 0 : 1);
+
+            // A neighbour of the previous block is taken instead if it has
+            // no more updates than the best block, counting the remote
+            // penalty. Its entry stays in pq and is dropped later
+            mf_float neighbour_cost = 0;
+            mf_int neighbour = find_neighbour(worker, [&] (mf_int block1)
             {
-                busy_p_blocks[p_block] = 1;
-                busy_q_blocks[q_block] = 1;
-                counts[block.second] += 1;
-                is_found = true;
-                break;
+                if(priorities[block1] < 0 ||
+                   busy_p_blocks[block1/nr_bins] ||
+                   busy_q_blocks[block1%nr_bins])
+                    return (mf_float)-1;
+                return priorities[block1]+(is_local(block1, worker) ? 0 : 1);
+            }, neighbour_cost);
+            if(neighbour >= 0 && floor(neighbour_cost) <= floor(best_cost))
+            {
+                locked_blocks.push_back(best);
+                best = make_pair(priorities[neighbour], neighbour);
+                priorities[neighbour] = -1;
             }
+            take(best);
         }
 
         for(auto &block1 : locked_blocks)
@@ -168,9 +612,11 @@ mf_int Scheduler::get_job()
     return block.second;
 }
 
-mf_int Scheduler::get_bpr_job(mf_int first_block, bool is_column_oriented)
+mf_int Scheduler::get_bpr_job(mf_int first_block, bool is_column_oriented,
+                              Worker &worker)
 {
-    lock_guard<mutex> lock(mtx);
+    unique_lock<mutex> lock(mtx, defer_lock);
+    acquire(lock, worker);
     mf_int another = first_block;
     vector<pair<mf_float, mf_int>> locked_blocks;
 
@@ -179,6 +625,9 @@ mf_int Scheduler::get_bpr_job(mf_int first_block, bool is_column_oriented)
         pair<mf_float, mf_int> block = pq.top();
         pq.pop();
 
+        if(block.first != priorities[block.second])
+            continue;
+
         mf_int p_block = block.second/nr_bins;
         mf_int q_block = block.second%nr_bins;
 
@@ -209,11 +658,23 @@ mf_int Scheduler::get_bpr_job(mf_int first_block, bool is_column_oriented)
     return another;
 }
 
-void Scheduler::put_job(mf_int block_idx, mf_double loss, mf_double error)
+void Scheduler::put_job(mf_int block_idx, mf_double loss, mf_double error,
+                        Worker &worker)
 {
+    if(worker.timed)
+        worker.end_block();
+    worker.last_block = block_idx;
+
+    if(lock_free)
+    {
+        put_job_lock_free(block_idx, loss, error, worker);
+        return;
+    }
+
     // Return the held block to the scheduler
     {
-        lock_guard<mutex> lock(mtx);
+        unique_lock<mutex> lock(mtx, defer_lock);
+        acquire(lock, worker);
         busy_p_blocks[block_idx/nr_bins] = 0;
         busy_q_blocks[block_idx%nr_bins] = 0;
         block_losses[block_idx] = loss;
@@ -221,21 +682,27 @@ void Scheduler::put_job(mf_int block_idx, mf_double loss, mf_double error)
         ++nr_done_jobs;
         mf_float priority =
             // (mf_float)counts[block_idx]+distribution(generator);
-            (mf_float)counts[block_idx]+mf_float(R::unif_rand());
+            (mf_float)counts[block_idx]+mf_float(worker.rng.unif_rand());
+        priorities[block_idx] = priority;
         pq.emplace(priority, block_idx);
-        ++nr_paused_threads;
         // Tell others that a block is available again.
         cond_var.notify_all();
+        if(async && nr_done_jobs < job_limit())
+            return;
+        ++nr_paused_threads;
     }
 
     // Wait if nr_done_jobs (aka the number of processed blocks) is too many
     // because we want to print out the training status roughly once all blocks
     // are processed once. This is the only place that a solver thread should
     // wait for something.
+    Worker::clock::time_point start;
+    if(worker.timed)
+        start = Worker::clock::now();
     {
         unique_lock<mutex> lock(mtx);
         cond_var.wait(lock, [&] {
-            return nr_done_jobs < target;
+            return nr_done_jobs < job_limit() || terminated;
         });
     }
 
@@ -244,20 +711,26 @@ void Scheduler::put_job(mf_int block_idx, mf_double loss, mf_double error)
         lock_guard<mutex> lock(mtx);
         --nr_paused_threads;
     }
+    if(worker.timed)
+        worker.stats->barrier_time +=
+            Worker::seconds(start, Worker::clock::now());
 }
 
-void Scheduler::put_bpr_job(mf_int first_block, mf_int second_block)
+void Scheduler::put_bpr_job(mf_int first_block, mf_int second_block,
+                            Worker &worker)
 {
     if(first_block == second_block)
         return;
 
-    lock_guard<mutex> lock(mtx);
+    unique_lock<mutex> lock(mtx, defer_lock);
+    acquire(lock, worker);
     {
         busy_p_blocks[second_block/nr_bins] = 0;
         busy_q_blocks[second_block%nr_bins] = 0;
         mf_float priority =
             // (mf_float)counts[second_block]+distribution(generator);
-            (mf_float)counts[second_block]+mf_float(R::unif_rand());
+            (mf_float)counts[second_block]+mf_float(worker.rng.unif_rand());
+        priorities[second_block] = priority;
         pq.emplace(priority, second_block);
     }
 }
@@ -275,18 +748,15 @@ mf_double Scheduler::get_error()
 }
 
 mf_int Scheduler::get_negative(mf_int first_block, mf_int second_block,
-        mf_int m, mf_int n, bool is_column_oriented)
+        mf_int m, mf_int n, bool is_column_oriented, Worker &worker)
 {
     // mf_int rand_val = (mf_int)block_generators[first_block]();
 
     // The original code allows this function to be excuted by several threads
-    // simultaneously, which will break R's RNG. We add a lock to make sure
-    // the RNG is single-threaded.
-    mf_int rand_val = RAND_MAX;
-    {
-        lock_guard<mutex> lock(mtx);
-        rand_val = mf_int(R::unif_rand() * RAND_MAX);
-    }
+    // simultaneously, which would break R's RNG. Each thread now uses its
+    // own generator, so no lock is needed. The top 31 bits give a
+    // non-negative value, like rand() on Linux and MacOS
+    mf_int rand_val = mf_int(worker.rng.next()>>33);
 
     auto gen_random = [&] (mf_int block_id)
     {
@@ -328,6 +798,8 @@ void Scheduler::wait_for_jobs_done()
     cond_var.wait(lock, [&] {
         return nr_done_jobs >= target;
     });
+    if(async)
+        return;
 
     // Wait for all threads to stop. Once a thread realizes that all threads
     // have processed enough blocks it should stop. Then, the main thread can
@@ -348,11 +820,11 @@ void Scheduler::terminate()
 {
     lock_guard<mutex> lock(mtx);
     terminated = true;
+    cond_var.notify_all();
 }
 
 bool Scheduler::is_terminated()
 {
-    lock_guard<mutex> lock(mtx);
     return terminated;
 }
 
@@ -365,6 +837,8 @@ class BlockBase
 public:
     virtual bool move_next() { return false; };
     virtual mf_node* get_current() { return nullptr; }
+    // The ratings of the block, which are in one array after reload()
+    virtual mf_node* data() { return nullptr; }
     virtual void reload() {};
     virtual void free() {};
     virtual mf_long get_nnz() { return 0; };
@@ -379,6 +853,7 @@ public:
         : first(first_), last(last_), current(nullptr) {};
     bool move_next() { return ++current != last; }
     mf_node* get_current() { return current; }
+    mf_node* data() { return first; }
     void tie_to(mf_node *first_, mf_node *last_);
     void reload() { current = first-1; };
     mf_long get_nnz() { return last-first; };
@@ -402,6 +877,7 @@ public:
                     source_path(""), buffer(0) {};
     bool move_next() { return ++current < last-first; }
     mf_node* get_current() { return &buffer[static_cast<size_t>(current)]; }
+    mf_node* data() { return buffer.data(); }
     void tie_to(string source_path_, mf_long first_, mf_long last_);
     void reload();
     void free() { buffer.resize(0); };
@@ -434,6 +910,159 @@ void BlockOnDisk::reload()
     current = -1;
 }
 
+//--------------------------------------
+//-------------NUMA Layout--------------
+//--------------------------------------
+
+// Placement of the solver threads and the training data on the NUMA nodes
+// of the machine. Solver thread t runs on node t*nr_nodes/nr_threads, and
+// the blocks in row p of the grid belong to node p*nr_nodes/nr_bins, like
+// the rows of P in bin p. Q and QG are read by all the nodes, and their
+// bins are spread over the nodes in the same way. The layout only has an
+// effect when the threads are pinned on a machine with several nodes
+class NumaLayout
+{
+public:
+    NumaLayout() : nr_threads(1), nr_bins(1), pinned(false) {}
+    NumaLayout(mf_int nr_threads, mf_int nr_bins, bool pin,
+               vector<mf_int> const &bin_p, vector<mf_int> const &bin_q);
+    bool is_active() const { return node_ids.size() > 1; }
+    mf_int get_nr_nodes() const { return max((mf_int)node_ids.size(), 1); }
+    mf_int thread_node(mf_int thread) const
+    {
+        return thread*get_nr_nodes()/nr_threads;
+    }
+    mf_int bin_node(mf_int bin) const { return bin*get_nr_nodes()/nr_bins; }
+    // Bind the calling thread to a CPU of the node of solver thread t, if
+    // the threads are pinned
+    void pin(mf_int thread) const;
+    // Undo pin(), since the threads of the pool run other work later
+    void unpin() const;
+    // Fill the nr_rows rows of P (or Q if is_p is false) with value, where a
+    // row has row_size floats. The rows of each node are written by a thread
+    // on that node, so their pages are placed there when first used
+    void first_touch(mf_float *ptr, mf_long nr_rows, mf_long row_size,
+                     bool is_p, mf_float value) const;
+    // Move the ratings of each row of blocks to its node. They are read
+    // before training, so first touch does not apply to them
+    void move_blocks(vector<mf_node*> const &ptrs) const;
+
+private:
+    template<typename Func>
+    void on_each_node(Func f) const;
+    static vector<mf_long> node_bounds(vector<mf_int> const &bin_map,
+                                       mf_int nr_nodes, mf_int nr_bins);
+
+    mf_int nr_threads;
+    mf_int nr_bins;
+    bool pinned;
+    // Numbers and CPUs of the nodes that have CPUs
+    vector<int> node_ids;
+    vector<vector<int>> node_cpus;
+    // Rows of P and Q of each node. The bins are contiguous, so each node
+    // has a range of rows
+    vector<mf_long> p_bounds;
+    vector<mf_long> q_bounds;
+};
+
+NumaLayout::NumaLayout(mf_int nr_threads, mf_int nr_bins, bool pin,
+                       vector<mf_int> const &bin_p,
+                       vector<mf_int> const &bin_q)
+    : nr_threads(nr_threads), nr_bins(nr_bins), pinned(pin)
+{
+    if(!pin)
+        return;
+    vector<vector<int>> nodes = Reco::numa_nodes();
+    for(mf_int i = 0; i < (mf_int)nodes.size(); ++i)
+    {
+        // More nodes than threads would leave nodes without solvers
+        if(nodes[i].empty() || (mf_int)node_ids.size() == nr_threads)
+            continue;
+        node_ids.push_back(i);
+        node_cpus.push_back(nodes[i]);
+    }
+    if(is_active())
+    {
+        p_bounds = node_bounds(bin_p, get_nr_nodes(), nr_bins);
+        q_bounds = node_bounds(bin_q, get_nr_nodes(), nr_bins);
+    }
+}
+
+vector<mf_long> NumaLayout::node_bounds(vector<mf_int> const &bin_map,
+                                        mf_int nr_nodes, mf_int nr_bins)
+{
+    vector<mf_long> bounds(nr_nodes+1, (mf_long)bin_map.size());
+    bounds[0] = 0;
+    for(mf_int node = 1; node < nr_nodes; ++node)
+    {
+        // The first bin of the node
+        mf_int bin = (mf_int)(((mf_long)node*nr_bins+nr_nodes-1)/nr_nodes);
+        bounds[node] = lower_bound(bin_map.begin(), bin_map.end(), bin)-
+                       bin_map.begin();
+    }
+    return bounds;
+}
+
+void NumaLayout::pin(mf_int thread) const
+{
+    if(!pinned || node_cpus.empty())
+        return;
+    mf_int node = thread_node(thread);
+    // Position of the thread among the threads of its node
+    mf_int first = (mf_int)(((mf_long)node*nr_threads+get_nr_nodes()-1)/
+                            get_nr_nodes());
+    vector<int> const &cpus = node_cpus[node];
+    Reco::pin_thread(cpus[(thread-first)%cpus.size()]);
+}
+
+void NumaLayout::unpin() const
+{
+    if(!pinned || node_cpus.empty())
+        return;
+    Reco::unpin_thread();
+}
+
+template<typename Func>
+void NumaLayout::on_each_node(Func f) const
+{
+    // The calling thread is not pinned, so all the nodes use threads of the
+    // pool
+    Reco::ThreadPool::global().start(get_nr_nodes(), [&] (mf_int node)
+    {
+        Reco::pin_thread(node_cpus[node][0]);
+        f(node);
+        Reco::unpin_thread();
+    }).wait();
+}
+
+void NumaLayout::first_touch(mf_float *ptr, mf_long nr_rows, mf_long row_size,
+                             bool is_p, mf_float value) const
+{
+    if(!is_active())
+    {
+        fill(ptr, ptr+nr_rows*row_size, value);
+        return;
+    }
+    vector<mf_long> const &bounds = is_p ? p_bounds : q_bounds;
+    on_each_node([&] (mf_int node)
+    {
+        fill(ptr+bounds[node]*row_size, ptr+bounds[node+1]*row_size, value);
+    });
+}
+
+void NumaLayout::move_blocks(vector<mf_node*> const &ptrs) const
+{
+    if(!is_active())
+        return;
+    for(mf_int bin = 0; bin < nr_bins; ++bin)
+    {
+        mf_node *first = ptrs[bin*nr_bins];
+        mf_node *last = ptrs[(bin+1)*nr_bins];
+        Reco::move_to_node(first, (last-first)*sizeof(mf_node),
+                           node_ids[bin_node(bin)]);
+    }
+}
+
 //--------------------------------------
 //-------------Miscellaneous------------
 //--------------------------------------
@@ -454,6 +1083,23 @@ struct sort_node_by_q
     }
 };
 
+// Numbers of ratings of users or items, counted by several threads
+class AtomicCounts
+{
+public:
+    AtomicCounts(size_t size) : counts(new atomic<mf_int>[size]()), size(size) {}
+    void add(mf_int i) { counts[i].fetch_add(1, memory_order_relaxed); }
+    void add_to(vector<mf_int> &omega) const
+    {
+        for(size_t i = 0; i < size; ++i)
+            omega[i] += counts[i].load(memory_order_relaxed);
+    }
+
+private:
+    unique_ptr<atomic<mf_int>[]> counts;
+    size_t size;
+};
+
 struct deleter
 {
     void operator() (mf_problem *prob)
@@ -463,21 +1109,130 @@ struct deleter
     }
 };
 
+// A text data file of "u v r" records
+// Plain files are mapped into memory and split into parts by
+// Reco::split_lines(), one part per thread, and compressed files are
+// decompressed on a background thread and parsed as one part
+class TextFile
+{
+public:
+    TextFile() : compressed(false) {}
+
+    // Return false if the file cannot be opened
+    bool open(string const &path, mf_int nr_threads);
+    void close();
+
+    mf_int nr_parts() const { return compressed ? 1 : (mf_int)bounds.size()-1; }
+
+    // A guess of the number of records in a part, or 0 if unknown
+    mf_long size_hint() const;
+
+    // f(states[i], N) is called on every valid record N of part i in file
+    // order, and lines that cannot be parsed are skipped. Each thread works
+    // on a local copy of its state, so that threads do not write to the
+    // same cache lines. The file can be parsed more than once
+    template<typename State, typename Func>
+    void parse(vector<State> &states, Func f);
+
+private:
+    template<typename State, typename Func>
+    static void parse_lines(char const *p, char const *end, State &state, Func &f);
+
+    string path;
+    bool compressed;
+    Reco::MappedFile file;
+    vector<char const*> bounds;
+};
+
+bool TextFile::open(string const &path, mf_int nr_threads)
+{
+    close();
+    this->path = path;
+    compressed = (Reco::DecompressedFile::detect(path) != Reco::DecompressedFile::Plain);
+    if(compressed)
+        return ifstream(path).is_open();
+
+    if(!file.open(path))
+        return false;
+    bounds = Reco::split_lines(file.begin(), file.end(), nr_threads);
+    return true;
+}
+
+void TextFile::close()
+{
+    file.close();
+    bounds.clear();
+}
+
+mf_long TextFile::size_hint() const
+{
+    if(compressed)
+        return 0;
+    return Reco::estimate_lines(file.begin(), file.end())/nr_parts()+1;
+}
+
+template<typename State, typename Func>
+void TextFile::parse_lines(char const *p, char const *end, State &state, Func &f)
+{
+    while(p < end)
+    {
+        char const *line_end = Reco::next_line(p, end);
+        mf_node N;
+        bool status = Reco::parse_int(p, line_end, N.u) &&
+                      Reco::parse_int(p, line_end, N.v) &&
+                      Reco::parse_float(p, line_end, N.r);
+        p = line_end;
+        if(status)
+            f(state, N);
+    }
+}
+
+template<typename State, typename Func>
+void TextFile::parse(vector<State> &states, Func f)
+{
+    if(compressed)
+    {
+        Reco::DecompressedFile stream;
+        if(!stream.open(path))
+            throw runtime_error("cannot open " + path + ": " + stream.error());
+
+        char const *begin, *end;
+        while(stream.next_chunk(begin, end))
+            parse_lines(begin, end, states[0], f);
+        stream.close();
+        if(stream.failed())
+            throw runtime_error("cannot decompress " + path + ": " + stream.error());
+        return;
+    }
+
+    mf_int nr_parts = this->nr_parts();
+
+    Reco::ThreadPool::global().parallel_for(nr_parts, 0, nr_parts, [&] (mf_int i)
+    {
+        State state(move(states[i]));
+        parse_lines(bounds[i], bounds[i+1], state, f);
+        states[i] = move(state);
+    });
+}
+
 
 class Utility
 {
 public:
-    Utility(mf_int f, mf_int n) : fun(f), nr_threads(n) {};
+    Utility(mf_int f, mf_int n)
+        : fun(f), nr_threads(n), pool(Reco::ThreadPool::global()) {};
     void collect_info(mf_problem &prob, mf_float &avg, mf_float &std_dev);
     void collect_info_on_disk(string data_path, mf_problem &prob,
                               mf_float &avg, mf_float &std_dev);
     void shuffle_problem(mf_problem &prob, vector<mf_int> &p_map,
                          vector<mf_int> &q_map);
     vector<mf_node*> grid_problem(mf_problem &prob, mf_int nr_bins,
+                                  bool balance,
                                   vector<mf_int> &omega_p,
                                   vector<mf_int> &omega_q,
                                   vector<Block> &blocks);
     void grid_shuffle_scale_problem_on_disk(mf_int m, mf_int n, mf_int nr_bins,
+                                            bool balance,
                                             mf_float scale, string data_path,
                                             vector<mf_int> &p_map,
                                             vector<mf_int> &q_map,
@@ -497,6 +1252,15 @@ public:
 
     static mf_problem* copy_problem(mf_problem const *prob, bool copy_data);
     static vector<mf_int> gen_random_map(mf_int size);
+    // Map each user or item to its bin of the grid. The bins are either
+    // segments of equal width, or, if balance is true, segments with
+    // roughly equal numbers of ratings according to omega.
+    static vector<mf_int> gen_bin_map(vector<mf_int> const &omega,
+                                      mf_int nr_bins, bool balance);
+    // Ratio of the largest number of ratings in a block to the mean, over
+    // the blocks used for training
+    static mf_double calc_imbalance(vector<BlockBase*> &blocks,
+                                    vector<mf_int> &cv_block_ids);
     // A function used to allocate all aligned float array.
     // It hides platform-specific function calls. Memory
     // allocated by malloc_aligned_float must be freed by using
@@ -507,10 +1271,12 @@ public:
     static void free_aligned_float(mf_float* ptr);
     // Initialization function for stochastic gradient method.
     // Factor matrices P and Q are both randomly initialized.
+    // The matrices are first written according to layout.
     static mf_model* init_model(mf_int loss, mf_int m, mf_int n,
-                                mf_int k, mf_float avg,
+                                mf_int k, mf_int align, mf_float avg,
                                 vector<mf_int> &omega_p,
-                                vector<mf_int> &omega_q);
+                                vector<mf_int> &omega_q,
+                                NumaLayout const &layout = NumaLayout());
     static mf_float inner_product(mf_float *p, mf_float *q, mf_int k);
     static vector<mf_int> gen_inv_map(vector<mf_int> &map);
     static void shrink_model(mf_model &model, mf_int k_new);
@@ -521,6 +1287,8 @@ public:
 private:
     mf_int fun;
     mf_int nr_threads;
+    // The parallel loops run on the threads shared with the solvers
+    Reco::ThreadPool &pool;
 };
 
 void Utility::collect_info(
@@ -528,18 +1296,24 @@ void Utility::collect_info(
     mf_float &avg,
     mf_float &std_dev)
 {
-    mf_double ex = 0;
-    mf_double ex2 = 0;
-
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(static) reduction(+:ex,ex2)
-#endif
-    for(mf_long i = 0; i < prob.nnz; ++i)
+    vector<mf_double> part_ex(nr_threads, 0), part_ex2(nr_threads, 0);
+    pool.parallel_ranges(nr_threads, (mf_long)0, prob.nnz,
+                         [&] (mf_int t, mf_long first, mf_long last)
     {
-        mf_node &N = prob.R[i];
-        ex += (mf_double)N.r;
-        ex2 += (mf_double)N.r*N.r;
-    }
+        mf_double ex = 0;
+        mf_double ex2 = 0;
+        for(mf_long i = first; i < last; ++i)
+        {
+            mf_node &N = prob.R[i];
+            ex += (mf_double)N.r;
+            ex2 += (mf_double)N.r*N.r;
+        }
+        part_ex[t] = ex;
+        part_ex2[t] = ex2;
+    });
+
+    mf_double ex = accumulate(part_ex.begin(), part_ex.end(), 0.0);
+    mf_double ex2 = accumulate(part_ex2.begin(), part_ex2.end(), 0.0);
 
     ex /= (mf_double)prob.nnz;
     ex2 /= (mf_double)prob.nnz;
@@ -553,25 +1327,42 @@ void Utility::collect_info_on_disk(
     mf_float &avg,
     mf_float &std_dev)
 {
-    mf_double ex = 0;
-    mf_double ex2 = 0;
-
-    ifstream source(data_path);
-    if(!source.is_open())
+    struct Info
+    {
+        mf_int m, n;
+        mf_long nnz;
+        mf_double ex, ex2;
+    };
+
+    TextFile source;
+    if(!source.open(data_path, nr_threads))
         throw runtime_error("cannot open " + data_path);
 
-    for(mf_node N; source >> N.u >> N.v >> N.r;)
+    vector<Info> infos(source.nr_parts(), Info{0, 0, 0, 0, 0});
+
+    source.parse(infos, [] (Info &info, mf_node const &N)
     {
-        if(N.u+1 > prob.m)
-            prob.m = N.u+1;
-        if(N.v+1 > prob.n)
-            prob.n = N.v+1;
-        prob.nnz += 1;
-        ex += (mf_double)N.r;
-        ex2 += (mf_double)N.r*N.r;
-    }
+        if(N.u+1 > info.m)
+            info.m = N.u+1;
+        if(N.v+1 > info.n)
+            info.n = N.v+1;
+        info.nnz += 1;
+        info.ex += (mf_double)N.r;
+        info.ex2 += (mf_double)N.r*N.r;
+    });
     source.close();
 
+    mf_double ex = 0;
+    mf_double ex2 = 0;
+    for(Info const &info : infos)
+    {
+        prob.m = max(prob.m, info.m);
+        prob.n = max(prob.n, info.n);
+        prob.nnz += info.nnz;
+        ex += info.ex;
+        ex2 += info.ex2;
+    }
+
     ex /= (mf_double)prob.nnz;
     ex2 /= (mf_double)prob.nnz;
     avg = (mf_float)ex;
@@ -583,11 +1374,10 @@ void Utility::scale_problem(mf_problem &prob, mf_float scale)
     if(scale == 1.0)
         return;
 
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(static)
-#endif
-    for(mf_long i = 0; i < prob.nnz; ++i)
+    pool.parallel_for(nr_threads, (mf_long)0, prob.nnz, [&] (mf_long i)
+    {
         prob.R[i].r *= scale;
+    });
 }
 
 void Utility::scale_model(mf_model &model, mf_float scale)
@@ -601,49 +1391,18 @@ void Utility::scale_model(mf_model &model, mf_float scale)
 
     auto scale1 = [&] (mf_float *ptr, mf_int size, mf_float factor_scale)
     {
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(static)
-#endif
-        for(mf_int i = 0; i < size; ++i)
+        pool.parallel_for(nr_threads, 0, size, [&] (mf_int i)
         {
             mf_float *ptr1 = ptr+(mf_long)i*model.k;
             for(mf_int d = 0; d < k; ++d)
                 ptr1[d] *= factor_scale;
-        }
+        });
     };
 
     scale1(model.P, model.m, sqrt(scale));
     scale1(model.Q, model.n, sqrt(scale));
 }
 
-mf_float Utility::inner_product(mf_float *p, mf_float *q, mf_int k)
-{
-#if defined USESSE
-    __m128 XMM = _mm_setzero_ps();
-    for(mf_int d = 0; d < k; d += 4)
-        XMM = _mm_add_ps(XMM, _mm_mul_ps(
-                  _mm_load_ps(p+d), _mm_load_ps(q+d)));
-    __m128 XMMtmp = _mm_add_ps(XMM, _mm_movehl_ps(XMM, XMM));
-    XMM = _mm_add_ps(XMM, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
-    mf_float product;
-    _mm_store_ss(&product, XMM);
-    return product;
-#elif defined USEAVX
-    __m256 XMM = _mm256_setzero_ps();
-    for(mf_int d = 0; d < k; d += 8)
-        XMM = _mm256_add_ps(XMM, _mm256_mul_ps(
-                  _mm256_load_ps(p+d), _mm256_load_ps(q+d)));
-    XMM = _mm256_add_ps(XMM, _mm256_permute2f128_ps(XMM, XMM, 1));
-    XMM = _mm256_hadd_ps(XMM, XMM);
-    XMM = _mm256_hadd_ps(XMM, XMM);
-    mf_float product;
-    _mm_store_ss(&product, _mm256_castps256_ps128(XMM));
-    return product;
-#else
-    return std::inner_product(p, p+k, q, (mf_float)0.0);
-#endif
-}
-
 mf_double Utility::calc_reg1(mf_model &model,
                              mf_float lambda_p, mf_float lambda_q,
                              vector<mf_int> &omega_p, vector<mf_int> &omega_q)
@@ -676,20 +1435,15 @@ mf_double Utility::calc_reg2(mf_model &model,
     auto calc_reg2_core = [&] (mf_float *ptr, mf_int size,
                                vector<mf_int> &omega)
     {
-        mf_double reg = 0;
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(static) reduction(+:reg)
-#endif
-        for(mf_int i = 0; i < size; ++i)
+        return pool.parallel_sum(nr_threads, 0, size, [&] (mf_int i)
         {
             if(omega[i] <= 0)
-                continue;
+                return (mf_double)0;
 
             mf_float *ptr1 = ptr+(mf_long)i*model.k;
-            reg += omega[i]*Utility::inner_product(ptr1, ptr1, model.k);
-        }
-
-        return reg;
+            return (mf_double)omega[i]*
+                   Utility::inner_product(ptr1, ptr1, model.k);
+        });
     };
 
     return lambda_p*calc_reg2_core(model.P, model.m, omega_p) +
@@ -705,11 +1459,10 @@ mf_double Utility::calc_error(
     if(fun == P_L2_MFR || fun == P_L1_MFR || fun == P_KL_MFR ||
        fun == P_LR_MFC || fun == P_L2_MFC || fun == P_L1_MFC)
     {
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(static) reduction(+:error)
-#endif
-        for(mf_int i = 0; i < (mf_long)cv_block_ids.size(); ++i)
+        error = pool.parallel_sum(nr_threads, 0, (mf_int)cv_block_ids.size(),
+                                  [&] (mf_int i)
         {
+            mf_double block_error = 0;
             BlockBase *block = blocks[cv_block_ids[i]];
             block->reload();
             while(block->move_next())
@@ -719,26 +1472,26 @@ mf_double Utility::calc_error(
                 switch(fun)
                 {
                     case P_L2_MFR:
-                        error += pow(N.r-z, 2);
+                        block_error += pow(N.r-z, 2);
                         break;
                     case P_L1_MFR:
-                        error += abs(N.r-z);
+                        block_error += abs(N.r-z);
                         break;
                     case P_KL_MFR:
-                        error += N.r*log(N.r/z)-N.r+z;
+                        block_error += N.r*log(N.r/z)-N.r+z;
                         break;
                     case P_LR_MFC:
                         if(N.r > 0)
-                            error += log(1.0+exp(-z));
+                            block_error += log(1.0+exp(-z));
                         else
-                            error += log(1.0+exp(z));
+                            block_error += log(1.0+exp(z));
                         break;
                     case P_L2_MFC:
                     case P_L1_MFC:
                         if(N.r > 0)
-                            error += z > 0? 1: 0;
+                            block_error += z > 0? 1: 0;
                         else
-                            error += z < 0? 1: 0;
+                            block_error += z < 0? 1: 0;
                         break;
                     default:
                         throw invalid_argument("unknown error function");
@@ -746,7 +1499,8 @@ mf_double Utility::calc_error(
                 }
             }
             block->free();
-        }
+            return block_error;
+        });
     }
     else
     {
@@ -847,55 +1601,164 @@ void Utility::shuffle_problem(
     vector<mf_int> &p_map,
     vector<mf_int> &q_map)
 {
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(static)
-#endif
-    for(mf_long i = 0; i < prob.nnz; ++i)
+    pool.parallel_for(nr_threads, (mf_long)0, prob.nnz, [&] (mf_long i)
     {
         mf_node &N = prob.R[i];
         if(N.u < (mf_long)p_map.size())
             N.u = p_map[N.u];
         if(N.v < (mf_long)q_map.size())
             N.v = q_map[N.v];
-    }
+    });
 }
 
 vector<mf_node*> Utility::grid_problem(
     mf_problem &prob,
     mf_int nr_bins,
+    bool balance,
     vector<mf_int> &omega_p,
     vector<mf_int> &omega_q,
     vector<Block> &blocks)
 {
-    vector<mf_long> counts(nr_bins*nr_bins, 0);
+    mf_int nr_blocks = nr_bins*nr_bins;
+
+    // Balanced bins need the numbers of ratings before the partition
+    if(balance)
+    {
+        AtomicCounts counts_p(omega_p.size()), counts_q(omega_q.size());
+        pool.parallel_for(nr_threads, (mf_long)0, prob.nnz, [&] (mf_long i)
+        {
+            counts_p.add(prob.R[i].u);
+            counts_q.add(prob.R[i].v);
+        });
+        counts_p.add_to(omega_p);
+        counts_q.add_to(omega_q);
+    }
 
-    mf_int seg_p = (mf_int)ceil((double)prob.m/nr_bins);
-    mf_int seg_q = (mf_int)ceil((double)prob.n/nr_bins);
+    vector<mf_int> bin_p = gen_bin_map(omega_p, nr_bins, balance);
+    vector<mf_int> bin_q = gen_bin_map(omega_q, nr_bins, balance);
 
-    auto get_block_id = [=] (mf_int u, mf_int v)
+    auto get_block_id = [&] (mf_int u, mf_int v)
     {
-        return (u/seg_p)*nr_bins+v/seg_q;
+        return bin_p[u]*nr_bins+bin_q[v];
     };
 
-    for(mf_long i = 0; i < prob.nnz; ++i)
+    // The records are partitioned in place by a parallel counting sort. The
+    // threads count the records of every block, which gives the ranges of
+    // the blocks. Then in each round, the part of each block that is not
+    // done yet is cut into one slice per thread, and each thread moves the
+    // records of its slices to its slices of their blocks by cycles of
+    // swaps. Records that find no room are left at the end of their slices,
+    // and each block then moves its own records to the front. The rest is
+    // done by one thread once a round makes little progress. Every thread
+    // only touches its own slices, and the records are sorted within each
+    // block afterwards, so only the order of duplicate pairs of user and
+    // item depends on the number of threads
+    mf_int nr_parts = (mf_int)min((mf_long)nr_threads, max(prob.nnz>>16, (mf_long)1));
+
+    auto part_begin = [&] (mf_int part)
+    {
+        return prob.nnz*part/nr_parts;
+    };
+
+    vector<vector<mf_long>> part_counts(nr_parts);
+    pool.parallel_for(nr_parts, 0, nr_parts, [&] (mf_int part)
     {
-        mf_node &N = prob.R[i];
-        mf_int block = get_block_id(N.u, N.v);
-        counts[block] += 1;
-        omega_p[N.u] += 1;
-        omega_q[N.v] += 1;
+        vector<mf_long> counts(nr_blocks, 0);
+        for(mf_long i = part_begin(part); i < part_begin(part+1); ++i)
+            counts[get_block_id(prob.R[i].u, prob.R[i].v)] += 1;
+        part_counts[part] = move(counts);
+    });
+
+    vector<mf_node*> ptrs(nr_blocks+1);
+    ptrs[0] = prob.R;
+    for(mf_int block = 0; block < nr_blocks; ++block)
+    {
+        mf_long count = 0;
+        for(mf_int part = 0; part < nr_parts; ++part)
+            count += part_counts[part][block];
+        ptrs[block+1] = ptrs[block] + count;
     }
+    part_counts.clear();
 
-    vector<mf_node*> ptrs(nr_bins*nr_bins+1);
-    mf_node *ptr = prob.R;
-    ptrs[0] = ptr;
-    for(mf_int block = 0; block < nr_bins*nr_bins; ++block)
-        ptrs[block+1] = ptrs[block] + counts[block];
+    // [heads[block], ptrs[block+1]) are the records of a block not done yet
+    mf_node *R = prob.R;
+    vector<mf_long> heads(nr_blocks), tails(nr_blocks);
+    for(mf_int block = 0; block < nr_blocks; ++block)
+    {
+        heads[block] = ptrs[block]-R;
+        tails[block] = ptrs[block+1]-R;
+    }
 
-    vector<mf_node*> pivots(ptrs.begin(), ptrs.end()-1);
-    for(mf_int block = 0; block < nr_bins*nr_bins; ++block)
+    auto nr_left = [&] ()
+    {
+        mf_long left = 0;
+        for(mf_int block = 0; block < nr_blocks; ++block)
+            left += tails[block]-heads[block];
+        return left;
+    };
+
+    auto slice_begin = [&] (mf_int part, mf_int block)
+    {
+        return heads[block]+(tails[block]-heads[block])*part/nr_parts;
+    };
+
+    for(mf_long left = nr_left(); left > ((mf_long)nr_parts<<16);)
     {
-        for(mf_node* pivot = pivots[block]; pivot != ptrs[block+1];)
+        pool.parallel_for(nr_parts, 0, nr_parts, [&] (mf_int part)
+        {
+            vector<mf_long> first(nr_blocks), last(nr_blocks);
+            for(mf_int block = 0; block < nr_blocks; ++block)
+            {
+                first[block] = slice_begin(part, block);
+                last[block] = slice_begin(part+1, block);
+            }
+
+            for(mf_int block = 0; block < nr_blocks; ++block)
+            {
+                while(first[block] < last[block])
+                {
+                    mf_node N = R[first[block]];
+                    mf_int curr_block = get_block_id(N.u, N.v);
+                    while(curr_block != block &&
+                          first[curr_block] < last[curr_block])
+                    {
+                        swap(N, R[first[curr_block]++]);
+                        curr_block = get_block_id(N.u, N.v);
+                    }
+
+                    if(curr_block == block)
+                    {
+                        R[first[block]++] = N;
+                    }
+                    else
+                    {
+                        // No room for N in this thread
+                        R[first[block]] = R[--last[block]];
+                        R[last[block]] = N;
+                    }
+                }
+            }
+        });
+
+        pool.parallel_for(nr_threads, 0, nr_blocks, [&] (mf_int block)
+        {
+            mf_node *middle = partition(R+heads[block], R+tails[block],
+                [&] (mf_node const &N)
+                {
+                    return get_block_id(N.u, N.v) == block;
+                });
+            heads[block] = middle-R;
+        }, true);
+
+        mf_long next_left = nr_left();
+        if(next_left > left-left/nr_parts)
+            break;
+        left = next_left;
+    }
+
+    for(mf_int block = 0; block < nr_blocks; ++block)
+    {
+        for(mf_node* pivot = R+heads[block]; pivot != ptrs[block+1];)
         {
             mf_int curr_block = get_block_id(pivot->u, pivot->v);
             if(curr_block == block)
@@ -904,22 +1767,41 @@ vector<mf_node*> Utility::grid_problem(
                 continue;
             }
 
-            mf_node *next = pivots[curr_block];
-            swap(*pivot, *next);
-            pivots[curr_block] += 1;
+            swap(*pivot, R[heads[curr_block]]);
+            heads[curr_block] += 1;
         }
     }
 
-#if defined USEOMP
-#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
-#endif
-    for(mf_int block = 0; block < nr_bins*nr_bins; ++block)
+    // The numbers of ratings are counted here unless balanced bins needed
+    // them earlier. The users of a row of blocks only appear in that row,
+    // and the items of a column of blocks only in that column, so the
+    // threads update different counters
+    if(!balance)
+    {
+        pool.parallel_for(nr_threads, 0, nr_bins, [&] (mf_int bin)
+        {
+            for(mf_int j = 0; j < nr_bins; ++j)
+            {
+                mf_int block = bin*nr_bins+j;
+                for(mf_node const *N = ptrs[block]; N != ptrs[block+1]; ++N)
+                    omega_p[N->u] += 1;
+            }
+            for(mf_int i = 0; i < nr_bins; ++i)
+            {
+                mf_int block = i*nr_bins+bin;
+                for(mf_node const *N = ptrs[block]; N != ptrs[block+1]; ++N)
+                    omega_q[N->v] += 1;
+            }
+        }, true);
+    }
+
+    pool.parallel_for(nr_threads, 0, nr_blocks, [&] (mf_int block)
     {
         if(prob.m > prob.n)
             sort(ptrs[block], ptrs[block+1], sort_node_by_p());
         else
             sort(ptrs[block], ptrs[block+1], sort_node_by_q());
-    }
+    }, true);
 
     for(mf_int i = 0; i < (mf_long)blocks.size(); ++i)
         blocks[i].tie_to(ptrs[i], ptrs[i+1]);
@@ -929,75 +1811,104 @@ vector<mf_node*> Utility::grid_problem(
 
 void Utility::grid_shuffle_scale_problem_on_disk(
     mf_int m, mf_int n, mf_int nr_bins,
+    bool balance,
     mf_float scale, string data_path,
     vector<mf_int> &p_map, vector<mf_int> &q_map,
     vector<mf_int> &omega_p, vector<mf_int> &omega_q,
     vector<BlockOnDisk> &blocks)
 {
     string const buffer_path = data_path+string(".disk");
-    mf_int seg_p = (mf_int)ceil((double)m/nr_bins);
-    mf_int seg_q = (mf_int)ceil((double)n/nr_bins);
-    vector<mf_long> counts(nr_bins*nr_bins+1, 0);
-    vector<mf_long> pivots(nr_bins*nr_bins, 0);
-    ifstream source(data_path);
-    fstream buffer(buffer_path, fstream::in|fstream::out|
-                   fstream::binary|fstream::trunc);
-    auto get_block_id = [=] (mf_int u, mf_int v)
-    {
-        return (u/seg_p)*nr_bins+v/seg_q;
+    mf_int nr_blocks = nr_bins*nr_bins;
+    vector<mf_long> counts(nr_blocks+1, 0);
+    TextFile source;
+    Reco::MappedFile buffer;
+    vector<mf_int> bin_p, bin_q;
+    auto get_block_id = [&] (mf_int u, mf_int v)
+    {
+        return bin_p[u]*nr_bins+bin_q[v];
     };
 
-    if(!source)
+    if(!source.open(data_path, nr_threads))
         throw ios::failure(string("cannot to open ")+data_path);
-    if(!buffer)
-        throw ios::failure(string("cannot to open ")+buffer_path);
 
-    for(mf_node N; source >> N.u >> N.v >> N.r;)
+    // Both passes use the same parts, and each part counts its records in
+    // every block, so that the parts can write their records to disjoint
+    // ranges of the buffer without locking
+    mf_int nr_parts = source.nr_parts();
+    vector<vector<mf_long>> part_counts(nr_parts, vector<mf_long>(nr_blocks, 0));
+
+    // Equal-width bins are known in advance, so the blocks are counted in
+    // the same pass as the ratings of each user and item. Balanced bins
+    // depend on these numbers, so the blocks are counted in an extra pass.
+    if(!balance)
     {
-        N.u = p_map[N.u];
-        N.v = q_map[N.v];
-        mf_int bid = get_block_id(N.u, N.v);
-        omega_p[N.u] += 1;
-        omega_q[N.v] += 1;
-        counts[bid+1] += 1;
+        bin_p = gen_bin_map(omega_p, nr_bins, false);
+        bin_q = gen_bin_map(omega_q, nr_bins, false);
+    }
+
+    AtomicCounts counts_p(omega_p.size()), counts_q(omega_q.size());
+    source.parse(part_counts,
+                     [&] (vector<mf_long> &part_count, mf_node const &N)
+    {
+        mf_int u = p_map[N.u];
+        mf_int v = q_map[N.v];
+        counts_p.add(u);
+        counts_q.add(v);
+        if(!balance)
+            part_count[get_block_id(u, v)] += 1;
+    });
+    counts_p.add_to(omega_p);
+    counts_q.add_to(omega_q);
+
+    if(balance)
+    {
+        bin_p = gen_bin_map(omega_p, nr_bins, true);
+        bin_q = gen_bin_map(omega_q, nr_bins, true);
+
+        source.parse(part_counts,
+                         [&] (vector<mf_long> &part_count, mf_node const &N)
+        {
+            part_count[get_block_id(p_map[N.u], q_map[N.v])] += 1;
+        });
     }
 
-    for(mf_int i = 1; i < nr_bins*nr_bins+1; ++i)
+    // pivots[i][bid] is where part i writes its next record of block bid
+    vector<vector<mf_long>> pivots(nr_parts, vector<mf_long>(nr_blocks, 0));
+    for(mf_int bid = 0; bid < nr_blocks; ++bid)
     {
-        counts[i] += counts[i-1];
-        pivots[i-1] = counts[i-1];
+        counts[bid+1] = counts[bid];
+        for(mf_int i = 0; i < nr_parts; ++i)
+        {
+            pivots[i][bid] = counts[bid+1];
+            counts[bid+1] += part_counts[i][bid];
+        }
     }
 
-    source.clear();
-    source.seekg(0);
-    for(mf_node N; source >> N.u >> N.v >> N.r;)
+    if(!buffer.create(buffer_path, counts[nr_blocks]*sizeof(mf_node)))
+        throw ios::failure(string("cannot to open ")+buffer_path);
+    mf_node *nodes = (mf_node*)buffer.data();
+
+    source.parse(pivots,
+                     [&] (vector<mf_long> &pivot, mf_node const &N0)
     {
+        mf_node N = N0;
         N.u = p_map[N.u];
         N.v = q_map[N.v];
         N.r /= scale;
         mf_int bid = get_block_id(N.u, N.v);
-        buffer.seekp(pivots[bid]*sizeof(mf_node));
-        buffer.write((char*)&N, sizeof(mf_node));
-        pivots[bid] += 1;
-    }
+        nodes[pivot[bid]] = N;
+        pivot[bid] += 1;
+    });
+    source.close();
 
-    for(mf_int i = 0; i < nr_bins*nr_bins; ++i)
+    pool.parallel_for(nr_threads, 0, nr_blocks, [&] (mf_int i)
     {
-        vector<mf_node> nodes(static_cast<size_t>(counts[i+1]-counts[i]));
-        buffer.clear();
-        buffer.seekg(counts[i]*sizeof(mf_node));
-        buffer.read((char*)nodes.data(), sizeof(mf_node)*nodes.size());
-
         if(m > n)
-            sort(nodes.begin(), nodes.end(), sort_node_by_p());
+            sort(nodes+counts[i], nodes+counts[i+1], sort_node_by_p());
         else
-            sort(nodes.begin(), nodes.end(), sort_node_by_q());
-
-        buffer.clear();
-        buffer.seekp(counts[i]*sizeof(mf_node));
-        buffer.write((char*)nodes.data(), sizeof(mf_node)*nodes.size());
-        buffer.read((char*)nodes.data(), sizeof(mf_node)*nodes.size());
-    }
+            sort(nodes+counts[i], nodes+counts[i+1], sort_node_by_q());
+    }, true);
+    buffer.close();
 
     for(mf_int i = 0; i < (mf_long)blocks.size(); ++i)
         blocks[i].tie_to(buffer_path, counts[i], counts[i+1]);
@@ -1047,12 +1958,13 @@ void Utility::free_aligned_float(mf_float *ptr)
 
 mf_model* Utility::init_model(mf_int fun,
                               mf_int m, mf_int n,
-                              mf_int k, mf_float avg,
+                              mf_int k, mf_int align, mf_float avg,
                               vector<mf_int> &omega_p,
-                              vector<mf_int> &omega_q)
+                              vector<mf_int> &omega_q,
+                              NumaLayout const &layout)
 {
     mf_int k_real = k;
-    mf_int k_aligned = (mf_int)ceil(mf_double(k)/kALIGN)*kALIGN;
+    mf_int k_aligned = (mf_int)ceil(mf_double(k)/align)*align;
 
     mf_model *model = new mf_model;
 
@@ -1084,10 +1996,10 @@ mf_model* Utility::init_model(mf_int fun,
         throw;
     }
 
-    auto init1 = [&](mf_float *start_ptr, mf_long size, vector<mf_int> counts)
+    auto init1 = [&](mf_float *start_ptr, mf_long size, vector<mf_int> counts,
+                     bool is_p)
     {
-        memset(start_ptr, 0, static_cast<size_t>(
-                    sizeof(mf_float) * size*model->k));
+        layout.first_touch(start_ptr, size, model->k, is_p, 0);
         for(mf_long i = 0; i < size; ++i)
         {
             mf_float * ptr = start_ptr + i*model->k;
@@ -1102,8 +2014,8 @@ mf_model* Utility::init_model(mf_int fun,
         }
     };
 
-    init1(model->P, m, omega_p);
-    init1(model->Q, n, omega_q);
+    init1(model->P, m, omega_p, true);
+    init1(model->Q, n, omega_q, false);
 
     return model;
 }
@@ -1119,1774 +2031,464 @@ vector<mf_int> Utility::gen_random_map(mf_int size)
     return map;
 }
 
-vector<mf_int> Utility::gen_inv_map(vector<mf_int> &map)
-{
-    vector<mf_int> inv_map(map.size());
-    for(mf_int i = 0; i < (mf_long)map.size(); ++i)
-      inv_map[map[i]] = i;
-    return inv_map;
-}
-
-void Utility::shuffle_model(
-    mf_model &model,
-    vector<mf_int> &p_map,
-    vector<mf_int> &q_map)
+vector<mf_int> Utility::gen_bin_map(
+    vector<mf_int> const &omega,
+    mf_int nr_bins,
+    bool balance)
 {
-    auto inv_shuffle1 = [] (mf_float *vec, vector<mf_int> &map,
-                            mf_int size, mf_int k)
-    {
-        for(mf_int pivot = 0; pivot < size;)
-        {
-            if(pivot == map[pivot])
-            {
-                ++pivot;
-                continue;
-            }
-
-            mf_int next = map[pivot];
-
-            for(mf_int d = 0; d < k; ++d)
-                swap(*(vec+(mf_long)pivot*k+d), *(vec+(mf_long)next*k+d));
-
-            map[pivot] = map[next];
-            map[next] = next;
-        }
-    };
-
-    inv_shuffle1(model.P, p_map, model.m, model.k);
-    inv_shuffle1(model.Q, q_map, model.n, model.k);
-}
+    mf_int size = (mf_int)omega.size();
+    vector<mf_int> bin(size, 0);
 
-void Utility::shrink_model(mf_model &model, mf_int k_new)
-{
-    mf_int k_old = model.k;
-    model.k = k_new;
+    mf_long total = 0;
+    if(balance)
+        total = accumulate(omega.begin(), omega.end(), (mf_long)0);
 
-    auto shrink1 = [&] (mf_float *ptr, mf_int size)
+    if(total == 0)
     {
+        mf_int seg = max((mf_int)ceil((double)size/nr_bins), 1);
         for(mf_int i = 0; i < size; ++i)
-        {
-            mf_float *src = ptr+(mf_long)i*k_old;
-            mf_float *dst = ptr+(mf_long)i*k_new;
-            copy(src, src+k_new, dst);
-        }
-    };
-
-    shrink1(model.P, model.m);
-    shrink1(model.Q, model.n);
-}
-
-mf_problem* Utility::copy_problem(mf_problem const *prob, bool copy_data)
-{
-    mf_problem *new_prob = new mf_problem;
-
-    if(prob == nullptr)
-    {
-        new_prob->m = 0;
-        new_prob->n = 0;
-        new_prob->nnz = 0;
-        new_prob->R = nullptr;
-
-        return new_prob;
+            bin[i] = i/seg;
+        return bin;
     }
 
-    new_prob->m = prob->m;
-    new_prob->n = prob->n;
-    new_prob->nnz = prob->nnz;
-
-    if(copy_data)
-    {
-        try
-        {
-            new_prob->R = new mf_node[static_cast<size_t>(prob->nnz)];
-            copy(prob->R, prob->R+prob->nnz, new_prob->R);
-        }
-        catch(...)
-        {
-            delete new_prob;
-            throw;
-        }
-    }
-    else
+    // An index goes to the bin that contains the middle of its ratings in
+    // the cumulative count, so a heavy user or item is not split from its
+    // own ratings, and the bins stay contiguous
+    mf_long cum = 0;
+    for(mf_int i = 0; i < size; ++i)
     {
-        new_prob->R = prob->R;
+        mf_long mid = 2*cum+omega[i];
+        bin[i] = (mf_int)min(mid*nr_bins/(2*total), (mf_long)nr_bins-1);
+        cum += omega[i];
     }
-
-    return new_prob;
+    return bin;
 }
 
-//--------------------------------------
-//-----The base class of all solvers----
-//--------------------------------------
-
-class SolverBase
+mf_double Utility::calc_imbalance(
+    vector<BlockBase*> &blocks,
+    vector<mf_int> &cv_block_ids)
 {
-public:
-    SolverBase(Scheduler &scheduler, vector<BlockBase*> &blocks,
-               mf_float *PG, mf_float *QG, mf_model &model, mf_parameter param,
-               bool &slow_only)
-        : scheduler(scheduler), blocks(blocks), PG(PG), QG(QG),
-          model(model), param(param), slow_only(slow_only) {}
-    void run();
-    SolverBase(const SolverBase&) = delete;
-    SolverBase& operator=(const SolverBase&) = delete;
-    // Solver is stateless functor, so default destructor should be
-    // good enough.
-    virtual ~SolverBase() = default;
-
-protected:
-#if defined USESSE
-    static void calc_z(__m128 &XMMz, mf_int k, mf_float *p, mf_float *q);
-    virtual void load_fixed_variables(
-        __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
-        __m128 &XMMlambda_p2, __m128 &XMMlabmda_q2,
-        __m128 &XMMeta, __m128 &XMMrk_slow,
-        __m128 &XMMrk_fast);
-    virtual void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
-    virtual void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror) = 0;
-    virtual void sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
-                           __m128 XMMlambda_p1, __m128 XMMlambda_q1,
-                           __m128 XMMlambda_p2, __m128 XMMlamdba_q2,
-                           __m128 XMMeta, __m128 XMMrk) = 0;
-    virtual void finalize(__m128d XMMloss, __m128d XMMerror);
-#elif defined USEAVX
-    static void calc_z(__m256 &XMMz, mf_int k, mf_float *p, mf_float *q);
-    virtual void load_fixed_variables(
-        __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
-        __m256 &XMMlambda_p2, __m256 &XMMlabmda_q2,
-        __m256 &XMMeta, __m256 &XMMrk_slow,
-        __m256 &XMMrk_fast);
-    virtual void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
-    virtual void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror) = 0;
-    virtual void sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
-                           __m256 XMMlambda_p1, __m256 XMMlambda_q1,
-                           __m256 XMMlambda_p2, __m256 XMMlamdba_q2,
-                           __m256 XMMeta, __m256 XMMrk) = 0;
-    virtual void finalize(__m128d XMMloss, __m128d XMMerror);
-#else
-    static void calc_z(mf_float &z, mf_int k, mf_float *p, mf_float *q);
-    virtual void load_fixed_variables();
-    virtual void arrange_block();
-    virtual void prepare_for_sg_update() = 0;
-    virtual void sg_update(mf_int d_begin, mf_int d_end, mf_float rk) = 0;
-    virtual void finalize();
-    static float qrsqrt(float x);
-#endif
-    virtual void update() { ++pG; ++qG; };
-
-    Scheduler &scheduler;
-    vector<BlockBase*> &blocks;
-    BlockBase *block;
-    mf_float *PG;
-    mf_float *QG;
-    mf_model &model;
-    mf_parameter param;
-    bool &slow_only;
-
-    mf_node *N;
-    mf_float z;
-    mf_double loss;
-    mf_double error;
-    mf_float *p;
-    mf_float *q;
-    mf_float *pG;
-    mf_float *qG;
-    mf_int bid;
-
-    mf_float lambda_p1;
-    mf_float lambda_q1;
-    mf_float lambda_p2;
-    mf_float lambda_q2;
-    mf_float rk_slow;
-    mf_float rk_fast;
-};
+    vector<bool> is_cv(blocks.size(), false);
+    for(auto block : cv_block_ids)
+        is_cv[block] = true;
 
-#if defined USESSE
-inline void SolverBase::run()
-{
-    __m128d XMMloss;
-    __m128d XMMerror;
-    __m128 XMMz;
-    __m128 XMMlambda_p1;
-    __m128 XMMlambda_q1;
-    __m128 XMMlambda_p2;
-    __m128 XMMlambda_q2;
-    __m128 XMMeta;
-    __m128 XMMrk_slow;
-    __m128 XMMrk_fast;
-    load_fixed_variables(XMMlambda_p1, XMMlambda_q1,
-                         XMMlambda_p2, XMMlambda_q2,
-                         XMMeta, XMMrk_slow,
-                         XMMrk_fast);
-    while(!scheduler.is_terminated())
-    {
-        arrange_block(XMMloss, XMMerror);
-        while(block->move_next())
-        {
-            N = block->get_current();
-            p = model.P+(mf_long)N->u*model.k;
-            q = model.Q+(mf_long)N->v*model.k;
-            pG = PG+N->u*2;
-            qG = QG+N->v*2;
-            prepare_for_sg_update(XMMz, XMMloss, XMMerror);
-            sg_update(0, kALIGN, XMMz, XMMlambda_p1, XMMlambda_q1,
-                    XMMlambda_p2, XMMlambda_q2, XMMeta, XMMrk_slow);
-            if(slow_only)
-                continue;
-            update();
-            sg_update(kALIGN, model.k, XMMz, XMMlambda_p1, XMMlambda_q1,
-                    XMMlambda_p2, XMMlambda_q2, XMMeta, XMMrk_slow);
-        }
-        finalize(XMMloss, XMMerror);
-    }
-}
-
-void SolverBase::load_fixed_variables(
-    __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
-    __m128 &XMMlambda_p2, __m128 &XMMlambda_q2,
-    __m128 &XMMeta, __m128 &XMMrk_slow,
-    __m128 &XMMrk_fast)
-{
-    XMMlambda_p1 = _mm_set1_ps(param.lambda_p1);
-    XMMlambda_q1 = _mm_set1_ps(param.lambda_q1);
-    XMMlambda_p2 = _mm_set1_ps(param.lambda_p2);
-    XMMlambda_q2 = _mm_set1_ps(param.lambda_q2);
-    XMMeta = _mm_set1_ps(param.eta);
-    XMMrk_slow = _mm_set1_ps((mf_float)1.0/kALIGN);
-    XMMrk_fast = _mm_set1_ps((mf_float)1.0/(model.k-kALIGN));
-}
-
-void SolverBase::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
-{
-    XMMloss = _mm_setzero_pd();
-    XMMerror = _mm_setzero_pd();
-    bid = scheduler.get_job();
-    block = blocks[bid];
-    block->reload();
-}
-
-inline void SolverBase::calc_z(
-    __m128 &XMMz, mf_int k, mf_float *p, mf_float *q)
-{
-    XMMz = _mm_setzero_ps();
-    for(mf_int d = 0; d < k; d += 4)
-        XMMz = _mm_add_ps(XMMz, _mm_mul_ps(
-               _mm_load_ps(p+d), _mm_load_ps(q+d)));
-    // Bit-wise representation of 177 is {1,0}+{1,1}+{0,0}+{0,1} from
-    // high-bit to low-bit, where "+" means concatenating two arrays.
-    __m128 XMMtmp = _mm_add_ps(XMMz, _mm_shuffle_ps(XMMz, XMMz, 177));
-    // Bit-wise representation of 78 is {0,1}+{0,0}+{1,1}+{1,0} from
-    // high-bit to low-bit, where "+" means concatenating two arrays.
-    XMMz = _mm_add_ps(XMMtmp, _mm_shuffle_ps(XMMtmp, XMMtmp, 78));
-}
-
-void SolverBase::finalize(__m128d XMMloss, __m128d XMMerror)
-{
-    _mm_store_sd(&loss, XMMloss);
-    _mm_store_sd(&error, XMMerror);
-    block->free();
-    scheduler.put_job(bid, loss, error);
-}
-#elif defined USEAVX
-inline void SolverBase::run()
-{
-    __m128d XMMloss;
-    __m128d XMMerror;
-    __m256 XMMz;
-    __m256 XMMlambda_p1;
-    __m256 XMMlambda_q1;
-    __m256 XMMlambda_p2;
-    __m256 XMMlambda_q2;
-    __m256 XMMeta;
-    __m256 XMMrk_slow;
-    __m256 XMMrk_fast;
-    load_fixed_variables(XMMlambda_p1, XMMlambda_q1,
-                         XMMlambda_p2, XMMlambda_q2,
-                         XMMeta, XMMrk_slow, XMMrk_fast);
-    while(!scheduler.is_terminated())
-    {
-        arrange_block(XMMloss, XMMerror);
-        while(block->move_next())
-        {
-            N = block->get_current();
-            p = model.P+(mf_long)N->u*model.k;
-            q = model.Q+(mf_long)N->v*model.k;
-            pG = PG+N->u*2;
-            qG = QG+N->v*2;
-            prepare_for_sg_update(XMMz, XMMloss, XMMerror);
-            sg_update(0, kALIGN, XMMz, XMMlambda_p1, XMMlambda_q1,
-                      XMMlambda_p2, XMMlambda_q2, XMMeta, XMMrk_slow);
-            if(slow_only)
-                continue;
-            update();
-            sg_update(kALIGN, model.k, XMMz, XMMlambda_p1, XMMlambda_q1,
-                      XMMlambda_p2, XMMlambda_q2, XMMeta, XMMrk_fast);
-        }
-        finalize(XMMloss, XMMerror);
+    mf_long max_nnz = 0;
+    mf_long total = 0;
+    mf_long nr_blocks = 0;
+    for(mf_int i = 0; i < (mf_long)blocks.size(); ++i)
+    {
+        if(is_cv[i])
+            continue;
+        mf_long nnz = blocks[i]->get_nnz();
+        max_nnz = max(max_nnz, nnz);
+        total += nnz;
+        nr_blocks += 1;
     }
-}
-
-void SolverBase::load_fixed_variables(
-    __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
-    __m256 &XMMlambda_p2, __m256 &XMMlambda_q2,
-    __m256 &XMMeta, __m256 &XMMrk_slow,
-    __m256 &XMMrk_fast)
-{
-    XMMlambda_p1 = _mm256_set1_ps(param.lambda_p1);
-    XMMlambda_q1 = _mm256_set1_ps(param.lambda_q1);
-    XMMlambda_p2 = _mm256_set1_ps(param.lambda_p2);
-    XMMlambda_q2 = _mm256_set1_ps(param.lambda_q2);
-    XMMeta = _mm256_set1_ps(param.eta);
-    XMMrk_slow = _mm256_set1_ps((mf_float)1.0/kALIGN);
-    XMMrk_fast = _mm256_set1_ps((mf_float)1.0/(model.k-kALIGN));
-}
+    if(total == 0)
+        return 1;
 
-void SolverBase::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
-{
-    XMMloss = _mm_setzero_pd();
-    XMMerror = _mm_setzero_pd();
-    bid = scheduler.get_job();
-    block = blocks[bid];
-    block->reload();
+    return (mf_double)max_nnz*nr_blocks/total;
 }
 
-inline void SolverBase::calc_z(
-    __m256 &XMMz, mf_int k, mf_float *p, mf_float *q)
+vector<mf_int> Utility::gen_inv_map(vector<mf_int> &map)
 {
-    XMMz = _mm256_setzero_ps();
-    for(mf_int d = 0; d < k; d += 8)
-        XMMz = _mm256_add_ps(XMMz, _mm256_mul_ps(
-               _mm256_load_ps(p+d), _mm256_load_ps(q+d)));
-    XMMz = _mm256_add_ps(XMMz, _mm256_permute2f128_ps(XMMz, XMMz, 0x1));
-    XMMz = _mm256_hadd_ps(XMMz, XMMz);
-    XMMz = _mm256_hadd_ps(XMMz, XMMz);
+    vector<mf_int> inv_map(map.size());
+    for(mf_int i = 0; i < (mf_long)map.size(); ++i)
+      inv_map[map[i]] = i;
+    return inv_map;
 }
 
-void SolverBase::finalize(__m128d XMMloss, __m128d XMMerror)
-{
-    _mm_store_sd(&loss, XMMloss);
-    _mm_store_sd(&error, XMMerror);
-    block->free();
-    scheduler.put_job(bid, loss, error);
-}
-#else
-inline void SolverBase::run()
+void Utility::shuffle_model(
+    mf_model &model,
+    vector<mf_int> &p_map,
+    vector<mf_int> &q_map)
 {
-    load_fixed_variables();
-    while(!scheduler.is_terminated())
+    auto inv_shuffle1 = [] (mf_float *vec, vector<mf_int> &map,
+                            mf_int size, mf_int k)
     {
-        arrange_block();
-        while(block->move_next())
+        for(mf_int pivot = 0; pivot < size;)
         {
-            N = block->get_current();
-            p = model.P+(mf_long)N->u*model.k;
-            q = model.Q+(mf_long)N->v*model.k;
-            pG = PG+N->u*2;
-            qG = QG+N->v*2;
-            prepare_for_sg_update();
-            sg_update(0, kALIGN, rk_slow);
-            if(slow_only)
-                continue;
-            update();
-            sg_update(kALIGN, model.k, rk_fast);
-        }
-        finalize();
-    }
-}
-
-inline float SolverBase::qrsqrt(float x)
-{
-    float xhalf = 0.5f*x;
-    uint32_t i;
-    memcpy(&i, &x, sizeof(i));
-    i = 0x5f375a86 - (i>>1);
-    memcpy(&x, &i, sizeof(i));
-    x = x*(1.5f - xhalf*x*x);
-    return x;
-}
-
-void SolverBase::load_fixed_variables()
-{
-    lambda_p1 = param.lambda_p1;
-    lambda_q1 = param.lambda_q1;
-    lambda_p2 = param.lambda_p2;
-    lambda_q2 = param.lambda_q2;
-    rk_slow = (mf_float)1.0/kALIGN;
-    rk_fast = (mf_float)1.0/(model.k-kALIGN);
-}
-
-void SolverBase::arrange_block()
-{
-    loss = 0.0;
-    error = 0.0;
-    bid = scheduler.get_job();
-    block = blocks[bid];
-    block->reload();
-}
-
-inline void SolverBase::calc_z(mf_float &z, mf_int k, mf_float *p, mf_float *q)
-{
-    z = 0;
-    for(mf_int d = 0; d < k; ++d)
-        z += p[d]*q[d];
-}
-
-void SolverBase::finalize()
-{
-    block->free();
-    scheduler.put_job(bid, loss, error);
-}
-#endif
-
-//--------------------------------------
-//-----Real-valued MF and binary MF-----
-//--------------------------------------
-
-class MFSolver: public SolverBase
-{
-public:
-    MFSolver(Scheduler &scheduler, vector<BlockBase*> &blocks,
-             mf_float *PG, mf_float *QG, mf_model &model,
-             mf_parameter param, bool &slow_only)
-        : SolverBase(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
-                   __m128 XMMlambda_p1, __m128 XMMlambda_q1,
-                   __m128 XMMlambda_p2, __m128 XMMlambda_q2,
-                   __m128 XMMeta, __m128 XMMrk);
-#elif defined USEAVX
-    void sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
-                   __m256 XMMlambda_p1, __m256 XMMlambda_q1,
-                   __m256 XMMlambda_p2, __m256 XMMlambda_q2,
-                   __m256 XMMeta, __m256 XMMrk);
-#else
-    void sg_update(mf_int d_begin, mf_int d_end, mf_float rk);
-#endif
-};
-
-#if defined USESSE
-void MFSolver::sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
-                                __m128 XMMlambda_p1, __m128 XMMlambda_q1,
-                                __m128 XMMlambda_p2, __m128 XMMlambda_q2,
-                                __m128 XMMeta, __m128 XMMrk)
-{
-    __m128 XMMpG = _mm_load1_ps(pG);
-    __m128 XMMqG = _mm_load1_ps(qG);
-    __m128 XMMeta_p = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMpG));
-    __m128 XMMeta_q = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMqG));
-    __m128 XMMpG1 = _mm_setzero_ps();
-    __m128 XMMqG1 = _mm_setzero_ps();
-
-    for(mf_int d = d_begin; d < d_end; d += 4)
-    {
-        __m128 XMMp = _mm_load_ps(p+d);
-        __m128 XMMq = _mm_load_ps(q+d);
-
-        __m128 XMMpg = _mm_sub_ps(_mm_mul_ps(XMMlambda_p2, XMMp),
-                       _mm_mul_ps(XMMz, XMMq));
-        __m128 XMMqg = _mm_sub_ps(_mm_mul_ps(XMMlambda_q2, XMMq),
-                       _mm_mul_ps(XMMz, XMMp));
-
-        XMMpG1 = _mm_add_ps(XMMpG1, _mm_mul_ps(XMMpg, XMMpg));
-        XMMqG1 = _mm_add_ps(XMMqG1, _mm_mul_ps(XMMqg, XMMqg));
-
-        XMMp = _mm_sub_ps(XMMp, _mm_mul_ps(XMMeta_p, XMMpg));
-        XMMq = _mm_sub_ps(XMMq, _mm_mul_ps(XMMeta_q, XMMqg));
-
-        _mm_store_ps(p+d, XMMp);
-        _mm_store_ps(q+d, XMMq);
-    }
-
-    mf_float tmp = 0;
-    _mm_store_ss(&tmp, XMMlambda_p1);
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 4)
-        {
-            __m128 XMMp = _mm_load_ps(p+d);
-            __m128 XMMflip = _mm_and_ps(_mm_cmple_ps(XMMp, _mm_set1_ps(0.0f)),
-                             _mm_set1_ps(-0.0f));
-            XMMp = _mm_xor_ps(XMMflip,
-                   _mm_max_ps(_mm_sub_ps(_mm_xor_ps(XMMp, XMMflip),
-                   _mm_mul_ps(XMMeta_p, XMMlambda_p1)), _mm_set1_ps(0.0f)));
-            _mm_store_ps(p+d, XMMp);
-        }
-    }
-
-    _mm_store_ss(&tmp, XMMlambda_q1);
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 4)
-        {
-            __m128 XMMq = _mm_load_ps(q+d);
-            __m128 XMMflip = _mm_and_ps(_mm_cmple_ps(XMMq, _mm_set1_ps(0.0f)),
-                             _mm_set1_ps(-0.0f));
-            XMMq = _mm_xor_ps(XMMflip,
-                   _mm_max_ps(_mm_sub_ps(_mm_xor_ps(XMMq, XMMflip),
-                   _mm_mul_ps(XMMeta_q, XMMlambda_q1)), _mm_set1_ps(0.0f)));
-            _mm_store_ps(q+d, XMMq);
-        }
-    }
-
-    if(param.do_nmf)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 4)
-        {
-            __m128 XMMp = _mm_load_ps(p+d);
-            __m128 XMMq = _mm_load_ps(q+d);
-            XMMp = _mm_max_ps(XMMp, _mm_set1_ps(0.0f));
-            XMMq = _mm_max_ps(XMMq, _mm_set1_ps(0.0f));
-            _mm_store_ps(p+d, XMMp);
-            _mm_store_ps(q+d, XMMq);
-        }
-    }
-
-    __m128 XMMtmp = _mm_add_ps(XMMpG1, _mm_movehl_ps(XMMpG1, XMMpG1));
-    XMMpG1 = _mm_add_ps(XMMpG1, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
-    XMMpG = _mm_add_ps(XMMpG, _mm_mul_ps(XMMpG1, XMMrk));
-    _mm_store_ss(pG, XMMpG);
-
-    XMMtmp = _mm_add_ps(XMMqG1, _mm_movehl_ps(XMMqG1, XMMqG1));
-    XMMqG1 = _mm_add_ps(XMMqG1, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
-    XMMqG = _mm_add_ps(XMMqG, _mm_mul_ps(XMMqG1, XMMrk));
-    _mm_store_ss(qG, XMMqG);
-}
-#elif defined USEAVX
-void MFSolver::sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
-                                __m256 XMMlambda_p1, __m256 XMMlambda_q1,
-                                __m256 XMMlambda_p2, __m256 XMMlambda_q2,
-                                __m256 XMMeta, __m256 XMMrk)
-{
-    __m256 XMMpG = _mm256_broadcast_ss(pG);
-    __m256 XMMqG = _mm256_broadcast_ss(qG);
-    __m256 XMMeta_p = _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMpG));
-    __m256 XMMeta_q = _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMqG));
-    __m256 XMMpG1 = _mm256_setzero_ps();
-    __m256 XMMqG1 = _mm256_setzero_ps();
-
-    for(mf_int d = d_begin; d < d_end; d += 8)
-    {
-        __m256 XMMp = _mm256_load_ps(p+d);
-        __m256 XMMq = _mm256_load_ps(q+d);
-
-        __m256 XMMpg = _mm256_sub_ps(_mm256_mul_ps(XMMlambda_p2, XMMp),
-                                     _mm256_mul_ps(XMMz, XMMq));
-        __m256 XMMqg = _mm256_sub_ps(_mm256_mul_ps(XMMlambda_q2, XMMq),
-                                     _mm256_mul_ps(XMMz, XMMp));
-
-        XMMpG1 = _mm256_add_ps(XMMpG1, _mm256_mul_ps(XMMpg, XMMpg));
-        XMMqG1 = _mm256_add_ps(XMMqG1, _mm256_mul_ps(XMMqg, XMMqg));
-
-        XMMp = _mm256_sub_ps(XMMp, _mm256_mul_ps(XMMeta_p, XMMpg));
-        XMMq = _mm256_sub_ps(XMMq, _mm256_mul_ps(XMMeta_q, XMMqg));
-        _mm256_store_ps(p+d, XMMp);
-        _mm256_store_ps(q+d, XMMq);
-    }
-
-    mf_float tmp = 0;
-    _mm_store_ss(&tmp, _mm256_castps256_ps128(XMMlambda_p1));
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 8)
-        {
-            __m256 XMMp = _mm256_load_ps(p+d);
-            __m256 XMMflip = _mm256_and_ps(_mm256_cmp_ps(XMMp,
-                             _mm256_set1_ps(0.0f), _CMP_LE_OS),
-                             _mm256_set1_ps(-0.0f));
-            XMMp = _mm256_xor_ps(XMMflip,
-                   _mm256_max_ps(_mm256_sub_ps(
-                   _mm256_xor_ps(XMMp, XMMflip),
-                   _mm256_mul_ps(XMMeta_p, XMMlambda_p1)),
-                   _mm256_set1_ps(0.0f)));
-            _mm256_store_ps(p+d, XMMp);
-        }
-    }
-
-    _mm_store_ss(&tmp, _mm256_castps256_ps128(XMMlambda_q1));
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 8)
-        {
-            __m256 XMMq = _mm256_load_ps(q+d);
-            __m256 XMMflip = _mm256_and_ps(_mm256_cmp_ps(XMMq,
-                             _mm256_set1_ps(0.0f), _CMP_LE_OS),
-                             _mm256_set1_ps(-0.0f));
-            XMMq = _mm256_xor_ps(XMMflip,
-                   _mm256_max_ps(_mm256_sub_ps(
-                   _mm256_xor_ps(XMMq, XMMflip),
-                   _mm256_mul_ps(XMMeta_q, XMMlambda_q1)),
-                   _mm256_set1_ps(0.0f)));
-            _mm256_store_ps(q+d, XMMq);
-        }
-    }
-
-    if(param.do_nmf)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 8)
-        {
-            __m256 XMMp = _mm256_load_ps(p+d);
-            __m256 XMMq = _mm256_load_ps(q+d);
-            XMMp = _mm256_max_ps(XMMp, _mm256_set1_ps(0));
-            XMMq = _mm256_max_ps(XMMq, _mm256_set1_ps(0));
-            _mm256_store_ps(p+d, XMMp);
-            _mm256_store_ps(q+d, XMMq);
-        }
-    }
-
-    XMMpG1 = _mm256_add_ps(XMMpG1,
-             _mm256_permute2f128_ps(XMMpG1, XMMpG1, 0x1));
-    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
-    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
-
-    XMMqG1 = _mm256_add_ps(XMMqG1,
-             _mm256_permute2f128_ps(XMMqG1, XMMqG1, 0x1));
-    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
-    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
-
-    XMMpG = _mm256_add_ps(XMMpG, _mm256_mul_ps(XMMpG1, XMMrk));
-    XMMqG = _mm256_add_ps(XMMqG, _mm256_mul_ps(XMMqG1, XMMrk));
-
-    _mm_store_ss(pG, _mm256_castps256_ps128(XMMpG));
-    _mm_store_ss(qG, _mm256_castps256_ps128(XMMqG));
-}
-#else
-void MFSolver::sg_update(mf_int d_begin, mf_int d_end, mf_float rk)
-{
-    mf_float eta_p = param.eta*qrsqrt(*pG);
-    mf_float eta_q = param.eta*qrsqrt(*qG);
-
-    mf_float pG1 = 0;
-    mf_float qG1 = 0;
-
-    for(mf_int d = d_begin; d < d_end; ++d)
-    {
-        mf_float gp = -z*q[d]+lambda_p2*p[d];
-        mf_float gq = -z*p[d]+lambda_q2*q[d];
-
-        pG1 += gp*gp;
-        qG1 += gq*gq;
-
-        p[d] -= eta_p*gp;
-        q[d] -= eta_q*gq;
-    }
-
-    if(lambda_p1 > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; ++d)
-        {
-            mf_float p1 = max(abs(p[d])-lambda_p1*eta_p, 0.0f);
-            p[d] = p[d] >= 0? p1: -p1;
-        }
-    }
-
-    if(lambda_q1 > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; ++d)
-        {
-            mf_float q1 = max(abs(q[d])-lambda_q1*eta_q, 0.0f);
-            q[d] = q[d] >= 0? q1: -q1;
-        }
-    }
-
-    if(param.do_nmf)
-    {
-        for(mf_int d = d_begin; d < d_end; ++d)
-        {
-            p[d] = max(p[d], (mf_float)0.0f);
-            q[d] = max(q[d], (mf_float)0.0f);
-        }
-    }
-
-    *pG += pG1*rk;
-    *qG += qG1*rk;
-}
-#endif
-
-class L2_MFR : public MFSolver
-{
-public:
-    L2_MFR(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
-           mf_model &model, mf_parameter param, bool &slow_only)
-        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#elif defined USEAVX
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#else
-    void prepare_for_sg_update();
-#endif
-};
-
-#if defined USESSE
-void L2_MFR::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    XMMz = _mm_sub_ps(_mm_set1_ps(N->r), XMMz);
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-              _mm_mul_ps(XMMz, XMMz)));
-    XMMerror = XMMloss;
-}
-#elif defined USEAVX
-void L2_MFR::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    XMMz = _mm256_sub_ps(_mm256_set1_ps(N->r), XMMz);
-    XMMloss = _mm_add_pd(XMMloss,
-              _mm_cvtps_pd(_mm256_castps256_ps128(
-              _mm256_mul_ps(XMMz, XMMz))));
-    XMMerror = XMMloss;
-}
-#else
-void L2_MFR::prepare_for_sg_update()
-{
-    calc_z(z, model.k, p, q);
-    z = N->r-z;
-    loss += z*z;
-    error = loss;
-}
-#endif
-class L1_MFR : public MFSolver
-{
-public:
-    L1_MFR(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
-           mf_model &model, mf_parameter param, bool &slow_only)
-        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#elif defined USEAVX
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#else
-    void prepare_for_sg_update();
-#endif
-};
-
-#if defined USESSE
-void L1_MFR::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    XMMz = _mm_sub_ps(_mm_set1_ps(N->r), XMMz);
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-              _mm_andnot_ps(_mm_set1_ps(-0.0f), XMMz)));
-    XMMerror = XMMloss;
-    XMMz = _mm_add_ps(_mm_and_ps(_mm_cmpgt_ps(XMMz, _mm_set1_ps(0.0f)),
-           _mm_set1_ps(1.0f)),
-           _mm_and_ps(_mm_cmplt_ps(XMMz, _mm_set1_ps(0.0f)),
-           _mm_set1_ps(-1.0f)));
-}
-#elif defined USEAVX
-void L1_MFR::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    XMMz = _mm256_sub_ps(_mm256_set1_ps(N->r), XMMz);
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm256_castps256_ps128(
-              _mm256_andnot_ps(_mm256_set1_ps(-0.0f), XMMz))));
-    XMMerror = XMMloss;
-    XMMz = _mm256_add_ps(_mm256_and_ps(_mm256_cmp_ps(XMMz,
-           _mm256_set1_ps(0.0f), _CMP_GT_OS), _mm256_set1_ps(1.0f)),
-           _mm256_and_ps(_mm256_cmp_ps(XMMz,
-           _mm256_set1_ps(0.0f), _CMP_LT_OS), _mm256_set1_ps(-1.0f)));
-}
-#else
-void L1_MFR::prepare_for_sg_update()
-{
-    calc_z(z, model.k, p, q);
-    z = N->r-z;
-    loss += abs(z);
-    error = loss;
-    if(z > 0)
-        z = 1;
-    else if(z < 0)
-        z = -1;
-}
-#endif
-
-class KL_MFR : public MFSolver
-{
-public:
-    KL_MFR(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
-           mf_model &model, mf_parameter param, bool &slow_only)
-        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#elif defined USEAVX
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#else
-    void prepare_for_sg_update();
-#endif
-};
-
-#if defined USESSE
-void KL_MFR::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    XMMz = _mm_div_ps(_mm_set1_ps(N->r), XMMz);
-    _mm_store_ss(&z, XMMz);
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-              _mm_set1_ps(N->r*(log(z)-1+1/z))));
-    XMMerror = XMMloss;
-    XMMz = _mm_sub_ps(XMMz, _mm_set1_ps(1.0f));
-}
-#elif defined USEAVX
-void KL_MFR::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    XMMz = _mm256_div_ps(_mm256_set1_ps(N->r), XMMz);
-    _mm_store_ss(&z, _mm256_castps256_ps128(XMMz));
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-              _mm_set1_ps(N->r*(log(z)-1+1/z))));
-    XMMerror = XMMloss;
-    XMMz = _mm256_sub_ps(XMMz, _mm256_set1_ps(1.0f));
-}
-#else
-void KL_MFR::prepare_for_sg_update()
-{
-    calc_z(z, model.k, p, q);
-    z = N->r/z;
-    loss += N->r*(log(z)-1+1/z);
-    error = loss;
-    z -= 1;
-}
-#endif
-
-class LR_MFC : public MFSolver
-{
-public:
-    LR_MFC(Scheduler &scheduler, vector<BlockBase*> &blocks,
-           mf_float *PG, mf_float *QG, mf_model &model,
-           mf_parameter param, bool &slow_only)
-        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#elif defined USEAVX
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#else
-    void prepare_for_sg_update();
-#endif
-};
-
-#if defined USESSE
-void LR_MFC::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    _mm_store_ss(&z, XMMz);
-    if(N->r > 0)
-    {
-        z = exp(-z);
-        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
-        XMMz = _mm_set1_ps(z/(1+z));
-    }
-    else
-    {
-        z = exp(z);
-        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
-        XMMz = _mm_set1_ps(-z/(1+z));
-    }
-    XMMerror = XMMloss;
-}
-#elif defined USEAVX
-void LR_MFC::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    _mm_store_ss(&z, _mm256_castps256_ps128(XMMz));
-    if(N->r > 0)
-    {
-        z = exp(-z);
-        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1.0+z)));
-        XMMz = _mm256_set1_ps(z/(1+z));
-    }
-    else
-    {
-        z = exp(z);
-        XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1.0+z)));
-        XMMz = _mm256_set1_ps(-z/(1+z));
-    }
-    XMMerror = XMMloss;
-}
-#else
-void LR_MFC::prepare_for_sg_update()
-{
-    calc_z(z, model.k, p, q);
-    if(N->r > 0)
-    {
-        z = exp(-z);
-        loss += log(1+z);
-        error = loss;
-        z = z/(1+z);
-    }
-    else
-    {
-        z = exp(z);
-        loss += log(1+z);
-        error = loss;
-        z = -z/(1+z);
-    }
-}
-#endif
-
-class L2_MFC : public MFSolver
-{
-public:
-    L2_MFC(Scheduler &scheduler, vector<BlockBase*> &blocks,
-           mf_float *PG, mf_float *QG, mf_model &model,
-           mf_parameter param, bool &slow_only)
-        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#elif defined USEAVX
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#else
-    void prepare_for_sg_update();
-#endif
-};
-
-#if defined USESSE
-void L2_MFC::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    if(N->r > 0)
-    {
-        __m128 mask = _mm_cmpgt_ps(XMMz, _mm_set1_ps(0.0f));
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
-                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
-        XMMz = _mm_max_ps(_mm_set1_ps(0.0f), _mm_sub_ps(
-               _mm_set1_ps(1.0f), XMMz));
-    }
-    else
-    {
-        __m128 mask = _mm_cmplt_ps(XMMz, _mm_set1_ps(0.0f));
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
-                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
-        XMMz = _mm_min_ps(_mm_set1_ps(0.0f), _mm_sub_ps(
-               _mm_set1_ps(-1.0f), XMMz));
-    }
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-              _mm_mul_ps(XMMz, XMMz)));
-}
-#elif defined USEAVX
-void L2_MFC::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    if(N->r > 0)
-    {
-        __m128 mask = _mm_cmpgt_ps(_mm256_castps256_ps128(XMMz),
-                      _mm_set1_ps(0.0f));
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
-                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
-        XMMz = _mm256_max_ps(_mm256_set1_ps(0.0f),
-               _mm256_sub_ps(_mm256_set1_ps(1.0f), XMMz));
-    }
-    else
-    {
-        __m128 mask = _mm_cmplt_ps(_mm256_castps256_ps128(XMMz),
-                      _mm_set1_ps(0.0f));
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
-                   _mm_and_ps(_mm_set1_ps(1.0f), mask)));
-        XMMz = _mm256_min_ps(_mm256_set1_ps(0.0f),
-               _mm256_sub_ps(_mm256_set1_ps(-1.0f), XMMz));
-    }
-    XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-              _mm_mul_ps(_mm256_castps256_ps128(XMMz),
-              _mm256_castps256_ps128(XMMz))));
-}
-#else
-void L2_MFC::prepare_for_sg_update()
-{
-    calc_z(z, model.k, p, q);
-    if(N->r > 0)
-    {
-        error += z > 0? 1: 0;
-        z = max(0.0f, 1-z);
-    }
-    else
-    {
-        error += z < 0? 1: 0;
-        z = min(0.0f, -1-z);
-    }
-    loss += z*z;
-}
-#endif
-
-class L1_MFC : public MFSolver
-{
-public:
-    L1_MFC(Scheduler &scheduler, vector<BlockBase*> &blocks, mf_float *PG, mf_float *QG,
-           mf_model &model, mf_parameter param, bool &slow_only)
-        : MFSolver(scheduler, blocks, PG, QG, model, param, slow_only) {}
-
-protected:
-#if defined USESSE
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#elif defined USEAVX
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-#else
-    void prepare_for_sg_update();
-#endif
-};
-
-#if defined USESSE
-void L1_MFC::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    if(N->r > 0)
-    {
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
-                   _mm_and_ps(_mm_cmpge_ps(XMMz, _mm_set1_ps(0.0f)),
-                   _mm_set1_ps(1.0f))));
-        XMMz = _mm_sub_ps(_mm_set1_ps(1.0f), XMMz);
-        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-                  _mm_max_ps(_mm_set1_ps(0.0f), XMMz)));
-        XMMz = _mm_and_ps(_mm_cmpge_ps(XMMz, _mm_set1_ps(0.0f)),
-               _mm_set1_ps(1.0f));
-    }
-    else
-    {
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(
-                   _mm_and_ps(_mm_cmplt_ps(XMMz, _mm_set1_ps(0.0f)),
-                   _mm_set1_ps(1.0f))));
-        XMMz = _mm_add_ps(_mm_set1_ps(1.0f), XMMz);
-        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(
-                  _mm_max_ps(_mm_set1_ps(0.0f), XMMz)));
-        XMMz = _mm_and_ps(_mm_cmpge_ps(XMMz, _mm_set1_ps(0.0f)),
-               _mm_set1_ps(-1.0f));
-    }
-}
-#elif defined USEAVX
-void L1_MFC::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    calc_z(XMMz, model.k, p, q);
-    if(N->r > 0)
-    {
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(_mm_and_ps(
-                   _mm_cmpge_ps(_mm256_castps256_ps128(XMMz),
-                   _mm_set1_ps(0.0f)), _mm_set1_ps(1.0f))));
-        XMMz = _mm256_sub_ps(_mm256_set1_ps(1.0f), XMMz);
-        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm_max_ps(
-                  _mm_set1_ps(0.0f), _mm256_castps256_ps128(XMMz))));
-        XMMz = _mm256_and_ps(_mm256_cmp_ps(XMMz, _mm256_set1_ps(0.0f),
-               _CMP_GE_OS), _mm256_set1_ps(1.0f));
-    }
-    else
-    {
-        XMMerror = _mm_add_pd(XMMerror, _mm_cvtps_pd(_mm_and_ps(
-                   _mm_cmplt_ps(_mm256_castps256_ps128(XMMz),
-                   _mm_set1_ps(0.0f)), _mm_set1_ps(1.0f))));
-        XMMz = _mm256_add_ps(_mm256_set1_ps(1.0f), XMMz);
-        XMMloss = _mm_add_pd(XMMloss, _mm_cvtps_pd(_mm_max_ps(
-                  _mm_set1_ps(0.0f), _mm256_castps256_ps128(XMMz))));
-        XMMz = _mm256_and_ps(_mm256_cmp_ps(XMMz, _mm256_set1_ps(0.0f),
-               _CMP_GE_OS), _mm256_set1_ps(-1.0f));
-    }
-}
-#else
-void L1_MFC::prepare_for_sg_update()
-{
-    calc_z(z, model.k, p, q);
-    if(N->r > 0)
-    {
-        loss += max(0.0f, 1-z);
-        error += z > 0? 1.0f: 0.0f;
-        z = z > 1? 0.0f: 1.0f;
-    }
-    else
-    {
-        loss += max(0.0f, 1+z);
-        error += z < 0? 1.0f: 0.0f;
-        z = z < -1? 0.0f: -1.0f;
-    }
-}
-#endif
-//--------------------------------------
-//------------One-class MF--------------
-//--------------------------------------
-
-class BPRSolver : public SolverBase
-{
-public:
-    BPRSolver(Scheduler &scheduler, vector<BlockBase*> &blocks,
-              mf_float *PG, mf_float *QG, mf_model &model, mf_parameter param,
-              bool &slow_only, bool is_column_oriented)
-        : SolverBase(scheduler, blocks, PG, QG, model, param, slow_only),
-                     is_column_oriented(is_column_oriented) {}
-
-protected:
-#if defined USESSE
-    static void calc_z(__m128 &XMMz, mf_int k,
-                       mf_float *p, mf_float *q, mf_float *w);
-    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
-    void prepare_for_sg_update(
-        __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-    void sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
-                   __m128 XMMlambda_p1, __m128 XMMlambda_q1,
-                   __m128 XMMlambda_p2, __m128 XMMlamdba_q2,
-                   __m128 XMMeta, __m128 XMMrk);
-    void finalize(__m128d XMMloss, __m128d XMMerror);
-#elif defined USEAVX
-    static void calc_z(__m256 &XMMz, mf_int k,
-                       mf_float *p, mf_float *q, mf_float *w);
-    void arrange_block(__m128d &XMMloss, __m128d &XMMerror);
-    void prepare_for_sg_update(
-        __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror);
-    void sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
-                   __m256 XMMlambda_p1, __m256 XMMlambda_q1,
-                   __m256 XMMlambda_p2, __m256 XMMlamdba_q2,
-                   __m256 XMMeta, __m256 XMMrk);
-    void finalize(__m128d XMMloss, __m128d XMMerror);
-#else
-    static void calc_z(mf_float &z, mf_int k,
-                       mf_float *p, mf_float *q, mf_float *w);
-    void arrange_block();
-    void prepare_for_sg_update();
-    void sg_update(mf_int d_begin, mf_int d_end, mf_float rk);
-    void finalize();
-#endif
-    void update() { ++pG; ++qG; ++wG; };
-    virtual void prepare_negative() = 0;
-
-    bool is_column_oriented;
-    mf_int bpr_bid;
-    mf_float *w;
-    mf_float *wG;
-};
+            if(pivot == map[pivot])
+            {
+                ++pivot;
+                continue;
+            }
 
+            mf_int next = map[pivot];
 
-#if defined USESSE
-inline void BPRSolver::calc_z(
-    __m128 &XMMz, mf_int k, mf_float *p, mf_float *q, mf_float *w)
-{
-    XMMz = _mm_setzero_ps();
-    for(mf_int d = 0; d < k; d += 4)
-        XMMz = _mm_add_ps(XMMz, _mm_mul_ps(_mm_load_ps(p+d),
-               _mm_sub_ps(_mm_load_ps(q+d), _mm_load_ps(w+d))));
-    // Bit-wise representation of 177 is {1,0}+{1,1}+{0,0}+{0,1} from
-    // high-bit to low-bit, where "+" means concatenating two arrays.
-    __m128 XMMtmp = _mm_add_ps(XMMz, _mm_shuffle_ps(XMMz, XMMz, 177));
-    // Bit-wise representation of 78 is {0,1}+{0,0}+{1,1}+{1,0} from
-    // high-bit to low-bit, where "+" means concatenating two arrays.
-    XMMz = _mm_add_ps(XMMz, _mm_shuffle_ps(XMMtmp, XMMtmp, 78));
-}
+            for(mf_int d = 0; d < k; ++d)
+                swap(*(vec+(mf_long)pivot*k+d), *(vec+(mf_long)next*k+d));
 
-void BPRSolver::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
-{
-    XMMloss = _mm_setzero_pd();
-    XMMerror = _mm_setzero_pd();
-    bid = scheduler.get_job();
-    block = blocks[bid];
-    block->reload();
-    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented);
-}
+            map[pivot] = map[next];
+            map[next] = next;
+        }
+    };
 
-void BPRSolver::finalize(__m128d XMMloss, __m128d XMMerror)
-{
-    _mm_store_sd(&loss, XMMloss);
-    _mm_store_sd(&error, XMMerror);
-    scheduler.put_job(bid, loss, error);
-    scheduler.put_bpr_job(bid, bpr_bid);
+    inv_shuffle1(model.P, p_map, model.m, model.k);
+    inv_shuffle1(model.Q, q_map, model.n, model.k);
 }
 
-void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, __m128 XMMz,
-                                 __m128 XMMlambda_p1, __m128 XMMlambda_q1,
-                                 __m128 XMMlambda_p2, __m128 XMMlambda_q2,
-                                 __m128 XMMeta, __m128 XMMrk)
+void Utility::shrink_model(mf_model &model, mf_int k_new)
 {
-    __m128 XMMpG = _mm_load1_ps(pG);
-    __m128 XMMqG = _mm_load1_ps(qG);
-    __m128 XMMwG = _mm_load1_ps(wG);
-    __m128 XMMeta_p = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMpG));
-    __m128 XMMeta_q = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMqG));
-    __m128 XMMeta_w = _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMwG));
-
-    __m128 XMMpG1 = _mm_setzero_ps();
-    __m128 XMMqG1 = _mm_setzero_ps();
-    __m128 XMMwG1 = _mm_setzero_ps();
+    mf_int k_old = model.k;
+    model.k = k_new;
 
-    for(mf_int d = d_begin; d < d_end; d += 4)
+    auto shrink1 = [&] (mf_float *ptr, mf_int size)
     {
-        __m128 XMMp = _mm_load_ps(p+d);
-        __m128 XMMq = _mm_load_ps(q+d);
-        __m128 XMMw = _mm_load_ps(w+d);
-
-        __m128 XMMpg = _mm_add_ps(_mm_mul_ps(XMMlambda_p2, XMMp),
-                       _mm_mul_ps(XMMz, _mm_sub_ps(XMMw, XMMq)));
-        __m128 XMMqg = _mm_sub_ps(_mm_mul_ps(XMMlambda_q2, XMMq),
-                       _mm_mul_ps(XMMz, XMMp));
-        __m128 XMMwg = _mm_add_ps(_mm_mul_ps(XMMlambda_q2, XMMw),
-                       _mm_mul_ps(XMMz, XMMp));
-
-        XMMpG1 = _mm_add_ps(XMMpG1, _mm_mul_ps(XMMpg, XMMpg));
-        XMMqG1 = _mm_add_ps(XMMqG1, _mm_mul_ps(XMMqg, XMMqg));
-        XMMwG1 = _mm_add_ps(XMMwG1, _mm_mul_ps(XMMwg, XMMwg));
+        for(mf_int i = 0; i < size; ++i)
+        {
+            mf_float *src = ptr+(mf_long)i*k_old;
+            mf_float *dst = ptr+(mf_long)i*k_new;
+            copy(src, src+k_new, dst);
+        }
+    };
 
-        XMMp = _mm_sub_ps(XMMp, _mm_mul_ps(XMMeta_p, XMMpg));
-        XMMq = _mm_sub_ps(XMMq, _mm_mul_ps(XMMeta_q, XMMqg));
-        XMMw = _mm_sub_ps(XMMw, _mm_mul_ps(XMMeta_w, XMMwg));
+    shrink1(model.P, model.m);
+    shrink1(model.Q, model.n);
+}
 
-        _mm_store_ps(p+d, XMMp);
-        _mm_store_ps(q+d, XMMq);
-        _mm_store_ps(w+d, XMMw);
-    }
+mf_problem* Utility::copy_problem(mf_problem const *prob, bool copy_data)
+{
+    mf_problem *new_prob = new mf_problem;
 
-    mf_float tmp = 0;
-    _mm_store_ss(&tmp, XMMlambda_p1);
-    if(tmp > 0)
+    if(prob == nullptr)
     {
-        for(mf_int d = d_begin; d < d_end; d += 4)
-        {
-            __m128 XMMp = _mm_load_ps(p+d);
-            __m128 XMMflip = _mm_and_ps(_mm_cmple_ps(XMMp, _mm_set1_ps(0.0f)),
-                             _mm_set1_ps(-0.0f));
-            XMMp = _mm_xor_ps(XMMflip,
-                   _mm_max_ps(_mm_sub_ps(_mm_xor_ps(XMMp, XMMflip),
-                   _mm_mul_ps(XMMeta_p, XMMlambda_p1)), _mm_set1_ps(0.0f)));
-            _mm_store_ps(p+d, XMMp);
-        }
-    }
+        new_prob->m = 0;
+        new_prob->n = 0;
+        new_prob->nnz = 0;
+        new_prob->R = nullptr;
 
-    _mm_store_ss(&tmp, XMMlambda_q1);
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 4)
-        {
-            __m128 XMMq = _mm_load_ps(q+d);
-            __m128 XMMw = _mm_load_ps(w+d);
-            __m128 XMMflip = _mm_and_ps(_mm_cmple_ps(XMMq, _mm_set1_ps(0.0f)),
-                             _mm_set1_ps(-0.0f));
-            XMMq = _mm_xor_ps(XMMflip,
-                   _mm_max_ps(_mm_sub_ps(_mm_xor_ps(XMMq, XMMflip),
-                   _mm_mul_ps(XMMeta_q, XMMlambda_q1)), _mm_set1_ps(0.0f)));
-            _mm_store_ps(q+d, XMMq);
-
-
-            XMMflip = _mm_and_ps(_mm_cmple_ps(XMMw, _mm_set1_ps(0.0f)),
-                    _mm_set1_ps(-0.0f));
-            XMMw = _mm_xor_ps(XMMflip,
-                   _mm_max_ps(_mm_sub_ps(_mm_xor_ps(XMMw, XMMflip),
-                   _mm_mul_ps(XMMeta_w, XMMlambda_q1)), _mm_set1_ps(0.0f)));
-            _mm_store_ps(w+d, XMMw);
-        }
+        return new_prob;
     }
 
-    if(param.do_nmf)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 4)
-        {
-            __m128 XMMp = _mm_load_ps(p+d);
-            __m128 XMMq = _mm_load_ps(q+d);
-            __m128 XMMw = _mm_load_ps(w+d);
-            XMMp = _mm_max_ps(XMMp, _mm_set1_ps(0.0f));
-            XMMq = _mm_max_ps(XMMq, _mm_set1_ps(0.0f));
-            XMMw = _mm_max_ps(XMMw, _mm_set1_ps(0.0f));
-            _mm_store_ps(p+d, XMMp);
-            _mm_store_ps(q+d, XMMq);
-            _mm_store_ps(w+d, XMMw);
-        }
-    }
+    new_prob->m = prob->m;
+    new_prob->n = prob->n;
+    new_prob->nnz = prob->nnz;
 
-    // Update learning rate of latent vector p. Squared derivatives along all
-    // latent dimensions will be computed above. Here their average will be
-    // added into the associated squared-gradient sum.
-    __m128 XMMtmp = _mm_add_ps(XMMpG1, _mm_movehl_ps(XMMpG1, XMMpG1));
-    XMMpG1 = _mm_add_ps(XMMpG1, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
-    XMMpG = _mm_add_ps(XMMpG, _mm_mul_ps(XMMpG1, XMMrk));
-    _mm_store_ss(pG, XMMpG);
-
-    // Similar code is used to update learning rate of latent vector q.
-    XMMtmp = _mm_add_ps(XMMqG1, _mm_movehl_ps(XMMqG1, XMMqG1));
-    XMMqG1 = _mm_add_ps(XMMqG1, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
-    XMMqG = _mm_add_ps(XMMqG, _mm_mul_ps(XMMqG1, XMMrk));
-    _mm_store_ss(qG, XMMqG);
-
-    // Similar code is used to update learning rate of latent vector w.
-    XMMtmp = _mm_add_ps(XMMwG1, _mm_movehl_ps(XMMwG1, XMMwG1));
-    XMMwG1 = _mm_add_ps(XMMwG1, _mm_shuffle_ps(XMMtmp, XMMtmp, 1));
-    XMMwG = _mm_add_ps(XMMwG, _mm_mul_ps(XMMwG1, XMMrk));
-    _mm_store_ss(wG, XMMwG);
-}
-
-void BPRSolver::prepare_for_sg_update(
-    __m128 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
-{
-    prepare_negative();
-    calc_z(XMMz, model.k, p, q, w);
-    _mm_store_ss(&z, XMMz);
-    z = exp(-z);
-    XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
-    XMMerror = XMMloss;
-    XMMz = _mm_set1_ps(z/(1+z));
-}
-#elif defined USEAVX
-inline void BPRSolver::calc_z(
-    __m256 &XMMz, mf_int k, mf_float *p, mf_float *q, mf_float *w)
-{
-    XMMz = _mm256_setzero_ps();
-    for(mf_int d = 0; d < k; d += 8)
-        XMMz = _mm256_add_ps(XMMz, _mm256_mul_ps(
-               _mm256_load_ps(p+d), _mm256_sub_ps(
-               _mm256_load_ps(q+d), _mm256_load_ps(w+d))));
-    XMMz = _mm256_add_ps(XMMz, _mm256_permute2f128_ps(XMMz, XMMz, 0x1));
-    XMMz = _mm256_hadd_ps(XMMz, XMMz);
-    XMMz = _mm256_hadd_ps(XMMz, XMMz);
-}
-
-void BPRSolver::arrange_block(__m128d &XMMloss, __m128d &XMMerror)
-{
-    XMMloss = _mm_setzero_pd();
-    XMMerror = _mm_setzero_pd();
-    bid = scheduler.get_job();
-    block = blocks[bid];
-    block->reload();
-    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented);
-}
-
-void BPRSolver::finalize(__m128d XMMloss, __m128d XMMerror)
-{
-    _mm_store_sd(&loss, XMMloss);
-    _mm_store_sd(&error, XMMerror);
-    scheduler.put_job(bid, loss, error);
-    scheduler.put_bpr_job(bid, bpr_bid);
-}
-
-void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, __m256 XMMz,
-                                 __m256 XMMlambda_p1, __m256 XMMlambda_q1,
-                                 __m256 XMMlambda_p2, __m256 XMMlambda_q2,
-                                 __m256 XMMeta, __m256 XMMrk)
-{
-    __m256 XMMpG = _mm256_broadcast_ss(pG);
-    __m256 XMMqG = _mm256_broadcast_ss(qG);
-    __m256 XMMwG = _mm256_broadcast_ss(wG);
-    __m256 XMMeta_p =
-        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMpG));
-    __m256 XMMeta_q =
-        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMqG));
-    __m256 XMMeta_w =
-        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMwG));
-
-    __m256 XMMpG1 = _mm256_setzero_ps();
-    __m256 XMMqG1 = _mm256_setzero_ps();
-    __m256 XMMwG1 = _mm256_setzero_ps();
-
-    for(mf_int d = d_begin; d < d_end; d += 8)
-    {
-        __m256 XMMp = _mm256_load_ps(p+d);
-        __m256 XMMq = _mm256_load_ps(q+d);
-        __m256 XMMw = _mm256_load_ps(w+d);
-        __m256 XMMpg = _mm256_add_ps(_mm256_mul_ps(XMMlambda_p2, XMMp),
-                       _mm256_mul_ps(XMMz, _mm256_sub_ps(XMMw, XMMq)));
-        __m256 XMMqg = _mm256_sub_ps(_mm256_mul_ps(XMMlambda_q2, XMMq),
-                       _mm256_mul_ps(XMMz, XMMp));
-        __m256 XMMwg = _mm256_add_ps(_mm256_mul_ps(XMMlambda_q2, XMMw),
-                       _mm256_mul_ps(XMMz, XMMp));
-
-        XMMpG1 = _mm256_add_ps(XMMpG1, _mm256_mul_ps(XMMpg, XMMpg));
-        XMMqG1 = _mm256_add_ps(XMMqG1, _mm256_mul_ps(XMMqg, XMMqg));
-        XMMwG1 = _mm256_add_ps(XMMwG1, _mm256_mul_ps(XMMwg, XMMwg));
-
-        XMMp = _mm256_sub_ps(XMMp, _mm256_mul_ps(XMMeta_p, XMMpg));
-        XMMq = _mm256_sub_ps(XMMq, _mm256_mul_ps(XMMeta_q, XMMqg));
-        XMMw = _mm256_sub_ps(XMMw, _mm256_mul_ps(XMMeta_w, XMMwg));
-
-        _mm256_store_ps(p+d, XMMp);
-        _mm256_store_ps(q+d, XMMq);
-        _mm256_store_ps(w+d, XMMw);
-    }
-
-    mf_float tmp = 0;
-    _mm_store_ss(&tmp, _mm256_castps256_ps128(XMMlambda_p1));
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 8)
+    if(copy_data)
+    {
+        try
         {
-            __m256 XMMp = _mm256_load_ps(p+d);
-            __m256 XMMflip =
-                _mm256_and_ps(
-                _mm256_cmp_ps(XMMp, _mm256_set1_ps(0.0f), _CMP_LE_OS),
-                _mm256_set1_ps(-0.0f));
-            XMMp = _mm256_xor_ps(XMMflip,
-                   _mm256_max_ps(_mm256_sub_ps(_mm256_xor_ps(XMMp, XMMflip),
-                   _mm256_mul_ps(XMMeta_p, XMMlambda_p1)),
-                   _mm256_set1_ps(0.0f)));
-            _mm256_store_ps(p+d, XMMp);
+            new_prob->R = new mf_node[static_cast<size_t>(prob->nnz)];
+            copy(prob->R, prob->R+prob->nnz, new_prob->R);
         }
-    }
-
-    _mm_store_ss(&tmp, _mm256_castps256_ps128(XMMlambda_q1));
-    if(tmp > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; d += 8)
+        catch(...)
         {
-            __m256 XMMq = _mm256_load_ps(q+d);
-            __m256 XMMw = _mm256_load_ps(w+d);
-            __m256 XMMflip;
-
-            XMMflip = _mm256_and_ps(
-                      _mm256_cmp_ps(XMMq, _mm256_set1_ps(0.0f), _CMP_LE_OS),
-                      _mm256_set1_ps(-0.0f));
-            XMMq = _mm256_xor_ps(XMMflip,
-                   _mm256_max_ps(_mm256_sub_ps(_mm256_xor_ps(XMMq, XMMflip),
-                   _mm256_mul_ps(XMMeta_q, XMMlambda_q1)),
-                   _mm256_set1_ps(0.0f)));
-            _mm256_store_ps(q+d, XMMq);
-
-
-            XMMflip = _mm256_and_ps(
-                      _mm256_cmp_ps(XMMw, _mm256_set1_ps(0.0f), _CMP_LE_OS),
-                      _mm256_set1_ps(-0.0f));
-            XMMw = _mm256_xor_ps(XMMflip,
-                   _mm256_max_ps(_mm256_sub_ps(_mm256_xor_ps(XMMw, XMMflip),
-                   _mm256_mul_ps(XMMeta_w, XMMlambda_q1)),
-                   _mm256_set1_ps(0.0f)));
-            _mm256_store_ps(w+d, XMMw);
+            delete new_prob;
+            throw;
         }
     }
-
-    if(param.do_nmf)
+    else
     {
-        for(mf_int d = d_begin; d < d_end; d += 8)
-        {
-            __m256 XMMp = _mm256_load_ps(p+d);
-            __m256 XMMq = _mm256_load_ps(q+d);
-            __m256 XMMw = _mm256_load_ps(w+d);
-            XMMp = _mm256_max_ps(XMMp, _mm256_set1_ps(0.0f));
-            XMMq = _mm256_max_ps(XMMq, _mm256_set1_ps(0.0f));
-            XMMw = _mm256_max_ps(XMMw, _mm256_set1_ps(0.0f));
-            _mm256_store_ps(p+d, XMMp);
-            _mm256_store_ps(q+d, XMMq);
-            _mm256_store_ps(w+d, XMMw);
-        }
+        new_prob->R = prob->R;
     }
 
-    XMMpG1 = _mm256_add_ps(XMMpG1,
-             _mm256_permute2f128_ps(XMMpG1, XMMpG1, 0x1));
-    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
-    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
-
-    XMMqG1 = _mm256_add_ps(XMMqG1,
-             _mm256_permute2f128_ps(XMMqG1, XMMqG1, 0x1));
-    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
-    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
-
-    XMMwG1 = _mm256_add_ps(XMMwG1,
-             _mm256_permute2f128_ps(XMMwG1, XMMwG1, 0x1));
-    XMMwG1 = _mm256_hadd_ps(XMMwG1, XMMwG1);
-    XMMwG1 = _mm256_hadd_ps(XMMwG1, XMMwG1);
+    return new_prob;
+}
 
-    XMMpG = _mm256_add_ps(XMMpG, _mm256_mul_ps(XMMpG1, XMMrk));
-    XMMqG = _mm256_add_ps(XMMqG, _mm256_mul_ps(XMMqG1, XMMrk));
-    XMMwG = _mm256_add_ps(XMMwG, _mm256_mul_ps(XMMwG1, XMMrk));
+//--------------------------------------
+//---------------Solvers----------------
+//--------------------------------------
 
-    _mm_store_ss(pG, _mm256_castps256_ps128(XMMpG));
-    _mm_store_ss(qG, _mm256_castps256_ps128(XMMqG));
-    _mm_store_ss(wG, _mm256_castps256_ps128(XMMwG));
-}
+// The part of a solver that fpsg_core() works with
+class Solver
+{
+public:
+    virtual void run() = 0;
+    virtual vector<mf_thread_stats> const &get_stats() const = 0;
+    virtual void set_node(mf_int node) = 0;
+    virtual ~Solver() = default;
+};
 
-void BPRSolver::prepare_for_sg_update(
-    __m256 &XMMz, __m128d &XMMloss, __m128d &XMMerror)
+// The solvers are compiled once for each instruction set, each time in its
+// own namespace, and SolverFactory chooses one of them when the training
+// starts. The compiler may use the instruction set in every function of
+// its namespace, since they only run on CPUs that support it. The AVX2 and
+// AVX-512 ones also have kernels for the common numbers of factors, which
+// mf-solver-dims.h adds to their namespaces
+namespace simd_none
 {
-    prepare_negative();
-    calc_z(XMMz, model.k, p, q, w);
-    _mm_store_ss(&z, _mm256_castps256_ps128(XMMz));
-    z = exp(-z);
-    XMMloss = _mm_add_pd(XMMloss, _mm_set1_pd(log(1+z)));
-    XMMerror = XMMloss;
-    XMMz = _mm256_set1_ps(z/(1+z));
+#include "mf-solver.h"
 }
+
+#if defined RECO_SIMD_X86
+
+#if defined __clang__
+#pragma clang attribute push(__attribute__((target("sse3"))), apply_to = function)
 #else
-inline void BPRSolver::calc_z(
-    mf_float &z, mf_int k, mf_float *p, mf_float *q, mf_float *w)
+#pragma GCC push_options
+#pragma GCC target("sse3")
+#endif
+namespace simd_sse
 {
-    z = 0;
-    for(mf_int d = 0; d < k; ++d)
-        z += p[d]*(q[d]-w[d]);
+#define USESSE
+#include "mf-solver.h"
+#undef USESSE
 }
+#if defined __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
 
-void BPRSolver::arrange_block()
-{
-    loss = 0.0;
-    error = 0.0;
-    bid = scheduler.get_job();
-    block = blocks[bid];
-    block->reload();
-    bpr_bid = scheduler.get_bpr_job(bid, is_column_oriented);
-}
+#if defined RECO_SIMD_AVX
 
-void BPRSolver::finalize()
+#if defined __clang__
+#pragma clang attribute push(__attribute__((target("avx"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx")
+#endif
+namespace simd_avx
 {
-    scheduler.put_job(bid, loss, error);
-    scheduler.put_bpr_job(bid, bpr_bid);
+#define USEAVX
+#include "mf-solver.h"
+#undef USEAVX
 }
+#if defined __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
 
-void BPRSolver::sg_update(mf_int d_begin, mf_int d_end, mf_float rk)
+// The AVX kernels with fused multiply-add, where the compiler also has the
+// AVX2 instructions
+#if defined __clang__
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace simd_avx2
 {
-    mf_float eta_p = param.eta*qrsqrt(*pG);
-    mf_float eta_q = param.eta*qrsqrt(*qG);
-    mf_float eta_w = param.eta*qrsqrt(*wG);
+#define USEAVX
+#define USEFMA
+#include "mf-solver.h"
+#include "mf-solver-dims.h"
+#undef USEFMA
+#undef USEAVX
+}
+#if defined __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
 
-    mf_float pG1 = 0;
-    mf_float qG1 = 0;
-    mf_float wG1 = 0;
+#if defined RECO_SIMD_AVX512
 
-    for(mf_int d = d_begin; d < d_end; ++d)
-    {
-        mf_float gp = z*(w[d]-q[d]) + lambda_p2*p[d];
-        mf_float gq = -z*p[d] + lambda_q2*q[d];
-        mf_float gw = z*p[d] + lambda_q2*w[d];
+// The vectors of 16 floats are also the alignment of the model. The slow
+// part of the factors still ends in the middle of the first vector
+#if defined __clang__
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace simd_avx512
+{
+mf_int const kALIGN = 16;
+#define USEAVX512
+#include "mf-solver.h"
+#include "mf-solver-dims.h"
+#undef USEAVX512
+}
+#if defined __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
 
-        pG1 += gp*gp;
-        qG1 += gq*gq;
-        wG1 += gw*gw;
+#endif // RECO_SIMD_AVX512
 
-        p[d] -= eta_p*gp;
-        q[d] -= eta_q*gq;
-        w[d] -= eta_w*gw;
-    }
+#endif // RECO_SIMD_AVX
 
-    if(lambda_p1 > 0)
-    {
-        for(mf_int d = d_begin; d < d_end; ++d)
-        {
-            mf_float p1 = max(abs(p[d])-lambda_p1*eta_p, 0.0f);
-            p[d] = p[d] >= 0? p1: -p1;
-        }
-    }
+#endif // RECO_SIMD_X86
 
-    if(lambda_q1 > 0)
+// Whether the kernels of an instruction set are compiled in and the CPU
+// supports them
+bool simd_supported(mf_int simd)
+{
+    switch(simd)
     {
-        for(mf_int d = d_begin; d < d_end; ++d)
-        {
-            mf_float q1 = max(abs(w[d])-lambda_q1*eta_w, 0.0f);
-            w[d] = w[d] >= 0? q1: -q1;
-            q1 = max(abs(q[d])-lambda_q1*eta_q, 0.0f);
-            q[d] = q[d] >= 0? q1: -q1;
-        }
+        case SIMD_NONE:
+            return true;
+#if defined RECO_SIMD_X86
+        case SIMD_SSE:
+            return Reco::cpu_features().sse3;
+#if defined RECO_SIMD_AVX
+        case SIMD_AVX:
+            return Reco::cpu_features().avx;
+        case SIMD_AVX2:
+            return Reco::cpu_features().avx2 && Reco::cpu_features().fma;
+#endif
+#if defined RECO_SIMD_AVX512
+        case SIMD_AVX512:
+            return Reco::cpu_features().avx512f;
+#endif
+#endif
+        default:
+            return false;
     }
+}
 
-    if(param.do_nmf)
+// The instruction set of the kernels for param.simd, which is the widest
+// one supported for SIMD_AUTO
+mf_int choose_simd(mf_int simd)
+{
+    if(simd != SIMD_AUTO)
+        return simd;
+    for(simd = SIMD_AVX512; simd > SIMD_NONE; simd--)
     {
-        for(mf_int d = d_begin; d < d_end; ++d)
-        {
-            p[d] = max(p[d], (mf_float)0.0);
-            q[d] = max(q[d], (mf_float)0.0);
-            w[d] = max(w[d], (mf_float)0.0);
-        }
+        if(simd_supported(simd))
+            break;
     }
-
-    *pG += pG1*rk;
-    *qG += qG1*rk;
-    *wG += wG1*rk;
+    return simd;
 }
 
-void BPRSolver::prepare_for_sg_update()
+// The padding of the rows of the model for the kernels of param.simd
+mf_int simd_align(mf_int simd)
 {
-    prepare_negative();
-    calc_z(z, model.k, p, q, w);
-    z = exp(-z);
-    loss += log(1+z);
-    error = loss;
-    z = z/(1+z);
-}
+#if defined RECO_SIMD_AVX512
+    if(choose_simd(simd) == SIMD_AVX512)
+        return simd_avx512::kALIGN;
+#else
+    (void) simd;
 #endif
+    return kALIGN;
+}
 
-class COL_BPR_MFOC : public BPRSolver
+// Makes the calling thread flush denormal results to zero until it is
+// destroyed, so that tiny factors do not slow down the vector kernels
+class FlushZero
 {
 public:
-    COL_BPR_MFOC(Scheduler &scheduler, vector<BlockBase*> &blocks,
-                 mf_float *PG, mf_float *QG, mf_model &model,
-                 mf_parameter param, bool &slow_only,
-                 bool is_column_oriented=true)
-        : BPRSolver(scheduler, blocks, PG, QG, model, param,
-                    slow_only, is_column_oriented) {}
-protected:
-#if defined USESSE
-    void load_fixed_variables(
-        __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
-        __m128 &XMMlambda_p2, __m128 &XMMlabmda_q2,
-        __m128 &XMMeta, __m128 &XMMrk_slow,
-        __m128 &XMMrk_fast);
-#elif defined USEAVX
-    void load_fixed_variables(
-        __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
-        __m256 &XMMlambda_p2, __m256 &XMMlabmda_q2,
-        __m256 &XMMeta, __m256 &XMMrk_slow,
-        __m256 &XMMrk_fast);
+    FlushZero(bool enable)
+    {
+#if defined RECO_SIMD_X86
+        mode = _MM_GET_FLUSH_ZERO_MODE();
+        if(enable)
+            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #else
-    void load_fixed_variables();
+        (void) enable;
 #endif
-    void prepare_negative();
-};
-
-void COL_BPR_MFOC::prepare_negative()
-{
-    mf_int negative = scheduler.get_negative(bid, bpr_bid, model.m, model.n,
-                                             is_column_oriented);
-    w = model.P + negative*model.k;
-    wG = PG + negative*2;
-    swap(p, q);
-    swap(pG, qG);
-}
-
-#if defined USESSE
-void COL_BPR_MFOC::load_fixed_variables(
-    __m128 &XMMlambda_p1, __m128 &XMMlambda_q1,
-    __m128 &XMMlambda_p2, __m128 &XMMlambda_q2,
-    __m128 &XMMeta, __m128 &XMMrk_slow,
-    __m128 &XMMrk_fast)
-{
-    XMMlambda_p1 = _mm_set1_ps(param.lambda_q1);
-    XMMlambda_q1 = _mm_set1_ps(param.lambda_p1);
-    XMMlambda_p2 = _mm_set1_ps(param.lambda_q2);
-    XMMlambda_q2 = _mm_set1_ps(param.lambda_p2);
-    XMMeta = _mm_set1_ps(param.eta);
-    XMMrk_slow = _mm_set1_ps((mf_float)1.0/kALIGN);
-    XMMrk_fast = _mm_set1_ps((mf_float)1.0/(model.k-kALIGN));
-}
-#elif defined USEAVX
-void COL_BPR_MFOC::load_fixed_variables(
-    __m256 &XMMlambda_p1, __m256 &XMMlambda_q1,
-    __m256 &XMMlambda_p2, __m256 &XMMlambda_q2,
-    __m256 &XMMeta, __m256 &XMMrk_slow,
-    __m256 &XMMrk_fast)
-{
-    XMMlambda_p1 = _mm256_set1_ps(param.lambda_q1);
-    XMMlambda_q1 = _mm256_set1_ps(param.lambda_p1);
-    XMMlambda_p2 = _mm256_set1_ps(param.lambda_q2);
-    XMMlambda_q2 = _mm256_set1_ps(param.lambda_p2);
-    XMMeta = _mm256_set1_ps(param.eta);
-    XMMrk_slow = _mm256_set1_ps((mf_float)1.0/kALIGN);
-    XMMrk_fast = _mm256_set1_ps((mf_float)1.0/(model.k-kALIGN));
-}
-#else
-void COL_BPR_MFOC::load_fixed_variables()
-{
-    lambda_p1 = param.lambda_q1;
-    lambda_q1 = param.lambda_p1;
-    lambda_p2 = param.lambda_q2;
-    lambda_q2 = param.lambda_p2;
-    rk_slow = (mf_float)1.0/kALIGN;
-    rk_fast = (mf_float)1.0/(model.k-kALIGN);
-}
+    }
+    ~FlushZero()
+    {
+#if defined RECO_SIMD_X86
+        _MM_SET_FLUSH_ZERO_MODE(mode);
 #endif
+    }
+    FlushZero(const FlushZero&) = delete;
+    FlushZero& operator=(const FlushZero&) = delete;
 
-class ROW_BPR_MFOC : public BPRSolver
-{
-public:
-    ROW_BPR_MFOC(Scheduler &scheduler, vector<BlockBase*> &blocks,
-                 mf_float *PG, mf_float *QG, mf_model &model,
-                 mf_parameter param, bool &slow_only,
-                 bool is_column_oriented = false)
-        : BPRSolver(scheduler, blocks, PG, QG, model, param,
-                    slow_only, is_column_oriented) {}
-protected:
-    void prepare_negative();
+private:
+#if defined RECO_SIMD_X86
+    unsigned int mode;
+#endif
 };
 
-void ROW_BPR_MFOC::prepare_negative()
-{
-    mf_int negative = scheduler.get_negative(bid, bpr_bid, model.m, model.n,
-                                             is_column_oriented);
-    w = model.Q + negative*model.k;
-    wG = QG + negative*2;
-}
-
-
 class SolverFactory
 {
 public:
-    static shared_ptr<SolverBase> get_solver(
+    static shared_ptr<Solver> get_solver(
         Scheduler &scheduler,
         vector<BlockBase*> &blocks,
         mf_float *PG,
         mf_float *QG,
         mf_model &model,
         mf_parameter param,
-        bool &slow_only);
+        atomic<bool> &slow_only);
 };
 
-shared_ptr<SolverBase> SolverFactory::get_solver(
+shared_ptr<Solver> SolverFactory::get_solver(
     Scheduler &scheduler,
     vector<BlockBase*> &blocks,
     mf_float *PG,
     mf_float *QG,
     mf_model &model,
     mf_parameter param,
-    bool &slow_only)
-{
-    shared_ptr<SolverBase> solver;
+    atomic<bool> &slow_only)
+{
+    switch(choose_simd(param.simd))
+    {
+#if defined RECO_SIMD_X86
+        case SIMD_SSE:
+            return simd_sse::make_solver(scheduler, blocks, PG, QG,
+                                         model, param, slow_only);
+#if defined RECO_SIMD_AVX
+        case SIMD_AVX:
+            return simd_avx::make_solver(scheduler, blocks, PG, QG,
+                                         model, param, slow_only);
+        case SIMD_AVX2:
+            return simd_avx2::make_solver_dim(scheduler, blocks, PG, QG,
+                                              model, param, slow_only);
+#endif
+#if defined RECO_SIMD_AVX512
+        case SIMD_AVX512:
+            return simd_avx512::make_solver_dim(scheduler, blocks, PG, QG,
+                                                model, param, slow_only);
+#endif
+#endif
+        default:
+            return simd_none::make_solver(scheduler, blocks, PG, QG,
+                                          model, param, slow_only);
+    }
+}
 
-    switch(param.fun)
+// The training status is computed with the kernels of the CPU
+mf_float Utility::inner_product(mf_float *p, mf_float *q, mf_int k)
+{
+    switch(choose_simd(SIMD_AUTO))
     {
-        case P_L2_MFR:
-            solver = shared_ptr<SolverBase>(new L2_MFR(scheduler, blocks,
-                        PG, QG, model, param, slow_only));
-            break;
-        case P_L1_MFR:
-            solver = shared_ptr<SolverBase>(new L1_MFR(scheduler, blocks,
-                        PG, QG, model, param, slow_only));
-            break;
-        case P_KL_MFR:
-            solver = shared_ptr<SolverBase>(new KL_MFR(scheduler, blocks,
-                        PG, QG, model, param, slow_only));
-            break;
-        case P_LR_MFC:
-            solver = shared_ptr<SolverBase>(new LR_MFC(scheduler, blocks,
-                        PG, QG, model, param, slow_only));
-            break;
-        case P_L2_MFC:
-            solver = shared_ptr<SolverBase>(new L2_MFC(scheduler, blocks,
-                        PG, QG, model, param, slow_only));
-            break;
-        case P_L1_MFC:
-            solver = shared_ptr<SolverBase>(new L1_MFC(scheduler, blocks,
-                        PG, QG, model, param, slow_only));
-            break;
-        case P_ROW_BPR_MFOC:
-            solver = shared_ptr<SolverBase>(new ROW_BPR_MFOC(scheduler,
-                        blocks, PG, QG, model, param, slow_only));
-            break;
-        case P_COL_BPR_MFOC:
-            solver = shared_ptr<SolverBase>(new COL_BPR_MFOC(scheduler,
-                        blocks, PG, QG, model, param, slow_only));
-            break;
+#if defined RECO_SIMD_X86
+        case SIMD_SSE:
+            return simd_sse::inner_product(p, q, k);
+#if defined RECO_SIMD_AVX
+        case SIMD_AVX:
+            return simd_avx::inner_product(p, q, k);
+        case SIMD_AVX2:
+            return simd_avx2::inner_product(p, q, k);
+#endif
+#if defined RECO_SIMD_AVX512
+        case SIMD_AVX512:
+            return simd_avx512::inner_product(p, q, k);
+#endif
+#endif
         default:
-            throw invalid_argument("unknown error function");
+            return simd_none::inner_product(p, q, k);
     }
-    return solver;
+}
+
+// The solvers of BPR losses take pairs of blocks from the priority queue,
+// which only the locked mode of Scheduler supports
+bool use_lock_free_scheduler(mf_parameter const &param)
+{
+    return param.lock_free_scheduler &&
+           param.fun != P_ROW_BPR_MFOC &&
+           param.fun != P_COL_BPR_MFOC;
+}
+
+// Scheduler::get_negative() draws negative samples from the equal-width
+// segment of a bin, so BPR losses cannot use balanced bins
+bool use_balanced_bins(mf_parameter const &param)
+{
+    return param.balance_bins &&
+           param.fun != P_ROW_BPR_MFOC &&
+           param.fun != P_COL_BPR_MFOC;
+}
+
+// The placement of the threads on the NUMA nodes follows the bins that
+// Utility::grid_problem() has chosen from omega_p and omega_q
+NumaLayout make_numa_layout(mf_parameter const &param,
+                            vector<mf_int> const &omega_p,
+                            vector<mf_int> const &omega_q)
+{
+    if(!param.pin_threads)
+        return NumaLayout();
+    bool balance = use_balanced_bins(param);
+    return NumaLayout(param.nr_threads, param.nr_bins, true,
+                      Utility::gen_bin_map(omega_p, param.nr_bins, balance),
+                      Utility::gen_bin_map(omega_q, param.nr_bins, balance));
 }
 
 void fpsg_core(
@@ -2900,13 +2502,10 @@ void fpsg_core(
     vector<mf_int> &omega_p,
     vector<mf_int> &omega_q,
     shared_ptr<mf_model> &model,
+    NumaLayout const &layout,
     vector<mf_int> cv_blocks,
     mf_double *cv_error)
 {
-#if defined USESSE || defined USEAVX
-    auto flush_zero_mode = _MM_GET_FLUSH_ZERO_MODE();
-    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-#endif
     if(tr->nnz == 0)
     {
         Rcout << "warning: train on an empty training set" << endl;
@@ -2935,6 +2534,9 @@ void fpsg_core(
 
     if(!param.quiet)
     {
+        Rcout << "block imbalance (max/mean nnz): " << fixed << setprecision(2)
+              << Utility::calc_imbalance(block_ptrs, cv_blocks) << "\n";
+
         Rcout.width(4);
         Rcout << "iter";
         Rcout.width(13);
@@ -2949,30 +2551,67 @@ void fpsg_core(
         Rcout << "\n";
     }
 
-    bool slow_only = param.lambda_p1 == 0 && param.lambda_q1 == 0? true: false;
-    vector<mf_float> PG(model->m*2, 1), QG(model->n*2, 1);
+    atomic<bool> slow_only(param.lambda_p1 == 0 && param.lambda_q1 == 0? true: false);
+    unique_ptr<mf_float[]> PG(new mf_float[(mf_long)model->m*2]);
+    unique_ptr<mf_float[]> QG(new mf_float[(mf_long)model->n*2]);
+    layout.first_touch(PG.get(), model->m, 2, true, 1);
+    layout.first_touch(QG.get(), model->n, 2, false, 1);
+    if(layout.is_active())
+        sched.set_nr_nodes(layout.get_nr_nodes());
+    sched.set_nr_iters(param.nr_iters);
 
-    vector<shared_ptr<SolverBase>> solvers(param.nr_threads);
-    vector<thread> threads;
-    threads.reserve(param.nr_threads);
+    vector<shared_ptr<Solver>> solvers(param.nr_threads);
     for(mf_int i = 0; i < param.nr_threads; ++i)
     {
         solvers[i] = SolverFactory::get_solver(sched, block_ptrs,
-                                               PG.data(), QG.data(),
+                                               PG.get(), QG.get(),
                                                *model, param, slow_only);
-        threads.emplace_back(&SolverBase::run, solvers[i].get());
+        if(layout.is_active())
+            solvers[i]->set_node(layout.thread_node(i));
     }
 
+    // The solvers run on threads of the pool, which are kept for the next
+    // call, while this thread schedules the epochs
+    bool flush_zero = choose_simd(param.simd) != SIMD_NONE;
+    Reco::ThreadPool::Job job = Reco::ThreadPool::global().start(
+        param.nr_threads, [&] (mf_int i)
+    {
+        FlushZero flush_zero_mode(flush_zero);
+        layout.pin(i);
+        solvers[i]->run();
+        layout.unpin();
+    });
+
+    // Without the barrier the solvers keep their threads busy while the
+    // statistics of an epoch are computed, so this thread computes them
+    // alone instead of taking more threads from the pool
+    Utility epoch_util(param.fun, param.async_epochs? 1: param.nr_threads);
+
     for(mf_int iter = 0; iter < param.nr_iters; ++iter)
     {
         sched.wait_for_jobs_done();
 
+        auto next_epoch = [&] ()
+        {
+            if(iter == 0)
+                slow_only = false;
+            if(iter == param.nr_iters - 1)
+                sched.terminate();
+            sched.resume();
+        };
+
+        // Without the barrier, the solvers continue with the next epoch
+        // while the statistics of this one are computed from the model
+        // being updated, so they are approximate
+        if(param.async_epochs)
+            next_epoch();
+
         if(!param.quiet)
         {
             mf_double reg = 0;
-            mf_double reg1 = util.calc_reg1(*model, param.lambda_p1,
+            mf_double reg1 = epoch_util.calc_reg1(*model, param.lambda_p1,
                              param.lambda_q1, omega_p, omega_q);
-            mf_double reg2 = util.calc_reg2(*model, param.lambda_p2,
+            mf_double reg2 = epoch_util.calc_reg2(*model, param.lambda_p2,
                              param.lambda_q2, omega_p, omega_q);
             mf_double tr_loss = sched.get_loss();
             mf_double tr_error = sched.get_error()/tr->nnz;
@@ -3005,7 +2644,7 @@ void fpsg_core(
                 vector<BlockBase*> va_blocks(1, &va_block);
                 vector<mf_int> va_block_ids(1, 0);
                 mf_double va_error =
-                    util.calc_error(va_blocks, va_block_ids, *model)/va->nnz;
+                    epoch_util.calc_error(va_blocks, va_block_ids, *model)/va->nnz;
                 switch(param.fun)
                 {
                     case P_L2_MFR:
@@ -3025,15 +2664,24 @@ void fpsg_core(
             Rcout << "\n" << flush;
         }
 
-        if(iter == 0)
-            slow_only = false;
-        if(iter == param.nr_iters - 1)
-            sched.terminate();
-        sched.resume();
+        if(!param.async_epochs)
+            next_epoch();
     }
 
-    for(auto &thread : threads)
-        thread.join();
+    job.wait();
+
+    if(param.stats != nullptr)
+    {
+        for(mf_int iter = 0; iter < param.nr_iters; ++iter)
+        {
+            for(mf_int i = 0; i < param.nr_threads; ++i)
+            {
+                mf_thread_stats stats = solvers[i]->get_stats()[iter];
+                stats.thread = i;
+                param.stats->push_back(stats);
+            }
+        }
+    }
 
     if(cv_error != nullptr && cv_blocks.size() > 0)
     {
@@ -3054,10 +2702,6 @@ void fpsg_core(
                 break;
         }
     }
-
-#if defined USESSE || defined USEAVX
-    _MM_SET_FLUSH_ZERO_MODE(flush_zero_mode);
-#endif
 }
 
 shared_ptr<mf_model> fpsg(
@@ -3071,7 +2715,9 @@ shared_ptr<mf_model> fpsg(
 try
 {
     Utility util(param.fun, param.nr_threads);
-    Scheduler sched(param.nr_bins, param.nr_threads, cv_blocks);
+    Scheduler sched(param.nr_bins, param.nr_threads, cv_blocks,
+                    use_lock_free_scheduler(param), param.async_epochs,
+                    param.locality_scheduling);
     shared_ptr<mf_problem> tr;
     shared_ptr<mf_problem> va;
     vector<Block> blocks(param.nr_bins*param.nr_bins);
@@ -3118,17 +2764,21 @@ try
     util.shuffle_problem(*va, p_map, q_map);
     util.scale_problem(*tr, (mf_float)1.0/scale);
     util.scale_problem(*va, (mf_float)1.0/scale);
-    ptrs = util.grid_problem(*tr, param.nr_bins, omega_p, omega_q, blocks);
+    ptrs = util.grid_problem(*tr, param.nr_bins, use_balanced_bins(param),
+                             omega_p, omega_q, blocks);
+    NumaLayout layout = make_numa_layout(param, omega_p, omega_q);
+    layout.move_blocks(ptrs);
 
     model = shared_ptr<mf_model>(Utility::init_model(param.fun,
-                tr->m, tr->n, param.k, avg/scale, omega_p, omega_q),
+                tr->m, tr->n, param.k, simd_align(param.simd), avg/scale,
+                omega_p, omega_q, layout),
                 [] (mf_model *ptr) { mf_destroy_model(&ptr); });
 
     for(mf_int i = 0; i < (mf_long)blocks.size(); ++i)
         block_ptrs[i] = &blocks[i];
 
-    fpsg_core(util, sched, tr.get(), va.get(), param, scale,
-              block_ptrs, omega_p, omega_q, model, cv_blocks, cv_error);
+    fpsg_core(util, sched, tr.get(), va.get(), param, scale, block_ptrs,
+              omega_p, omega_q, model, layout, cv_blocks, cv_error);
 
     if(!param.copy_data)
     {
@@ -3162,9 +2812,11 @@ shared_ptr<mf_model> fpsg_on_disk(
 try
 {
     Utility util(param.fun, param.nr_threads);
-    Scheduler sched(param.nr_bins, param.nr_threads, cv_blocks);
+    Scheduler sched(param.nr_bins, param.nr_threads, cv_blocks,
+                    use_lock_free_scheduler(param), param.async_epochs,
+                    param.locality_scheduling);
     mf_problem tr = {};
-    mf_problem va = read_problem(va_path.c_str());
+    mf_problem va = read_problem(va_path.c_str(), param.nr_threads);
     vector<BlockOnDisk> blocks(param.nr_bins*param.nr_bins);
     vector<BlockBase*> block_ptrs(param.nr_bins*param.nr_bins);
     vector<mf_int> p_map;
@@ -3195,18 +2847,22 @@ try
     util.scale_problem(va, (mf_float)1.0/scale);
 
     util.grid_shuffle_scale_problem_on_disk(
-        tr.m, tr.n, param.nr_bins, scale, tr_path,
+        tr.m, tr.n, param.nr_bins, use_balanced_bins(param), scale, tr_path,
         p_map, q_map, omega_p, omega_q, blocks);
+    // The blocks are loaded from the disk by the threads that use them, so
+    // they are on the right nodes already
+    NumaLayout layout = make_numa_layout(param, omega_p, omega_q);
 
     model = shared_ptr<mf_model>(Utility::init_model(param.fun,
-                tr.m, tr.n, param.k, avg/scale, omega_p, omega_q),
+                tr.m, tr.n, param.k, simd_align(param.simd), avg/scale,
+                omega_p, omega_q, layout),
                 [] (mf_model *ptr) { mf_destroy_model(&ptr); });
 
     for(mf_int i = 0; i < (mf_long)blocks.size(); ++i)
         block_ptrs[i] = &blocks[i];
 
-    fpsg_core(util, sched, &tr, &va, param, scale,
-              block_ptrs, omega_p, omega_q, model, cv_blocks, cv_error);
+    fpsg_core(util, sched, &tr, &va, param, scale, block_ptrs,
+              omega_p, omega_q, model, layout, cv_blocks, cv_error);
 
     delete [] va.R;
 
@@ -3285,6 +2941,12 @@ bool check_parameter(mf_parameter param)
         return false;
     }
 
+    if(param.simd != SIMD_AUTO && !simd_supported(param.simd))
+    {
+        Rcpp::stop("the instruction set of the solver is not supported on this machine");
+        return false;
+    }
+
     if(param.fun == P_KL_MFR && !param.do_nmf)
     {
         // cerr << "--nmf must be set when using generalized KL-divergence"
@@ -3426,6 +3088,113 @@ mf_double CrossValidatorOnDisk::do_cv1(vector<mf_int> &hidden_blocks)
 
 } // unnamed namespace
 
+void mf_auto_grid(mf_problem const *prob, mf_parameter *param, bool probe)
+{
+    if(param->nr_threads > 0 && param->nr_bins > 0)
+        return;
+
+    // Smaller blocks spend too much of their time in the scheduler
+    mf_long const min_block_nnz = 2048;
+
+    Reco::CacheInfo cache = Reco::cache_info();
+    mf_long l2 = cache.l2 > 0 ? (mf_long)cache.l2 : 256*1024;
+
+    mf_long max_bins = max((mf_long)sqrt((mf_double)prob->nnz/min_block_nnz),
+                           (mf_long)1);
+
+    // The hardware threads of a core share its L2 cache, so one thread is
+    // used per physical core, and the cache is divided among the threads
+    // of a core if there are more threads than physical cores
+    mf_long nr_cores = Reco::nr_physical_cores();
+    if(param->nr_threads < 1)
+    {
+        param->nr_threads = (mf_int)min(nr_cores,
+                                        max((max_bins-1)/2, (mf_long)1));
+        if(param->nr_bins > 0)
+            param->nr_threads = min(param->nr_threads,
+                                    max(param->nr_bins-1, 1));
+    }
+
+    mf_long threads_per_core = min(
+        ((mf_long)param->nr_threads+nr_cores-1)/nr_cores,
+        max((mf_long)Reco::nr_cores()/nr_cores, (mf_long)1));
+    l2 /= threads_per_core;
+
+    if(param->nr_bins < 1)
+    {
+        // A thread updates the rows of P and Q of one block at a time, which
+        // should fit in half of the L2 cache of its core. If the blocks
+        // would become too small, the smallest blocks allowed are used
+        mf_int align = simd_align(param->simd);
+        mf_long k_real = (mf_long)ceil((mf_double)param->k/align)*align;
+        mf_double factor_size =
+            (mf_double)(prob->m+prob->n)*k_real*sizeof(mf_float);
+        mf_long bins = (mf_long)ceil(factor_size/(l2/2));
+
+        // With at least 2*nr_threads+1 bins, a thread that finishes a block
+        // can always choose among several free blocks
+        mf_long min_bins = 2*(mf_long)param->nr_threads+1;
+        bins = max(min(bins, max_bins), min_bins);
+
+        if(probe && prob->nnz > 0)
+        {
+            // Each candidate trains a throwaway model for two epochs, and the
+            // fastest one is kept. Without L1 regularization, the first epoch
+            // only updates the first kSLOW factors, so only the second one is
+            // timed, from the counters of the threads, without building the
+            // grid and the model
+            vector<mf_thread_stats> probe_stats;
+            mf_parameter probe_param = *param;
+            probe_param.nr_iters = 2;
+            probe_param.quiet = true;
+            probe_param.stats = &probe_stats;
+
+            vector<mf_long> candidates;
+            for(mf_long c : {bins/2, bins, bins*2})
+            {
+                if(c >= min_bins && (c <= max_bins || c == bins))
+                    candidates.push_back(c);
+            }
+
+            mf_double best_time = numeric_limits<mf_double>::max();
+            for(mf_long c : candidates)
+            {
+                probe_param.nr_bins = (mf_int)c;
+                probe_stats.clear();
+                fpsg(prob, nullptr, probe_param);
+
+                // A thread is always computing, looking for blocks or
+                // waiting for the others until the epoch ends
+                mf_double time = 0;
+                for(mf_thread_stats const &stats : probe_stats)
+                {
+                    if(stats.iter < 1)
+                        continue;
+                    time = max(time, stats.compute_time+stats.schedule_time+
+                                     stats.barrier_time);
+                }
+
+                if(!param->quiet)
+                    Rcout << "probe: nbin = " << c << ", epoch time = "
+                          << fixed << setprecision(3) << time << "s\n";
+                if(time < best_time)
+                {
+                    best_time = time;
+                    bins = c;
+                }
+            }
+        }
+        param->nr_bins = (mf_int)bins;
+    }
+
+    if(!param->quiet)
+    {
+        Rcout << "auto: nthread = " << param->nr_threads
+              << ", nbin = " << param->nr_bins
+              << " (L2 cache " << l2/1024 << " KB per thread)\n";
+    }
+}
+
 mf_model* mf_train_with_validation(
     mf_problem const *tr,
     mf_problem const *va,
@@ -3517,8 +3286,14 @@ mf_double mf_cross_validation_on_disk(
     return validator.do_cross_validation();
 }
 
-mf_problem read_problem(string path)
+mf_problem read_problem(string path, mf_int nr_threads)
 {
+    struct Part
+    {
+        mf_int m, n;
+        Reco::NodeBuffer buffer;
+    };
+
     mf_problem prob;
     prob.m = 0;
     prob.n = 0;
@@ -3528,32 +3303,72 @@ mf_problem read_problem(string path)
     if(path.empty())
         return prob;
 
-    ifstream f(path);
-    if(!f.is_open())
+    Reco::MappedFile f;
+    if(!f.open(path))
         return prob;
 
-    string line;
-    while(getline(f, line))
-        prob.nnz += 1;
+    // Binary triplet files already hold an array of mf_node
+    if(Reco::is_binary(f.begin(), f.end()))
+    {
+        Reco::BinaryHeader const *header = Reco::binary_header(f.begin(), f.end());
+        if(header == nullptr)
+            return prob;
 
-    mf_node *R = new mf_node[static_cast<size_t>(prob.nnz)];
+        prob.m = header->m;
+        prob.n = header->n;
+        prob.nnz = header->nnz;
+        prob.R = new mf_node[static_cast<size_t>(prob.nnz)];
+        memcpy(prob.R, f.begin()+sizeof(Reco::BinaryHeader),
+               static_cast<size_t>(prob.nnz)*sizeof(mf_node));
 
+        mf_long first = 0;
+        if(Reco::check_binary(prob, nr_threads, first) > 0)
+        {
+            delete [] prob.R;
+            prob.m = 0;
+            prob.n = 0;
+            prob.nnz = 0;
+            prob.R = nullptr;
+        }
+        return prob;
+    }
     f.close();
-    f.open(path);
 
-    mf_long idx = 0;
-    for(mf_node N; f >> N.u >> N.v >> N.r;)
+    // Records are parsed in a single pass by nr_threads threads, one line
+    // each, and lines that cannot be parsed are skipped
+    TextFile text;
+    if(!text.open(path, nr_threads))
+        return prob;
+
+    mf_int nr_parts = text.nr_parts();
+    mf_long hint = text.size_hint();
+    vector<Part> parts(nr_parts);
+    for(Part &part : parts)
     {
-        if(N.u+1 > prob.m)
-            prob.m = N.u+1;
-        if(N.v+1 > prob.n)
-            prob.n = N.v+1;
-        R[idx] = N;
-        ++idx;
+        part.m = 0;
+        part.n = 0;
+        part.buffer.reserve(hint);
     }
-    prob.R = R;
 
-    f.close();
+    text.parse(parts, [] (Part &part, mf_node const &N)
+    {
+        if(N.u+1 > part.m)
+            part.m = N.u+1;
+        if(N.v+1 > part.n)
+            part.n = N.v+1;
+        part.buffer.push_back(N);
+    });
+
+    vector<Reco::NodeBuffer> buffers;
+    for(Part &part : parts)
+    {
+        prob.m = max(prob.m, part.m);
+        prob.n = max(prob.n, part.n);
+        buffers.push_back(move(part.buffer));
+    }
+    prob.R = Reco::merge_buffers(buffers, prob.nnz);
+
+    text.close();
 
     return prob;
 }
@@ -3928,6 +3743,13 @@ mf_parameter mf_get_default_param()
     param.do_nmf = false;
     param.quiet = false;
     param.copy_data = true;
+    param.balance_bins = false;
+    param.lock_free_scheduler = false;
+    param.async_epochs = false;
+    param.stats = nullptr;
+    param.pin_threads = false;
+    param.locality_scheduling = false;
+    param.simd = SIMD_AUTO;
 
     return param;
 }
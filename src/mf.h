@@ -3,6 +3,7 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #ifdef __cplusplus
 extern "C"
@@ -21,6 +22,9 @@ enum {P_L2_MFR=0, P_L1_MFR=1, P_KL_MFR=2, P_LR_MFC=5, P_L2_MFC=6, P_L1_MFC=7,
       P_ROW_BPR_MFOC=10, P_COL_BPR_MFOC=11};
 enum {RMSE=0, MAE=1, GKL=2, LOGLOSS=5, ACC=6, ROW_MPR=10, COL_MPR=11,
       ROW_AUC=12, COL_AUC=13};
+// Instruction sets of the solver kernels
+enum {SIMD_AUTO=-1, SIMD_NONE=0, SIMD_SSE=1, SIMD_AVX=2, SIMD_AVX2=3,
+      SIMD_AVX512=4};
 
 struct mf_node
 {
@@ -37,6 +41,27 @@ struct mf_problem
     struct mf_node *R;
 };
 
+// Counters of one solver thread in one iteration. The times are in seconds
+struct mf_thread_stats
+{
+    mf_int iter;
+    mf_int thread;
+    mf_long blocks;
+    mf_long ratings;
+    // Blocks that share a row or a column of the grid with the previous
+    // block of the thread, whose factors may still be in its caches
+    mf_long reused;
+    // Updating the factors of the blocks taken by the thread
+    mf_double compute_time;
+    // Looking for a free block in the scheduler, including lock_time
+    // spent there
+    mf_double schedule_time;
+    // Waiting for the lock of the scheduler
+    mf_double lock_time;
+    // Waiting for the other threads at the end of the iteration
+    mf_double barrier_time;
+};
+
 struct mf_parameter
 {
     mf_int fun;
@@ -52,6 +77,17 @@ struct mf_parameter
     bool do_nmf;
     bool quiet;
     bool copy_data;
+    bool balance_bins;
+    bool lock_free_scheduler;
+    bool async_epochs;
+    bool pin_threads;
+    bool locality_scheduling;
+    // One of SIMD_*, and SIMD_AUTO for the widest instruction set that the
+    // CPU supports
+    mf_int simd;
+    // If not NULL, the counters of each thread in each iteration are
+    // appended to it
+    std::vector<mf_thread_stats> *stats;
 };
 
 struct mf_parameter mf_get_default_param();
@@ -67,7 +103,7 @@ struct mf_model
     mf_float *Q;
 };
 
-mf_problem read_problem(std::string path);
+mf_problem read_problem(std::string path, mf_int nr_threads = 1);
 
 mf_int mf_save_model(struct mf_model const *model, char const *path);
 
@@ -75,6 +111,14 @@ struct mf_model* mf_load_model(char const *path);
 
 void mf_destroy_model(struct mf_model **model);
 
+// Choose the number of threads and the number of bins when they are zero,
+// from the size of the problem and the caches of the machine. If probe is
+// true, nearby numbers of bins are also timed with one training epoch
+void mf_auto_grid(
+    struct mf_problem const *prob,
+    struct mf_parameter *param,
+    bool probe);
+
 struct mf_model* mf_train(
     struct mf_problem const *prob,
     struct mf_parameter param);
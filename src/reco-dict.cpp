@@ -0,0 +1,162 @@
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+
+#include "reco-dict.h"
+
+namespace Reco
+{
+
+using mf::mf_int;
+using mf::mf_long;
+
+void remap_ids(mf::mf_problem& prob, IdMaps& ids, mf_int offset)
+{
+    // Records are visited in order, so the same data always give the same
+    // indices
+    for(mf_long i = 0; i < prob.nnz; i++)
+    {
+        prob.R[i].u = ids.users.insert(prob.R[i].u + offset);
+        prob.R[i].v = ids.items.insert(prob.R[i].v + offset);
+    }
+    prob.m = ids.users.size();
+    prob.n = ids.items.size();
+}
+
+void map_ids(mf::mf_node* nodes, mf_long len, const IdMaps& ids, mf_int offset)
+{
+    for(mf_long i = 0; i < len; i++)
+    {
+        nodes[i].u = ids.users.find(nodes[i].u + offset);
+        nodes[i].v = ids.items.find(nodes[i].v + offset);
+    }
+}
+
+// The file is in a text format similar to the model file
+//   users 3 integer
+//   1032
+//   17
+//   ...
+//   items 2 integer
+//   ...
+// where line i after the header is the ID of index i, and the type is
+// "integer" or "string". String IDs can contain any character, so
+// backslashes, line feeds and carriage returns are written as "\\", "\n"
+// and "\r" to keep one ID per line
+static void write_key(std::ofstream& f, mf_int key)
+{
+    f << key;
+}
+
+static void write_key(std::ofstream& f, const std::string& key)
+{
+    for(std::size_t i = 0; i < key.size(); i++)
+    {
+        if(key[i] == '\\')
+            f << "\\\\";
+        else if(key[i] == '\n')
+            f << "\\n";
+        else if(key[i] == '\r')
+            f << "\\r";
+        else
+            f << key[i];
+    }
+}
+
+static std::string unescape_key(const std::string& line)
+{
+    std::string key;
+    key.reserve(line.size());
+    for(std::size_t i = 0; i < line.size(); i++)
+    {
+        if(line[i] != '\\' || i + 1 == line.size())
+        {
+            key += line[i];
+            continue;
+        }
+        i++;
+        if(line[i] == 'n')
+            key += '\n';
+        else if(line[i] == 'r')
+            key += '\r';
+        else
+            key += line[i];
+    }
+    return key;
+}
+
+template <typename Key>
+static void write_dict(std::ofstream& f, const IdDict<Key>& dict, const char* name, const char* type)
+{
+    const std::vector<Key>& keys = dict.keys();
+    f << name << " " << keys.size() << " " << type << "\n";
+    for(std::size_t i = 0; i < keys.size(); i++)
+    {
+        write_key(f, keys[i]);
+        f << "\n";
+    }
+}
+
+bool write_ids(const std::string& path, const IdMaps& ids)
+{
+    std::ofstream f(path);
+    if(!f.is_open())
+        return false;
+
+    if(ids.strings)
+    {
+        write_dict(f, ids.user_names, "users", "string");
+        write_dict(f, ids.item_names, "items", "string");
+    } else {
+        write_dict(f, ids.users, "users", "integer");
+        write_dict(f, ids.items, "items", "integer");
+    }
+    f.close();
+
+    return !f.fail();
+}
+
+static bool read_header(std::ifstream& f, mf_long& size, bool& strings)
+{
+    std::string line, name, type;
+    if(!std::getline(f, line))
+        return false;
+    std::istringstream header(line);
+    header >> name >> size >> type;
+    strings = (type == "string");
+    return !header.fail() && size >= 0;
+}
+
+bool read_ids(const std::string& path, IdMaps& ids)
+{
+    std::ifstream f(path);
+    if(!f.is_open())
+        return false;
+
+    auto read = [&] (IdDict<mf_int>& dict, IdDict<std::string>& names)
+    {
+        mf_long size = 0;
+        if(!read_header(f, size, ids.strings))
+            return false;
+
+        std::string line;
+        if(ids.strings)
+        {
+            names.clear();
+            names.reserve(std::size_t(size));
+            for(mf_long i = 0; i < size && std::getline(f, line); i++)
+                names.insert(unescape_key(line));
+        } else {
+            dict.clear();
+            dict.reserve(std::size_t(size));
+            for(mf_long i = 0; i < size && std::getline(f, line); i++)
+                dict.insert(mf_int(std::atoi(line.c_str())));
+        }
+        return !f.fail();
+    };
+
+    return read(ids.users, ids.user_names) && read(ids.items, ids.item_names);
+}
+
+
+} // namespace Reco
@@ -0,0 +1,200 @@
+#ifndef RECO_DICT_H
+#define RECO_DICT_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "mf.h"
+
+namespace Reco
+{
+
+// A string ID that is looked up without being copied, for example a token
+// in a mapped file
+struct StringRef
+{
+    const char* data;
+    std::size_t size;
+
+    explicit operator std::string() const { return std::string(data, size); }
+};
+
+// Hash of a user or item ID
+// The result is further mixed by IdDict, so it only needs to carry all the
+// bits of the key
+inline std::uint64_t hash_id(mf::mf_int key)
+{
+    return std::uint32_t(key);
+}
+
+// FNV-1a
+inline std::uint64_t hash_id(const StringRef& key)
+{
+    std::uint64_t h = 0xCBF29CE484222325ULL;
+    for(std::size_t i = 0; i < key.size; i++)
+    {
+        h ^= static_cast<unsigned char>(key.data[i]);
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+inline std::uint64_t hash_id(const std::string& key)
+{
+    return hash_id(StringRef{ key.data(), key.size() });
+}
+
+inline bool same_id(mf::mf_int x, mf::mf_int y) { return x == y; }
+
+inline bool same_id(const std::string& x, const StringRef& y)
+{
+    return x.size() == y.size && std::memcmp(x.data(), y.data, y.size) == 0;
+}
+
+inline bool same_id(const std::string& x, const std::string& y) { return x == y; }
+
+// A dictionary that maps sparse IDs to dense indices 0, 1, 2, ... in the
+// order they are first inserted
+// It uses open addressing with linear probing on a power-of-two table that
+// is kept at most half full. The slots only store indices into the array
+// of keys, so that probing scans a compact array of integers
+// Lookups can use any type K with hash_id(K) and same_id(Key, K), and a key
+// is only converted to Key when it is added
+template <typename Key>
+class IdDict
+{
+private:
+    typedef mf::mf_int mf_int;
+
+    std::vector<Key>    m_keys;   // m_keys[i] is the ID of index i
+    std::vector<mf_int> m_slots;  // Index of the key in a slot, or -1 if empty
+    int                 m_shift;  // 64 - log2(number of slots)
+
+    // Fibonacci hashing, which takes the high bits of the product
+    template <typename K>
+    std::size_t first_slot(const K& key) const
+    {
+        return std::size_t((hash_id(key) * 0x9E3779B97F4A7C15ULL) >> m_shift);
+    }
+
+    void rehash(std::size_t nslots)
+    {
+        m_shift = 64;
+        for(std::size_t s = nslots; s > 1; s >>= 1)
+            m_shift--;
+        m_slots.assign(nslots, -1);
+
+        const std::size_t mask = nslots - 1;
+        for(std::size_t i = 0; i < m_keys.size(); i++)
+        {
+            std::size_t s = first_slot(m_keys[i]);
+            while(m_slots[s] >= 0)
+                s = (s + 1) & mask;
+            m_slots[s] = mf_int(i);
+        }
+    }
+
+public:
+    IdDict() { rehash(16); }
+
+    mf_int                  size() const { return mf_int(m_keys.size()); }
+    const std::vector<Key>& keys() const { return m_keys; }
+
+    void clear()
+    {
+        m_keys.clear();
+        rehash(16);
+    }
+
+    // Make room for n keys without rehashing
+    void reserve(std::size_t n)
+    {
+        m_keys.reserve(n);
+        std::size_t nslots = m_slots.size();
+        while(nslots < 2 * n)
+            nslots *= 2;
+        if(nslots > m_slots.size())
+            rehash(nslots);
+    }
+
+    // Index of the key, or -1 if it is not in the dictionary
+    template <typename K>
+    mf_int find(const K& key) const
+    {
+        const std::size_t mask = m_slots.size() - 1;
+        for(std::size_t s = first_slot(key); m_slots[s] >= 0; s = (s + 1) & mask)
+        {
+            if(same_id(m_keys[m_slots[s]], key))
+                return m_slots[s];
+        }
+        return -1;
+    }
+
+    // Index of the key, which is added to the dictionary if it is new
+    template <typename K>
+    mf_int insert(const K& key)
+    {
+        const std::size_t mask = m_slots.size() - 1;
+        std::size_t s = first_slot(key);
+        for(; m_slots[s] >= 0; s = (s + 1) & mask)
+        {
+            if(same_id(m_keys[m_slots[s]], key))
+                return m_slots[s];
+        }
+
+        const mf_int ind = size();
+        m_keys.push_back(Key(key));
+        m_slots[s] = ind;
+        if(m_keys.size() * 2 > m_slots.size())
+            rehash(m_slots.size() * 2);
+        return ind;
+    }
+};
+
+// Dictionaries of user and item IDs
+// A model trained on remapped data has one row of P for each user and one
+// row of Q for each item in the dictionaries
+// Integer IDs are stored in users and items, and string IDs in user_names
+// and item_names
+struct IdMaps
+{
+    bool                strings;
+    IdDict<mf::mf_int>  users;
+    IdDict<mf::mf_int>  items;
+    IdDict<std::string> user_names;
+    IdDict<std::string> item_names;
+
+    IdMaps() : strings(false) {}
+
+    mf::mf_int nusers() const { return strings ? user_names.size() : users.size(); }
+    mf::mf_int nitems() const { return strings ? item_names.size() : items.size(); }
+};
+
+// The dictionaries of a model file are saved next to it
+inline std::string ids_path(const std::string& model_path)
+{
+    return model_path + ".ids";
+}
+
+// Replace the user and item indices of the data by dense indices, and add
+// the IDs to the dictionaries
+// offset is the index offset of the data source, which is added back so
+// that the dictionaries store the IDs as they appear in the data
+void remap_ids(mf::mf_problem& prob, IdMaps& ids, mf::mf_int offset);
+
+// Translate integer indices of testing data with the dictionaries of a model
+// IDs that are not in the dictionaries become -1
+// String IDs are translated by the data readers instead
+void map_ids(mf::mf_node* nodes, mf::mf_long len, const IdMaps& ids, mf::mf_int offset);
+
+// Return false if the file cannot be written or read
+bool write_ids(const std::string& path, const IdMaps& ids);
+bool read_ids(const std::string& path, IdMaps& ids);
+
+
+} // namespace Reco
+
+
+#endif // RECO_DICT_H
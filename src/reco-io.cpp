@@ -0,0 +1,535 @@
+#include <fstream>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+#include <zlib.h>
+#if defined USEZSTD
+#include <zstd.h>
+#endif
+
+#include "reco-io.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Reco
+{
+
+#ifdef _WIN32
+
+// m_handle holds the file handle, and the mapping handle is only needed
+// until the view is created
+bool MappedFile::open(const std::string& path, bool copy_on_write)
+{
+    close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    m_handle = file;
+    m_size = static_cast<std::size_t>(size.QuadPart);
+    // An empty file cannot be mapped, but it is still a valid file
+    if(m_size == 0)
+        return true;
+
+    HANDLE mapping = CreateFileMappingA(file, NULL,
+                                       copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY,
+                                       0, 0, NULL);
+    if(mapping == NULL)
+    {
+        close();
+        return false;
+    }
+    m_data = static_cast<char*>(MapViewOfFile(mapping,
+                                              copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ,
+                                              0, 0, 0));
+    CloseHandle(mapping);
+    if(m_data == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+bool MappedFile::create(const std::string& path, std::size_t size)
+{
+    close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    m_handle = file;
+    if(size == 0)
+        return true;
+
+    LARGE_INTEGER li;
+    li.QuadPart = static_cast<LONGLONG>(size);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE,
+                                       li.HighPart, li.LowPart, NULL);
+    if(mapping == NULL)
+    {
+        close();
+        return false;
+    }
+    m_data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+    CloseHandle(mapping);
+    if(m_data == nullptr)
+    {
+        close();
+        return false;
+    }
+    m_size = size;
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(m_data)
+        UnmapViewOfFile(m_data);
+    if(m_handle)
+        CloseHandle(static_cast<HANDLE>(m_handle));
+    m_data = nullptr;
+    m_size = 0;
+    m_handle = nullptr;
+}
+
+#else
+
+// m_handle is unused on POSIX systems except as an "is open" flag, since the
+// file descriptor can be closed right after the mapping is created
+bool MappedFile::open(const std::string& path, bool copy_on_write)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    m_size = static_cast<std::size_t>(st.st_size);
+    if(m_size > 0)
+    {
+        int prot = copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+        void* addr = mmap(nullptr, m_size, prot, MAP_PRIVATE, fd, 0);
+        if(addr == MAP_FAILED)
+        {
+            ::close(fd);
+            m_size = 0;
+            return false;
+        }
+#ifdef POSIX_MADV_SEQUENTIAL
+        posix_madvise(addr, m_size, POSIX_MADV_SEQUENTIAL);
+#endif
+        m_data = static_cast<char*>(addr);
+    }
+    ::close(fd);
+
+    m_handle = this;
+    return true;
+}
+
+bool MappedFile::create(const std::string& path, std::size_t size)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return false;
+
+    if(size > 0)
+    {
+        if(ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(addr == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        m_data = static_cast<char*>(addr);
+        m_size = size;
+    }
+    ::close(fd);
+
+    m_handle = this;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(m_data)
+        munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_handle = nullptr;
+}
+
+#endif
+
+
+
+DecompressedFile::Format DecompressedFile::detect(const std::string& path)
+{
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    std::ifstream f(path, std::ios::in | std::ios::binary);
+    f.read(reinterpret_cast<char*>(magic), sizeof(magic));
+
+    if(f.gcount() >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return Gzip;
+    if(f.gcount() >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+       magic[2] == 0x2f && magic[3] == 0xfd)
+        return Zstd;
+    return Plain;
+}
+
+// The worker thread fills blocks from a pool and passes them to the reader
+// through a queue, so at most nblock blocks are in memory at any time
+// A block is cut after its last line break, and the remaining bytes are
+// moved to the beginning of the next block
+struct DecompressedFile::Impl
+{
+    static const std::size_t block_size = std::size_t(1) << 22;
+    static const int         nblock = 3;
+
+    struct Block
+    {
+        std::vector<char> data;
+        std::size_t       len;
+    };
+
+    Format                  format;
+    gzFile                  gz;
+#if defined USEZSTD
+    std::FILE*              fp;
+    ZSTD_DCtx*              dctx;
+    std::vector<char>       in_data;
+    ZSTD_inBuffer           input;
+#endif
+
+    std::thread             worker;
+    std::mutex              mtx;
+    std::condition_variable cv;
+    Block                   blocks[nblock];
+    std::deque<Block*>      free_blocks;
+    std::deque<Block*>      ready_blocks;
+    Block*                  current;
+    bool                    done;
+    bool                    stop;
+    bool                    failed;
+    std::string             error;
+
+    Impl() :
+        format(Plain), gz(nullptr),
+#if defined USEZSTD
+        fp(nullptr), dctx(nullptr),
+#endif
+        current(nullptr), done(true), stop(false), failed(false)
+    {}
+
+    // Decompress at most size bytes, and return the number of bytes written
+    // 0 means the end of data, and -1 means an error
+    long read(char* buf, std::size_t size)
+    {
+        if(format != Zstd)
+        {
+            int n = gzread(gz, buf, static_cast<unsigned int>(size));
+            // A truncated stream is reported at the end of data
+            int err = Z_OK;
+            if(n == 0)
+                gzerror(gz, &err);
+            return (err == Z_OK) ? n : -1;
+        }
+
+#if defined USEZSTD
+        ZSTD_outBuffer output = { buf, size, 0 };
+        while(output.pos < output.size)
+        {
+            if(input.pos == input.size)
+            {
+                input.size = std::fread(in_data.data(), 1, in_data.size(), fp);
+                input.pos = 0;
+                if(input.size == 0)
+                    break;
+            }
+            std::size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+            if(ZSTD_isError(ret))
+                return -1;
+        }
+        return long(output.pos);
+#else
+        return -1;
+#endif
+    }
+
+    void run()
+    {
+        try
+        {
+            std::vector<char> carry;
+            bool eof = false;
+            while(!eof)
+            {
+                Block* blk = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [this] { return stop || !free_blocks.empty(); });
+                    if(stop)
+                        break;
+                    blk = free_blocks.front();
+                    free_blocks.pop_front();
+                }
+
+                std::vector<char>& data = blk->data;
+                std::size_t filled = carry.size();
+                data.resize(std::max(std::size_t(block_size), 2 * filled));
+                std::copy(carry.begin(), carry.end(), data.begin());
+                carry.clear();
+
+                for(;;)
+                {
+                    while(filled < data.size() && !eof)
+                    {
+                        long n = read(data.data() + filled, data.size() - filled);
+                        if(n < 0)
+                            throw std::runtime_error("corrupted compressed data");
+                        eof = (n == 0);
+                        filled += n;
+                    }
+                    if(eof)
+                    {
+                        blk->len = filled;
+                        break;
+                    }
+
+                    std::size_t cut = filled;
+                    while(cut > 0 && data[cut - 1] != '\n')
+                        cut--;
+                    if(cut > 0)
+                    {
+                        blk->len = cut;
+                        carry.assign(data.begin() + cut, data.begin() + filled);
+                        break;
+                    }
+                    // A line longer than the block
+                    data.resize(2 * data.size());
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    ready_blocks.push_back(blk);
+                }
+                cv.notify_all();
+            }
+        } catch(std::exception& e) {
+            std::lock_guard<std::mutex> lock(mtx);
+            failed = true;
+            error = e.what();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            done = true;
+        }
+        cv.notify_all();
+    }
+};
+
+DecompressedFile::DecompressedFile() : m_impl(new Impl()) {}
+
+DecompressedFile::~DecompressedFile()
+{
+    close();
+    delete m_impl;
+}
+
+bool DecompressedFile::open(const std::string& path)
+{
+    close();
+    Impl& d = *m_impl;
+    d.failed = false;
+    d.error.clear();
+
+    d.format = detect(path);
+    if(d.format == Zstd)
+    {
+#if defined USEZSTD
+        d.fp = std::fopen(path.c_str(), "rb");
+        d.dctx = ZSTD_createDCtx();
+        if(d.fp == nullptr || d.dctx == nullptr)
+        {
+            d.error = "cannot open file";
+            close();
+            return false;
+        }
+        d.in_data.resize(ZSTD_DStreamInSize());
+        d.input.src = d.in_data.data();
+        d.input.size = 0;
+        d.input.pos = 0;
+#else
+        d.error = "zstd support is not enabled, see src/Makevars";
+        return false;
+#endif
+    } else {
+        // zlib also reads uncompressed files transparently
+        d.gz = gzopen(path.c_str(), "rb");
+        if(d.gz == nullptr)
+        {
+            d.error = "cannot open file";
+            return false;
+        }
+        gzbuffer(d.gz, 1 << 17);
+    }
+
+    for(int i = 0; i < Impl::nblock; i++)
+        d.free_blocks.push_back(&d.blocks[i]);
+    d.done = false;
+    d.stop = false;
+    d.worker = std::thread(&Impl::run, m_impl);
+
+    return true;
+}
+
+bool DecompressedFile::next_chunk(const char*& begin, const char*& end)
+{
+    Impl& d = *m_impl;
+    std::unique_lock<std::mutex> lock(d.mtx);
+    if(d.current)
+    {
+        d.free_blocks.push_back(d.current);
+        d.current = nullptr;
+        d.cv.notify_all();
+    }
+
+    d.cv.wait(lock, [&d] { return !d.ready_blocks.empty() || d.done; });
+    if(d.ready_blocks.empty())
+        return false;
+
+    d.current = d.ready_blocks.front();
+    d.ready_blocks.pop_front();
+    begin = d.current->data.data();
+    end = begin + d.current->len;
+    return true;
+}
+
+void DecompressedFile::close()
+{
+    Impl& d = *m_impl;
+    if(d.worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(d.mtx);
+            d.stop = true;
+        }
+        d.cv.notify_all();
+        d.worker.join();
+    }
+
+    if(d.gz)
+        gzclose(d.gz);
+    d.gz = nullptr;
+#if defined USEZSTD
+    if(d.fp)
+        std::fclose(d.fp);
+    if(d.dctx)
+        ZSTD_freeDCtx(d.dctx);
+    d.fp = nullptr;
+    d.dctx = nullptr;
+#endif
+
+    d.free_blocks.clear();
+    d.ready_blocks.clear();
+    d.current = nullptr;
+    d.done = true;
+}
+
+bool DecompressedFile::failed() const { return m_impl->failed; }
+
+const std::string& DecompressedFile::error() const { return m_impl->error; }
+
+
+
+mf::mf_long check_binary(const mf::mf_problem& prob, int nthread, mf::mf_long& first)
+{
+    const int nparts = std::max(nthread, 1);
+    std::vector<mf::mf_long> counts(nparts, 0), firsts(nparts, prob.nnz);
+    ThreadPool::global().parallel_ranges(nparts, mf::mf_long(0), prob.nnz,
+                                         [&] (int t, mf::mf_long begin, mf::mf_long end)
+    {
+        for(mf::mf_long i = begin; i < end; i++)
+        {
+            const mf::mf_node& N = prob.R[i];
+            if(N.u < 0 || N.u >= prob.m || N.v < 0 || N.v >= prob.n ||
+               !std::isfinite(N.r))
+            {
+                if(counts[t]++ == 0)
+                    firsts[t] = i;
+            }
+        }
+    });
+
+    first = *std::min_element(firsts.begin(), firsts.end());
+    mf::mf_long count = 0;
+    for(int t = 0; t < nparts; t++)
+        count += counts[t];
+    return count;
+}
+
+bool write_binary(const std::string& path, const mf::mf_problem& prob)
+{
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!out.is_open())
+        return false;
+
+    BinaryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, binary_magic, sizeof(binary_magic));
+    header.version = binary_version;
+    header.node_size = sizeof(mf::mf_node);
+    header.m = prob.m;
+    header.n = prob.n;
+    header.nnz = prob.nnz;
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(prob.R), prob.nnz * sizeof(mf::mf_node));
+    out.close();
+
+    return !out.fail();
+}
+
+
+} // namespace Reco
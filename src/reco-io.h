@@ -0,0 +1,548 @@
+#ifndef RECO_IO_H
+#define RECO_IO_H
+
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "mf.h"
+#include "reco-pool.h"
+
+namespace Reco
+{
+
+// A memory mapping of a whole file
+// The platform-specific code lives in reco-io.cpp, so that system headers
+// such as <windows.h> do not leak into the rest of the package
+class MappedFile
+{
+private:
+    char*       m_data;
+    std::size_t m_size;
+    void*       m_handle;
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+public:
+    MappedFile() : m_data(nullptr), m_size(0), m_handle(nullptr) {}
+    ~MappedFile() { close(); }
+
+    // Map an existing file for reading
+    // If copy_on_write is true, the mapped data can also be modified, and
+    // the changes are private to the process and never reach the file
+    // Return false if the file cannot be opened or mapped
+    bool open(const std::string& path, bool copy_on_write = false);
+    // Create or truncate a file of the given size and map it for writing
+    // Changes are written back to the file when it is closed
+    bool create(const std::string& path, std::size_t size);
+    void close();
+
+    bool        is_open() const { return m_handle != nullptr; }
+    char*       data()          { return m_data; }
+    const char* begin()   const { return m_data; }
+    const char* end()     const { return m_data + m_size; }
+    std::size_t size()    const { return m_size; }
+};
+
+
+
+// A compressed text file that is decompressed on a background thread
+// The data are handed out as chunks of whole lines, so that they can be
+// parsed while the next chunk is being decompressed
+// gzip is always supported, and zstd requires building with -DUSEZSTD
+class DecompressedFile
+{
+public:
+    enum Format { Plain, Gzip, Zstd };
+
+    // Detect the compression format from the magic bytes of a file
+    static Format detect(const std::string& path);
+
+    DecompressedFile();
+    ~DecompressedFile();
+
+    // Return false if the file cannot be opened, with the reason in error()
+    bool open(const std::string& path);
+    // Get the next chunk of lines, and return false at the end of data or
+    // if decompression fails
+    // The chunk is valid until the next call of next_chunk() or close()
+    bool next_chunk(const char*& begin, const char*& end);
+    void close();
+
+    bool               failed() const;
+    const std::string& error() const;
+
+private:
+    struct Impl;
+    Impl* m_impl;
+
+    DecompressedFile(const DecompressedFile&);
+    DecompressedFile& operator=(const DecompressedFile&);
+};
+
+
+
+// Hand-rolled parsers working on a byte range [p, end)
+// They mimic "stream >> value": leading blanks are skipped, parsing stops at
+// the first character that cannot be part of the number, and p is moved there
+// A line break is never skipped, since each line is one record
+
+inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline bool is_digit(char c)
+{
+    return static_cast<unsigned char>(c - '0') < 10;
+}
+
+inline void skip_blank(const char*& p, const char* end)
+{
+    while(p < end && is_blank(*p))
+        p++;
+}
+
+// Return false if no integer can be read or if the value overflows
+inline bool parse_int(const char*& p, const char* end, int& x)
+{
+    skip_blank(p, end);
+    if(p >= end)
+        return false;
+
+    bool neg = false;
+    if(*p == '-' || *p == '+')
+    {
+        neg = (*p == '-');
+        p++;
+    }
+    if(p >= end || !is_digit(*p))
+        return false;
+
+    const std::int64_t limit = std::int64_t(std::numeric_limits<int>::max()) + neg;
+    std::int64_t val = 0;
+    for(; p < end && is_digit(*p); p++)
+    {
+        val = val * 10 + (*p - '0');
+        if(val > limit)
+            return false;
+    }
+
+    x = neg ? int(-val) : int(val);
+    return true;
+}
+
+// Decimal numbers of the form [sign]digits[.digits][(e|E)[sign]digits]
+// Short mantissas with small exponents are converted exactly with one float
+// operation; everything else falls back to strtof() on a copy of the token
+inline bool parse_float(const char*& p, const char* end, float& x)
+{
+    static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                   1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+    skip_blank(p, end);
+    const char* start = p;
+
+    bool neg = false;
+    if(p < end && (*p == '-' || *p == '+'))
+    {
+        neg = (*p == '-');
+        p++;
+    }
+
+    // Mantissa, with the decimal point removed
+    std::uint64_t mant = 0;
+    int ndigit = 0, nsig = 0, exp10 = 0;
+    for(; p < end && is_digit(*p); p++, ndigit++)
+    {
+        if(nsig < 19)
+        {
+            mant = mant * 10 + (*p - '0');
+            nsig += (mant > 0);
+        } else {
+            exp10++;
+        }
+    }
+    if(p < end && *p == '.')
+    {
+        for(p++; p < end && is_digit(*p); p++, ndigit++)
+        {
+            if(nsig < 19)
+            {
+                mant = mant * 10 + (*p - '0');
+                nsig += (mant > 0);
+                exp10--;
+            }
+        }
+    }
+    if(ndigit == 0)
+    {
+        p = start;
+        return false;
+    }
+
+    // Exponent, which must have at least one digit
+    if(p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        bool eneg = false;
+        if(p < end && (*p == '-' || *p == '+'))
+        {
+            eneg = (*p == '-');
+            p++;
+        }
+        if(p >= end || !is_digit(*p))
+        {
+            p = start;
+            return false;
+        }
+        int e = 0;
+        for(; p < end && is_digit(*p); p++)
+            if(e < 100000)
+                e = e * 10 + (*p - '0');
+        exp10 += eneg ? -e : e;
+    }
+
+    if(mant <= (std::uint64_t(1) << 24) && exp10 >= -10 && exp10 <= 10)
+    {
+        float val = float(mant);
+        val = (exp10 < 0) ? val / pow10[-exp10] : val * pow10[exp10];
+        x = neg ? -val : val;
+        return true;
+    }
+
+    // Slow path: numbers that are too long for the exact conversion above
+    char buf[128];
+    std::size_t len = p - start;
+    if(len >= sizeof(buf))
+        len = sizeof(buf) - 1;
+    std::memcpy(buf, start, len);
+    buf[len] = '\0';
+    x = std::strtof(buf, nullptr);
+    return true;
+}
+
+// A field of non-blank characters, such as a string ID, which is returned
+// as its first character and its length
+// Return false if there is no field left on the line
+inline bool parse_token(const char*& p, const char* end, const char*& token, std::size_t& len)
+{
+    skip_blank(p, end);
+    token = p;
+    while(p < end && !is_blank(*p) && *p != '\n')
+        p++;
+    len = p - token;
+    return len > 0;
+}
+
+// Pointer to the first character of the next line, or end
+inline const char* next_line(const char* p, const char* end)
+{
+    const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return nl ? nl + 1 : end;
+}
+
+// Number of lines in [begin, end), where a non-empty last line that is
+// not terminated by a line break also counts
+inline std::int64_t count_lines(const char* begin, const char* end)
+{
+    std::int64_t nlines = 0;
+    for(const char* p = begin; p < end; nlines++)
+        p = next_line(p, end);
+    return nlines;
+}
+
+// Estimate the number of lines from the average line length of the first
+// 1MB of data, with some headroom so that the estimate is usually an upper
+// bound. Small inputs are counted exactly
+inline std::int64_t estimate_lines(const char* begin, const char* end)
+{
+    const std::size_t sample_size = std::size_t(1) << 20;
+    if(std::size_t(end - begin) <= sample_size)
+        return count_lines(begin, end);
+
+    const char* sample_end = begin + sample_size;
+    std::int64_t nlines = 0;
+    const char* last = begin;
+    for(const char* p = begin; ; nlines++)
+    {
+        const char* nl = static_cast<const char*>(std::memchr(p, '\n', sample_end - p));
+        if(nl == nullptr)
+            break;
+        p = last = nl + 1;
+    }
+    if(nlines == 0)
+        return 1;
+
+    double avg_len = double(last - begin) / double(nlines);
+    return std::int64_t(double(end - begin) / avg_len * 1.05) + 16;
+}
+
+// Split [begin, end) into at most nparts ranges of about the same size, so
+// that they can be parsed by different threads
+// Each range starts at the beginning of a line, and ranges are kept larger
+// than 64KB. The returned vector holds the nparts' + 1 boundaries
+inline std::vector<const char*> split_lines(const char* begin, const char* end, int nparts)
+{
+    const std::int64_t min_part = std::int64_t(1) << 16;
+    const std::int64_t size = end - begin;
+    nparts = int(std::max(std::int64_t(1), std::min(std::int64_t(nparts), size / min_part)));
+
+    std::vector<const char*> bounds(1, begin);
+    for(int i = 1; i < nparts; i++)
+    {
+        const char* p = begin + size * i / nparts;
+        if(p <= bounds.back())
+            continue;
+        // p - 1 is not before begin, so that a line starting at p is kept
+        p = next_line(p - 1, end);
+        if(p >= end)
+            break;
+        if(p > bounds.back())
+            bounds.push_back(p);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+
+
+// Binary triplet files
+// The file starts with a 64-byte header, followed by nnz records of mf_node
+// stored in the native byte order, so that the records can be mapped into
+// memory and used as mf_problem::R without parsing. User and item indices
+// always start from 0
+struct BinaryHeader
+{
+    char         magic[8];
+    std::int32_t version;
+    // sizeof(mf_node), guarding against files written by incompatible builds
+    std::int32_t node_size;
+    std::int32_t m;
+    std::int32_t n;
+    std::int64_t nnz;
+    char         reserved[32];
+};
+static_assert(sizeof(BinaryHeader) == 64, "binary header must have 64 bytes");
+
+const char          binary_magic[8] = { 'R', 'E', 'C', 'O', 'B', 'I', 'N', '\0' };
+const std::int32_t  binary_version = 1;
+
+// Whether [begin, end) looks like a binary triplet file
+inline bool is_binary(const char* begin, const char* end)
+{
+    return std::size_t(end - begin) >= sizeof(binary_magic) &&
+           std::memcmp(begin, binary_magic, sizeof(binary_magic)) == 0;
+}
+
+// Return the header of a binary triplet file, or nullptr if the header is
+// invalid or does not match the file size. A version or size mismatch also
+// detects files written on a machine with a different byte order
+inline const BinaryHeader* binary_header(const char* begin, const char* end)
+{
+    if(std::size_t(end - begin) < sizeof(BinaryHeader) || !is_binary(begin, end))
+        return nullptr;
+
+    const BinaryHeader* header = reinterpret_cast<const BinaryHeader*>(begin);
+    if(header->version != binary_version ||
+       header->node_size != std::int32_t(sizeof(mf::mf_node)) ||
+       header->m < 0 || header->n < 0 || header->nnz < 0)
+        return nullptr;
+
+    std::uint64_t body = std::uint64_t(end - begin) - sizeof(BinaryHeader);
+    if(body != std::uint64_t(header->nnz) * sizeof(mf::mf_node))
+        return nullptr;
+
+    return header;
+}
+
+// Check the records of a binary triplet file loaded into prob with nthread
+// threads, since they are used without parsing. The indices must be within
+// prob.m and prob.n, which come from the header, and the ratings finite
+// Return the number of invalid records, and set first to the position of
+// the first one
+mf::mf_long check_binary(const mf::mf_problem& prob, int nthread, mf::mf_long& first);
+
+// Write the records of prob to a binary triplet file
+// Return false if the file cannot be written
+bool write_binary(const std::string& path, const mf::mf_problem& prob);
+
+
+
+// A growable array of mf_node made of chunks
+// Growing never moves the records already stored, and release() returns the
+// records as one array that can be freed by delete[]
+class NodeBuffer
+{
+private:
+    typedef mf::mf_node mf_node;
+    typedef mf::mf_long mf_long;
+
+    static const mf_long min_chunk = mf_long(1) << 16;
+
+    std::vector<mf_node*> m_chunks;
+    std::vector<mf_long>  m_caps;
+    // Number of records in each chunk, only updated when a new chunk is added
+    std::vector<mf_long>  m_lens;
+    mf_node*              m_pos;
+    mf_node*              m_chunk_end;
+    mf_long               m_size;
+
+    void add_chunk(mf_long cap)
+    {
+        cap = std::max(cap, mf_long(min_chunk));
+        if(!m_chunks.empty())
+            m_lens.back() = m_pos - m_chunks.back();
+        m_chunks.push_back(new mf_node[cap]);
+        m_caps.push_back(cap);
+        m_lens.push_back(0);
+        m_pos = m_chunks.back();
+        m_chunk_end = m_pos + cap;
+    }
+
+public:
+    // The first chunk is sized by the hint, and later ones grow by 1/8 of
+    // the current size
+    NodeBuffer(mf_long size_hint = 0) :
+        m_pos(nullptr), m_chunk_end(nullptr), m_size(0)
+    {
+        if(size_hint > 0)
+            add_chunk(size_hint);
+    }
+
+    // Buffers can be moved but not copied
+    NodeBuffer(NodeBuffer&& other) :
+        m_pos(nullptr), m_chunk_end(nullptr), m_size(0)
+    {
+        swap(other);
+    }
+
+    NodeBuffer& operator=(NodeBuffer&& other)
+    {
+        swap(other);
+        return *this;
+    }
+
+    ~NodeBuffer() { clear(); }
+
+    void swap(NodeBuffer& other)
+    {
+        m_chunks.swap(other.m_chunks);
+        m_caps.swap(other.m_caps);
+        m_lens.swap(other.m_lens);
+        std::swap(m_pos, other.m_pos);
+        std::swap(m_chunk_end, other.m_chunk_end);
+        std::swap(m_size, other.m_size);
+    }
+
+    // Free all records
+    void clear()
+    {
+        for(std::size_t i = 0; i < m_chunks.size(); i++)
+            delete [] m_chunks[i];
+        m_chunks.clear();
+        m_caps.clear();
+        m_lens.clear();
+        m_pos = m_chunk_end = nullptr;
+        m_size = 0;
+    }
+
+    mf_long size() const { return m_size; }
+
+    // Allocate room for n records in advance
+    void reserve(mf_long n)
+    {
+        if(m_chunks.empty() && n > 0)
+            add_chunk(n);
+    }
+
+    void push_back(const mf_node& N)
+    {
+        if(m_pos == m_chunk_end)
+            add_chunk(m_size / 8);
+        *m_pos++ = N;
+        m_size++;
+    }
+
+    // Return room for at most n records stored contiguously after the
+    // existing records, and set n to the actual size of the room
+    // Call commit(k) to keep the first k of them
+    mf_node* prepare(mf_long& n)
+    {
+        if(m_pos == m_chunk_end)
+            add_chunk(std::max(n, m_size / 8));
+        n = std::min(n, mf_long(m_chunk_end - m_pos));
+        return m_pos;
+    }
+
+    void commit(mf_long k)
+    {
+        m_pos += k;
+        m_size += k;
+    }
+
+    // Copy all records to dest, which must have room for size() records
+    void copy_to(mf_node* dest) const
+    {
+        for(std::size_t i = 0; i < m_chunks.size(); i++)
+        {
+            mf_long len = (i + 1 < m_chunks.size()) ? m_lens[i] : (m_pos - m_chunks[i]);
+            std::copy(m_chunks[i], m_chunks[i] + len, dest);
+            dest += len;
+        }
+    }
+
+    // Transfer the records to a single array and empty the buffer
+    // The first chunk is handed over without copying if it holds all records
+    // and is not much larger than needed
+    mf_node* release(mf_long& nnz)
+    {
+        nnz = m_size;
+        mf_node* res = nullptr;
+        if(m_chunks.size() == 1 && m_caps[0] - m_size <= m_caps[0] / 8)
+        {
+            res = m_chunks[0];
+            m_chunks.clear();
+        } else {
+            res = new mf_node[m_size];
+            copy_to(res);
+        }
+
+        clear();
+        return res;
+    }
+};
+
+// Concatenate the buffers filled by different threads into one array that
+// can be freed by delete[], and empty the buffers
+inline mf::mf_node* merge_buffers(std::vector<NodeBuffer>& buffers, mf::mf_long& nnz)
+{
+    const int nbuf = int(buffers.size());
+    if(nbuf == 1)
+        return buffers[0].release(nnz);
+
+    std::vector<mf::mf_long> offsets(nbuf + 1, 0);
+    for(int i = 0; i < nbuf; i++)
+        offsets[i + 1] = offsets[i] + buffers[i].size();
+    nnz = offsets[nbuf];
+
+    mf::mf_node* res = new mf::mf_node[nnz];
+    ThreadPool::global().parallel_for(nbuf, 0, nbuf, [&] (int i)
+    {
+        buffers[i].copy_to(res + offsets[i]);
+        buffers[i].clear();
+    });
+
+    return res;
+}
+
+
+} // namespace Reco
+
+
+#endif // RECO_IO_H
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <cstdlib>
 #include "mf.h"
+#include "reco-read-data.h"
 
 using namespace mf;
 
@@ -27,10 +28,16 @@ class ModelExporterFile: public ModelExporter
 private:
     std::ofstream out_file;
     const mf_int  nfactor;
+    // If the IDs of the model are remapped, each line starts with the ID
+    const std::vector<mf_int>*      ids;
+    const std::vector<std::string>* names;
+    mf_int        row;
     
 public:
-    ModelExporterFile(const std::string& out_path_, const mf_int& nfactor_) :
-        out_file(out_path_), nfactor(nfactor_)
+    ModelExporterFile(const std::string& out_path_, const mf_int& nfactor_,
+                      const std::vector<mf_int>* ids_ = nullptr,
+                      const std::vector<std::string>* names_ = nullptr) :
+        out_file(out_path_), nfactor(nfactor_), ids(ids_), names(names_), row(0)
     {
         if(!out_file.is_open())
             Rcpp::stop("cannot write to " + out_path_);
@@ -38,6 +45,12 @@ public:
     
     void process_line(const std::string& line)
     {
+        if(ids)
+            out_file << (*ids)[row] << " ";
+        if(names)
+            out_file << (*names)[row] << " ";
+        row++;
+
         // Sample line:
         //     p0 T 0.560987 0.605718 0.528195 0.506409 ...
         // p0 means line 0 of P matrix
@@ -126,6 +139,14 @@ BEGIN_RCPP
     std::getline(model_file, line);  // k
     k = atoi(line.substr(line.find(' ') + 1).c_str());
     std::getline(model_file, line);  // b
+
+    // Dictionaries of user and item IDs
+    Reco::IdMaps ids;
+    bool remap = get_ids(Rcpp::List(), model_path, ids);
+    const std::vector<mf_int>* Pids = (remap && !ids.strings) ? &ids.users.keys() : nullptr;
+    const std::vector<mf_int>* Qids = (remap && !ids.strings) ? &ids.items.keys() : nullptr;
+    const std::vector<std::string>* Pnames = ids.strings ? &ids.user_names.keys() : nullptr;
+    const std::vector<std::string>* Qnames = ids.strings ? &ids.item_names.keys() : nullptr;
          
     Rcpp::S4 P(P_), Q(Q_);
     std::string P_type = Rcpp::as<std::string>(P.slot("type"));
@@ -141,7 +162,7 @@ BEGIN_RCPP
     
     if(P_type == "file")
     {
-        Pexporter = new ModelExporterFile(Rcpp::as<std::string>(P.slot("dest")), k);
+        Pexporter = new ModelExporterFile(Rcpp::as<std::string>(P.slot("dest")), k, Pids, Pnames);
     } else if(P_type == "memory") {
         Pexporter = new ModelExporterMemory(Pdata.begin(), k);
     } else if(P_type == "nothing") {
@@ -158,7 +179,7 @@ BEGIN_RCPP
 
     if(Q_type == "file")
     {
-        Qexporter = new ModelExporterFile(Rcpp::as<std::string>(Q.slot("dest")), k);
+        Qexporter = new ModelExporterFile(Rcpp::as<std::string>(Q.slot("dest")), k, Qids, Qnames);
     } else if(Q_type == "memory") {
         Qexporter = new ModelExporterMemory(Qdata.begin(), k);
     } else if(Q_type == "nothing") {
@@ -175,7 +196,8 @@ BEGIN_RCPP
     
     return Rcpp::List::create(
         Rcpp::Named("Pdata") = Pdata,
-        Rcpp::Named("Qdata") = Qdata
+        Rcpp::Named("Qdata") = Qdata,
+        Rcpp::Named("ids")   = remap ? wrap_ids(ids) : Rcpp::List::create()
     );
     
 END_RCPP
@@ -0,0 +1,174 @@
+#include "reco-pool.h"
+
+namespace Reco
+{
+
+// Shared by the calls of one start()
+struct ThreadPool::State
+{
+    std::function<void(int)> f;
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending;
+    std::exception_ptr error;
+
+    std::exception_ptr call(int index)
+    {
+        try
+        {
+            f(index);
+        } catch(...) {
+            return std::current_exception();
+        }
+        return std::exception_ptr();
+    }
+
+    void finish(std::exception_ptr err)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(err && !error)
+            error = err;
+        pending--;
+        if(pending == 0)
+            done.notify_all();
+    }
+};
+
+ThreadPool::Job::~Job()
+{
+    try
+    {
+        wait();
+    } catch(...) {}
+}
+
+void ThreadPool::Job::wait()
+{
+    if(!m_state)
+        return;
+
+    std::shared_ptr<State> state = std::move(m_state);
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&state] { return state->pending == 0; });
+    if(state->error)
+        std::rethrow_exception(state->error);
+}
+
+// The pool is never destroyed at exit, since joining threads while a
+// shared library is unloaded by the system can dead-lock on Windows.
+// The package joins them itself in R_unload_recosystem()
+static std::mutex global_mutex;
+static ThreadPool* global_pool = nullptr;
+
+ThreadPool& ThreadPool::global()
+{
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if(global_pool == nullptr)
+        global_pool = new ThreadPool();
+    return *global_pool;
+}
+
+void ThreadPool::shutdown()
+{
+    std::lock_guard<std::mutex> lock(global_mutex);
+    delete global_pool;
+    global_pool = nullptr;
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for(std::size_t i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+}
+
+int ThreadPool::size()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return int(m_threads.size());
+}
+
+ThreadPool::Job ThreadPool::start(int n, std::function<void(int)> f)
+{
+    Job job;
+    if(n <= 0)
+        return job;
+
+    job.m_state = std::make_shared<State>();
+    job.m_state->f = std::move(f);
+    job.m_state->pending = n;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Every queued task needs an idle thread
+        for(int missing = int(m_tasks.size()) + n - m_idle; missing > 0; missing--)
+        {
+            m_threads.emplace_back(&ThreadPool::work, this);
+            m_idle++;
+        }
+        for(int i = 0; i < n; i++)
+            m_tasks.push_back(Task{ job.m_state, i });
+    }
+    if(n == 1)
+        m_wake.notify_one();
+    else
+        m_wake.notify_all();
+    return job;
+}
+
+void ThreadPool::run(int n, const std::function<void(int)>& f)
+{
+    if(n <= 0)
+        return;
+
+    Job job = start(n - 1, [&f] (int i) { f(i + 1); });
+    std::exception_ptr error;
+    try
+    {
+        f(0);
+    } catch(...) {
+        error = std::current_exception();
+    }
+    job.wait();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+void ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+    {
+        m_wake.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+        if(m_tasks.empty())
+            return;
+
+        Task task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        m_idle--;
+        lock.unlock();
+        std::exception_ptr error = task.state->call(task.index);
+
+        // The thread is idle again before the job is done, so that a
+        // start() right after the job does not create a new thread
+        lock.lock();
+        m_idle++;
+        lock.unlock();
+        task.state->finish(error);
+        task.state.reset();
+        lock.lock();
+    }
+}
+
+
+} // namespace Reco
+
+
+// Called by R when the package is unloaded
+extern "C" void reco_shutdown_pool()
+{
+    Reco::ThreadPool::shutdown();
+}
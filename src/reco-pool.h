@@ -0,0 +1,159 @@
+#ifndef RECO_POOL_H
+#define RECO_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Reco
+{
+
+// A pool of worker threads shared by the whole process, so that training,
+// cross validation and tuning reuse the same threads for the solvers and
+// the parallel loops, instead of creating new threads for every model
+// Idle threads wait on a condition variable and take no CPU time
+class ThreadPool
+{
+private:
+    struct State;
+
+public:
+    // A group of calls started by start()
+    class Job
+    {
+    private:
+        friend class ThreadPool;
+        std::shared_ptr<State> m_state;
+
+    public:
+        Job() {}
+        Job(Job&& other) = default;
+        Job& operator=(Job&& other) = default;
+        // Waits for the calls that are still running
+        ~Job();
+
+        // Return when all the calls have returned, and rethrow the first
+        // exception thrown by them
+        void wait();
+    };
+
+    // The pool of the process, created on first use
+    static ThreadPool& global();
+    // Join the threads of the global pool, which is created again if it
+    // is used later. Must not be called while the pool is running calls
+    static void shutdown();
+
+    ThreadPool() : m_idle(0), m_stop(false) {}
+    ~ThreadPool();
+
+    // Number of threads in the pool
+    int size();
+
+    // Call f(0), ..., f(n - 1) concurrently on threads of the pool and
+    // return without waiting for them. Every call gets its own thread, and
+    // the pool grows if there are not enough idle threads, so the calls
+    // may wait for each other
+    Job start(int n, std::function<void(int)> f);
+
+    // Call f(0), ..., f(n - 1) concurrently, f(0) on the calling thread and
+    // the others on threads of the pool, and return when all of them have
+    // returned. The first exception thrown by a call is rethrown
+    void run(int n, const std::function<void(int)>& f);
+
+    // Divide [begin, end) into at most nthread contiguous ranges, and call
+    // f(t, first, last) on range t of them in parallel
+    template <typename Index, typename Func>
+    void parallel_ranges(int nthread, Index begin, Index end, Func f)
+    {
+        if(end <= begin)
+            return;
+        const long long len = (long long)(end - begin);
+        const int nparts = int(std::max(std::min((long long)nthread, len), 1LL));
+        if(nparts == 1)
+        {
+            f(0, begin, end);
+            return;
+        }
+        run(nparts, [&] (int t)
+        {
+            f(t, Index(begin + len * t / nparts), Index(begin + len * (t + 1) / nparts));
+        });
+    }
+
+    // Call f(i) for i in [begin, end) with at most nthread threads
+    // With static scheduling each thread works on one contiguous range,
+    // and with dynamic scheduling the threads take one index at a time
+    template <typename Index, typename Func>
+    void parallel_for(int nthread, Index begin, Index end, Func f, bool dynamic = false)
+    {
+        if(!dynamic)
+        {
+            parallel_ranges(nthread, begin, end, [&] (int, Index first, Index last)
+            {
+                for(Index i = first; i < last; i++)
+                    f(i);
+            });
+            return;
+        }
+
+        if(end <= begin)
+            return;
+        const int nparts = int(std::max(std::min((long long)nthread, (long long)(end - begin)), 1LL));
+        std::atomic<Index> next(begin);
+        run(nparts, [&] (int)
+        {
+            for(Index i = next++; i < end; i = next++)
+                f(i);
+        });
+    }
+
+    // Sum of f(i) for i in [begin, end), computed with at most nthread
+    // threads. Each thread sums its own range, and the partial sums are
+    // added in the order of the ranges
+    template <typename Index, typename Func>
+    double parallel_sum(int nthread, Index begin, Index end, Func f)
+    {
+        std::vector<double> sums(std::max(nthread, 1), 0.0);
+        parallel_ranges(nthread, begin, end, [&] (int t, Index first, Index last)
+        {
+            double sum = 0;
+            for(Index i = first; i < last; i++)
+                sum += f(i);
+            sums[t] = sum;
+        });
+        double sum = 0;
+        for(std::size_t t = 0; t < sums.size(); t++)
+            sum += sums[t];
+        return sum;
+    }
+
+private:
+    struct Task
+    {
+        std::shared_ptr<State> state;
+        int index;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::vector<std::thread> m_threads;
+    std::deque<Task> m_tasks;
+    // Threads that are not running a task
+    int m_idle;
+    bool m_stop;
+
+    void work();
+};
+
+
+} // namespace Reco
+
+
+#endif // RECO_POOL_H
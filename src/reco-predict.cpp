@@ -14,24 +14,13 @@
 using namespace mf;
 
 // Readers
+// The rating column is not required in testing data
 class TestDataFileReader: public DataFileReader
 {
 public:
-    TestDataFileReader(const std::string& file_path, bool index1 = false) :
-        DataFileReader(file_path, index1)
+    TestDataFileReader(const std::string& file_path, bool index1 = false, bool string_id = false) :
+        DataFileReader(file_path, index1, false, string_id)
     {}
-
-    bool next(mf_int& u, mf_int& v, mf_float& r)
-    {
-        std::getline(in_file, line);
-        std::stringstream ss(line);
-
-        ss >> u >> v;
-        u -= ind_offset;
-        v -= ind_offset;
-
-        return !ss.fail();
-    }
 };
 
 class TestDataMemoryReader: public DataReader
@@ -41,6 +30,7 @@ protected:
     const int*    pen_userid;
     const int*    pen_itemid;
     const mf_int  ind_offset;
+    std::vector< Part<mf_long> > parts;
 
 public:
     TestDataMemoryReader(Rcpp::IntegerVector user_ind,
@@ -54,22 +44,63 @@ public:
 
     mf_long count() { return len; }
 
-    void open() {}
+    mf_long size_hint() { return len; }
 
-    bool next(mf_int& u, mf_int& v, mf_float& r)
+    int open(int nparts = 1)
     {
-        u = *pen_userid - ind_offset;
-        v = *pen_itemid - ind_offset;
+        parts = split_index(len, nparts);
+        return int(parts.size());
+    }
+
+    bool has_next(int part = 0) { return parts[part].cursor < parts[part].end; }
 
-        bool failure = Rcpp::IntegerVector::is_na(*pen_userid) ||
-                       Rcpp::IntegerVector::is_na(*pen_itemid);
+    bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0)
+    {
+        const mf_long i = parts[part].cursor++;
+        u = pen_userid[i] - ind_offset;
+        v = pen_itemid[i] - ind_offset;
 
-        pen_userid++;
-        pen_itemid++;
+        bool failure = Rcpp::IntegerVector::is_na(pen_userid[i]) ||
+                       Rcpp::IntegerVector::is_na(pen_itemid[i]);
 
         return !failure;
     }
 
+    // See DataMemoryReader::next_batch()
+    mf_long next_batch(mf_node* nodes, mf_long len,
+                       std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        const mf_long start = parts[part].cursor;
+        len = std::min(len, parts[part].end - start);
+        parts[part].cursor += len;
+
+        const int* pu = pen_userid + start;
+        const int* pv = pen_itemid + start;
+        const int  na = NA_INTEGER;
+
+        int nbad = 0;
+        for(mf_long i = 0; i < len; i++)
+        {
+            nodes[i].u = pu[i] - ind_offset;
+            nodes[i].v = pv[i] - ind_offset;
+            nodes[i].r = 0;
+            nbad += (pu[i] == na) | (pv[i] == na);
+        }
+
+        if(nbad > 0)
+        {
+            for(mf_long i = 0; i < len; i++)
+            {
+                if(pu[i] == na)
+                    invalid.push_back(InvalidRecord{ i, InvalidRecord::BadUser });
+                else if(pv[i] == na)
+                    invalid.push_back(InvalidRecord{ i, InvalidRecord::BadItem });
+            }
+        }
+
+        return len;
+    }
+
     void close() {}
 };
 
@@ -139,7 +170,7 @@ public:
 
 
 
-RcppExport SEXP reco_predict(SEXP test_data_, SEXP model_path_, SEXP output_, SEXP model_inmemory_)
+RcppExport SEXP reco_predict(SEXP test_data_, SEXP model_path_, SEXP output_, SEXP model_inmemory_, SEXP ids_)
 {
 BEGIN_RCPP
 
@@ -151,21 +182,35 @@ BEGIN_RCPP
     {
         std::string path = Rcpp::as<std::string>(test_data.slot("source"));
         bool index1 = Rcpp::as<bool>(test_data.slot("index1"));
-        reader = new TestDataFileReader(path, index1);
+        bool string_id = Rcpp::as<bool>(test_data.slot("string_id"));
+        reader = new TestDataFileReader(path, index1, string_id);
     } else if(type == "memory") {
         Rcpp::List lst = test_data.slot("source");
         bool index1 = Rcpp::as<bool>(test_data.slot("index1"));
-        reader = new TestDataMemoryReader(lst[0], lst[1], index1);
+        if(TYPEOF(SEXP(lst[0])) == STRSXP)
+            reader = new DataMemoryStringReader(lst[0], lst[1], lst[2], false);
+        else
+            reader = new TestDataMemoryReader(lst[0], lst[1], index1);
+    } else if(type == "sparse") {
+        Rcpp::List lst = test_data.slot("source");
+        bool by_col = Rcpp::as<bool>(lst[3]);
+        // Values of the matrix are not required in testing data
+        reader = new DataSparseReader(lst[0], lst[1], lst[2], by_col, false);
+    } else if(type == "binary") {
+        std::string path = Rcpp::as<std::string>(test_data.slot("source"));
+        reader = new DataBinaryReader(path);
     } else {
         Rcpp::stop("unsupported data source");
     }
-    mf_long len = reader->count();
+    reader->set_strict(Rcpp::as<bool>(test_data.slot("strict")));
 
     // Exporter
+    // The number of records is only needed when predicted values are
+    // returned in memory, and the readers stop at the end of data otherwise
     PredictionExporter* exporter = nullptr;
     Rcpp::S4 output(output_);
     type = Rcpp::as<std::string>(output.slot("type"));
-    Rcpp::NumericVector res((type == "memory") ? len : 0);
+    Rcpp::NumericVector res((type == "memory") ? reader->count() : 0);
     if(type == "file")
     {
         exporter = new PredictionExporterFile(Rcpp::as<std::string>(output.slot("dest")));
@@ -200,25 +245,57 @@ BEGIN_RCPP
             Rcpp::stop("cannot load model from " + model_path);
     }
 
+    // IDs of testing data are translated if the model is trained on
+    // remapped IDs, and unknown IDs are predicted like unseen users and items
+    // String IDs are translated by the reader
+    Reco::IdMaps ids;
+    bool remap = get_ids(ids_, Rcpp::as<std::string>(model_path_), ids);
+    mf_int offset = Rcpp::as<bool>(test_data.slot("index1"));
+    if(reader->string_ids() != ids.strings)
+    {
+        if(!model_inmemory.size())
+            mf_destroy_model(&model);
+        delete exporter;
+        delete reader;
+        Rcpp::stop(ids.strings ? "the model is trained on string IDs, but testing data have integer IDs" :
+                                 "testing data have string IDs, but the model is not trained on string IDs");
+    }
+    reader->set_dict(&ids, false);
+
     // Prediction
-    mf_int u, v;
-    mf_float dummy;
+    // Predicted values are written in order, so the data are read as one part
+    // Invalid records are reported together after the prediction, or stop
+    // the prediction in strict mode
+    std::vector<mf_node> batch(4096);
+    std::vector<InvalidRecord> invalid;
+    InvalidLog log;
+    const bool strict = reader->is_strict();
     reader->open();
-    for(mf_long lino = 1; lino <= len; lino++)
+    for(mf_long lino = 0; reader->has_next(); )
     {
-        bool status = reader->next(u, v, dummy);
-        // If status is false, then an error occurs in this line
-        if(!status)
+        invalid.clear();
+        mf_long len = reader->next_batch(batch.data(), batch.size(), invalid);
+        if(remap && !ids.strings)
+            Reco::map_ids(batch.data(), len, ids, offset);
+        std::size_t next_invalid = 0;
+        for(mf_long i = 0; i < len; i++)
         {
-            std::ostringstream message;
-            message << "line " << lino << " of testing data is invalid, NA returned";
-            Rcpp::warning(message.str());
-            exporter->process_value(std::numeric_limits<mf_float>::quiet_NaN());
-            continue;
+            // An error occurs in this line
+            if(next_invalid < invalid.size() && invalid[next_invalid].pos == i)
+            {
+                log.add(lino + i + 1, invalid[next_invalid].reason);
+                next_invalid++;
+                exporter->process_value(std::numeric_limits<mf_float>::quiet_NaN());
+                continue;
+            }
+
+            mf_float val = mf_predict(model, batch[i].u, batch[i].v);
+            exporter->process_value(val);
         }
+        lino += len;
 
-        mf_float val = mf_predict(model, u, v);
-        exporter->process_value(val);
+        if(strict && log.count() > 0)
+            break;
     }
     reader->close();
 
@@ -227,6 +304,13 @@ BEGIN_RCPP
     delete exporter;
     delete reader;
 
+    if(log.count() > 0)
+    {
+        if(strict)
+            Rcpp::stop("testing data: " + log.first_error());
+        Rcpp::warning(log.summary("of testing data, NA returned"));
+    }
+
     if(res.length() == 0)  return R_NilValue;
     return res;
 
@@ -1,4 +1,7 @@
+#include <atomic>
+
 #include "reco-read-data.h"
+#include "reco-pool.h"
 
 using namespace mf;
 
@@ -14,20 +17,102 @@ DataReader* get_reader(SEXP data_source)
     {
         std::string path = Rcpp::as<std::string>(ds.slot("source"));
         bool index1 = Rcpp::as<bool>(ds.slot("index1"));
-        res = new DataFileReader(path, index1);
+        bool string_id = Rcpp::as<bool>(ds.slot("string_id"));
+        res = new DataFileReader(path, index1, true, string_id);
     } else if(type == "memory") {
         Rcpp::List lst = ds.slot("source");
         bool index1 = Rcpp::as<bool>(ds.slot("index1"));
-        res = new DataMemoryReader(lst[0], lst[1], lst[2], index1);
+        if(TYPEOF(SEXP(lst[0])) == STRSXP)
+            res = new DataMemoryStringReader(lst[0], lst[1], lst[2]);
+        else
+            res = new DataMemoryReader(lst[0], lst[1], lst[2], index1);
+    } else if(type == "sparse") {
+        Rcpp::List lst = ds.slot("source");
+        bool by_col = Rcpp::as<bool>(lst[3]);
+        res = new DataSparseReader(lst[0], lst[1], lst[2], by_col);
+    } else if(type == "binary") {
+        std::string path = Rcpp::as<std::string>(ds.slot("source"));
+        res = new DataBinaryReader(path);
     } else {
         Rcpp::stop("unsupported data source");
     }
+    res->set_strict(Rcpp::as<bool>(ds.slot("strict")));
 
     return res;
 }
 
+void InvalidLog::append(const InvalidLog& log, mf_long first_line)
+{
+    for(int r = 0; r < InvalidRecord::NReasons; r++)
+        m_counts[r] += log.m_counts[r];
+    for(std::size_t i = 0; i < log.m_lines.size() && m_lines.size() < m_max_lines; i++)
+        m_lines.push_back(InvalidRecord{ first_line - 1 + log.m_lines[i].pos, log.m_lines[i].reason });
+}
+
+mf_long InvalidLog::count() const
+{
+    mf_long total = 0;
+    for(int r = 0; r < InvalidRecord::NReasons; r++)
+        total += m_counts[r];
+    return total;
+}
+
+std::string InvalidLog::summary(const std::string& action) const
+{
+    const mf_long total = count();
+    std::ostringstream message;
+    message << total << (total == 1 ? " invalid line " : " invalid lines ") << action << " (";
+    bool first = true;
+    for(int r = 0; r < InvalidRecord::NReasons; r++)
+    {
+        if(m_counts[r] == 0)
+            continue;
+        message << (first ? "" : ", ") << m_counts[r] << " with " << reason_text(r);
+        first = false;
+    }
+    message << "): ";
+
+    if(total > mf_long(m_lines.size()))
+        message << "first lines ";
+    else
+        message << (total == 1 ? "line " : "lines ");
+    for(std::size_t i = 0; i < m_lines.size(); i++)
+        message << (i == 0 ? "" : ", ") << m_lines[i].pos;
+    if(total > mf_long(m_lines.size()))
+        message << ", ...";
+
+    return message.str();
+}
+
+std::string InvalidLog::first_error() const
+{
+    if(m_lines.empty())
+        return std::string();
+
+    std::ostringstream message;
+    message << "line " << m_lines[0].pos << " is invalid (" << reason_text(m_lines[0].reason) << ")";
+    return message.str();
+}
+
+const char* InvalidLog::reason_text(int reason)
+{
+    switch(reason)
+    {
+        case InvalidRecord::BadUser:
+            return "invalid user index";
+        case InvalidRecord::BadItem:
+            return "invalid item index";
+        case InvalidRecord::BadRating:
+            return "invalid rating";
+        case InvalidRecord::NegativeIndex:
+            return "negative index";
+        default:
+            return "invalid record";
+    }
+}
+
 // An mf_problem stands for a data object
-mf_problem read_data(DataReader* reader)
+mf_problem read_data(DataReader* reader, int nthread)
 {
     // Default empty data object
     mf_problem prob;
@@ -36,40 +121,225 @@ mf_problem read_data(DataReader* reader)
     prob.nnz = 0;
     prob.R = nullptr;
 
-    // Upper limit of nnz
-    mf_long max_nnz = reader->count();
+    // Binary data need no parsing, but the records are used as they are
+    // stored, so they are checked against the dimensions in the header
+    if(reader->read_direct(prob))
+    {
+        mf_long first = 0;
+        const mf_long count = Reco::check_binary(prob, nthread, first);
+        if(count > 0)
+        {
+            reader->free_data(prob);
+            std::ostringstream message;
+            message << count << (count == 1 ? " invalid record" : " invalid records")
+                    << " in binary data file (index out of range or invalid rating): "
+                    << "first record " << first + 1;
+            Rcpp::stop(message.str());
+        }
+        return prob;
+    }
 
-    // We have to allocate R to the maximum length
-    // In reality if there exist invalid lines in the file, for example,
-    // prob.nnz will be smaller than max_nnz
-    mf_node *R = new mf_node[max_nnz];
+    // The records are divided into parts that are read by different threads
+    // in a single pass. Each part goes into its own growable buffer, and the
+    // buffers are concatenated in the end. If there are invalid lines in
+    // the file, for example, prob.nnz will be smaller than the number of
+    // lines
+    const int nparts = reader->open(std::max(nthread, 1));
+    const mf_long hint = reader->size_hint() / nparts + 1;
+    const mf_long batch_size = 4096;
+    std::vector<Reco::NodeBuffer> buffers(nparts);
+    std::vector<mf_int> part_m(nparts, 0), part_n(nparts, 0);
+    std::vector<mf_long> part_lines(nparts, 0);
+    // Invalid records of each part, with line numbers within the part
+    std::vector<InvalidLog> logs(nparts);
+    std::atomic<bool> out_of_memory(false);
+    // In strict mode, a part stops at its first invalid record, and the
+    // parts after it stop too. The parts before it are read to the end,
+    // so that the line number of the record is known
+    const bool strict = reader->is_strict();
+    std::atomic<int> first_bad(nparts);
 
-    // Read data
-    mf_node N;
-    mf_long idx = 0;
-    reader->open();
-    for(mf_long lino = 1; lino <= max_nnz; lino++)
+    Reco::ThreadPool::global().parallel_for(nparts, 0, nparts, [&] (int i)
     {
-        bool status = reader->next(N.u, N.v, N.r);
-        // If status is false, then an error occurs in this line
-        if(!status)
+        try
         {
-            std::ostringstream message;
-            message << "line " << lino << " is invalid, ignored";
-            Rcpp::warning(message.str());
-            continue;
+            // Local variables are used in the loop, so that threads do not
+            // write to the same cache lines
+            Reco::NodeBuffer buffer(hint);
+            std::vector<InvalidRecord> batch_invalid;
+            InvalidLog log;
+            mf_int m = 0, n = 0;
+            mf_long lino = 0;
+            while(reader->has_next(i) && first_bad.load(std::memory_order_relaxed) > i)
+            {
+                // Records are read in batches directly into the buffer
+                mf_long len = batch_size;
+                mf_node* nodes = buffer.prepare(len);
+                batch_invalid.clear();
+                len = reader->next_batch(nodes, len, batch_invalid, i);
+
+                // Negative indices, for example 0 in data with index1 = TRUE,
+                // are also invalid
+                mf_int neg = 0;
+                for(mf_long j = 0; j < len; j++)
+                    neg |= nodes[j].u | nodes[j].v;
+
+                // Remove invalid records from the batch
+                mf_long nvalid = len;
+                if(!batch_invalid.empty() || neg < 0)
+                {
+                    nvalid = 0;
+                    std::size_t next_invalid = 0;
+                    for(mf_long j = 0; j < len; j++)
+                    {
+                        int reason = -1;
+                        if(next_invalid < batch_invalid.size() && batch_invalid[next_invalid].pos == j)
+                            reason = batch_invalid[next_invalid++].reason;
+                        else if(nodes[j].u < 0 || nodes[j].v < 0)
+                            reason = InvalidRecord::NegativeIndex;
+
+                        if(reason >= 0)
+                        {
+                            log.add(lino + j + 1, reason);
+                            continue;
+                        }
+                        nodes[nvalid++] = nodes[j];
+                    }
+                }
+
+                for(mf_long j = 0; j < nvalid; j++)
+                {
+                    m = std::max(m, nodes[j].u + 1);
+                    n = std::max(n, nodes[j].v + 1);
+                }
+                buffer.commit(nvalid);
+                lino += len;
+
+                if(strict && log.count() > 0)
+                {
+                    int bad = first_bad.load();
+                    while(bad > i && !first_bad.compare_exchange_weak(bad, i)) {}
+                }
+            }
+            buffers[i] = std::move(buffer);
+            logs[i] = std::move(log);
+            part_m[i] = m;
+            part_n[i] = n;
+            part_lines[i] = lino;
+        } catch(std::bad_alloc&) {
+            out_of_memory = true;
         }
+    });
+    reader->close();
 
-        if(N.u+1 > prob.m)
-            prob.m = N.u+1;
-        if(N.v+1 > prob.n)
-            prob.n = N.v+1;
-        R[idx] = N;
-        idx++;
+    if(out_of_memory)
+        throw std::bad_alloc();
+
+    // R functions can only be called from the main thread
+    InvalidLog log;
+    mf_long first_line = 1;
+    for(int i = 0; i < nparts; i++)
+    {
+        log.append(logs[i], first_line);
+        first_line += part_lines[i];
+        if(strict && log.count() > 0)
+            Rcpp::stop(log.first_error());
+
+        prob.m = std::max(prob.m, part_m[i]);
+        prob.n = std::max(prob.n, part_n[i]);
     }
-    reader->close();
-    prob.nnz = idx;
-    prob.R = R;
+    if(log.count() > 0)
+        Rcpp::warning(log.summary("ignored"));
+    prob.R = Reco::merge_buffers(buffers, prob.nnz);
 
     return prob;
 }
+
+
+
+Rcpp::List wrap_ids(const Reco::IdMaps& ids)
+{
+    if(ids.strings)
+    {
+        return Rcpp::List::create(
+            Rcpp::Named("user") = Rcpp::wrap(ids.user_names.keys()),
+            Rcpp::Named("item") = Rcpp::wrap(ids.item_names.keys())
+        );
+    }
+    return Rcpp::List::create(
+        Rcpp::Named("user") = Rcpp::wrap(ids.users.keys()),
+        Rcpp::Named("item") = Rcpp::wrap(ids.items.keys())
+    );
+}
+
+bool get_ids(SEXP ids_, const std::string& model_path, Reco::IdMaps& ids)
+{
+    Rcpp::List lst(ids_);
+    if(lst.size() && TYPEOF(SEXP(lst["user"])) == STRSXP)
+    {
+        auto insert = [] (Reco::IdDict<std::string>& dict, Rcpp::CharacterVector names)
+        {
+            dict.reserve(names.length());
+            for(mf_long i = 0; i < names.length(); i++)
+            {
+                SEXP str = STRING_ELT(names, i);
+                dict.insert(Reco::StringRef{ CHAR(str), std::size_t(LENGTH(str)) });
+            }
+        };
+        ids.strings = true;
+        insert(ids.user_names, lst["user"]);
+        insert(ids.item_names, lst["item"]);
+        return true;
+    }
+    if(lst.size())
+    {
+        Rcpp::IntegerVector users = lst["user"], items = lst["item"];
+        ids.users.reserve(users.length());
+        for(mf_long i = 0; i < users.length(); i++)
+            ids.users.insert(users[i]);
+        ids.items.reserve(items.length());
+        for(mf_long i = 0; i < items.length(); i++)
+            ids.items.insert(items[i]);
+        return true;
+    }
+
+    if(model_path.empty())
+        return false;
+    std::ifstream f(Reco::ids_path(model_path));
+    if(!f.is_open())
+        return false;
+    f.close();
+
+    if(!Reco::read_ids(Reco::ids_path(model_path), ids))
+        Rcpp::stop("cannot read IDs from " + Reco::ids_path(model_path));
+    return true;
+}
+
+
+// Convert a data source to a binary triplet file
+RcppExport SEXP reco_write_binary(SEXP data_source_, SEXP path_, SEXP nthread_)
+{
+BEGIN_RCPP
+
+    std::string path = Rcpp::as<std::string>(path_);
+    int nthread = Rcpp::as<int>(nthread_);
+
+    DataReader* reader = get_reader(data_source_);
+    if(reader->string_ids())
+    {
+        delete reader;
+        Rcpp::stop("data with string IDs cannot be converted to binary format");
+    }
+    mf_problem prob = read_data(reader, nthread);
+
+    bool status = Reco::write_binary(path, prob);
+    reader->free_data(prob);
+    delete reader;
+
+    if(!status)
+        Rcpp::stop("cannot write to " + path);
+
+    return R_NilValue;
+
+END_RCPP
+}
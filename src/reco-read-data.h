@@ -8,9 +8,66 @@
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <vector>
 
 #include <Rcpp.h>
 #include "mf.h"
+#include "reco-io.h"
+#include "reco-dict.h"
+
+// An invalid record in a batch read by DataReader::next_batch()
+struct InvalidRecord
+{
+    enum Reason { BadUser, BadItem, BadRating, NegativeIndex, BadRecord, NReasons };
+
+    mf::mf_long pos;     // Position in the batch
+    int         reason;
+};
+
+// Invalid records found while reading data
+// Records are counted by reason, and only the line numbers of the first
+// few records are kept, so that dirty data with millions of invalid records
+// give one short warning instead of a warning for each record
+class InvalidLog
+{
+private:
+    mf::mf_long                m_counts[InvalidRecord::NReasons];
+    // The first records, with pos being the line number
+    std::vector<InvalidRecord> m_lines;
+    std::size_t                m_max_lines;
+
+public:
+    explicit InvalidLog(std::size_t max_lines = 10) :
+        m_max_lines(max_lines)
+    {
+        std::fill(m_counts, m_counts + InvalidRecord::NReasons, mf::mf_long(0));
+    }
+
+    // line starts from 1
+    void add(mf::mf_long line, int reason)
+    {
+        m_counts[reason]++;
+        if(m_lines.size() < m_max_lines)
+            m_lines.push_back(InvalidRecord{ line, reason });
+    }
+
+    // Append a log whose line numbers start from first_line instead of 1,
+    // such as the log of the next part of the data
+    void append(const InvalidLog& log, mf::mf_long first_line);
+
+    mf::mf_long count() const;
+
+    // One message for all records, for example
+    //   "3 invalid lines ignored (2 with invalid user index, 1 with invalid
+    //   rating): lines 5000, 12001, 18011"
+    // action is what happens to the invalid lines
+    std::string summary(const std::string& action) const;
+
+    // The first record, for example "line 5000 is invalid (invalid user index)"
+    std::string first_error() const;
+
+    static const char* reason_text(int reason);
+};
 
 class DataReader
 {
@@ -19,23 +76,124 @@ protected:
     typedef mf::mf_long  mf_long;
     typedef mf::mf_float mf_float;
 
+    // Current position and end of a part
+    // Parts are padded to the size of a cache line, since they are updated
+    // by different threads
+    template <typename T>
+    struct Part
+    {
+        T    cursor;
+        T    end;
+        char padding[64 - 2 * sizeof(T)];
+    };
+
+    // Divide [0, len) into at most nparts ranges of about the same length,
+    // each having at least min_part elements
+    static std::vector< Part<mf_long> > split_index(mf_long len, int nparts, mf_long min_part = 1 << 16)
+    {
+        nparts = int(std::max(mf_long(1), std::min(mf_long(nparts), len / min_part)));
+        std::vector< Part<mf_long> > parts(nparts);
+        for(int i = 0; i < nparts; i++)
+        {
+            parts[i].cursor = len * i / nparts;
+            parts[i].end = len * (i + 1) / nparts;
+        }
+        return parts;
+    }
+
+    // Dictionaries of string IDs, see set_dict()
+    Reco::IdMaps* dict;
+    bool          dict_insert;
+
+    // Dense indices of string IDs
+    mf_int user_index(const Reco::StringRef& id)
+    {
+        return dict_insert ? dict->user_names.insert(id) : dict->user_names.find(id);
+    }
+    mf_int item_index(const Reco::StringRef& id)
+    {
+        return dict_insert ? dict->item_names.insert(id) : dict->item_names.find(id);
+    }
+
+    bool          strict;
+
 public:
+    DataReader() : dict(nullptr), dict_insert(false), strict(false) {}
+
+    // In strict mode, reading stops with an error at the first invalid
+    // record, instead of skipping invalid records
+    void set_strict(bool value) { strict = value; }
+    bool is_strict() const { return strict; }
+
+    // Whether the user and item IDs are strings
+    // Such readers translate the IDs with the dictionaries given by
+    // set_dict(), and read the data as one part, so that the dictionaries
+    // are filled in the order of the data
+    virtual bool string_ids() { return false; }
+
+    // If insert is true, new IDs are added to the dictionaries, otherwise
+    // unknown IDs are given the index -1
+    void set_dict(Reco::IdMaps* ids, bool insert)
+    {
+        dict = ids;
+        dict_insert = insert;
+    }
+
     // Return an upper limit of prob.nnz
     // When there exist invalid data in the file or data frame, this will be
     // greater than prob.nnz
     virtual mf_long count() = 0;
 
+    // A cheap guess of count() that can be used to size buffers
+    // Only valid after open()
+    virtual mf_long size_hint() = 0;
+
     // Ready to read
-    virtual void open() = 0;
+    // The records are divided into at most nparts consecutive parts that can
+    // be read concurrently by different threads, and the actual number of
+    // parts is returned
+    virtual int open(int nparts = 1) = 0;
+
+    // Whether there are records left to read in a part
+    virtual bool has_next(int part = 0) = 0;
 
     // Read the data into u, v, r and return the status
     // true for success and false for failure
     // u and v start from 0
-    virtual bool next(mf_int& u, mf_int& v, mf_float& r) = 0;
+    virtual bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0) = 0;
+
+    // Read at most len records of a part into nodes, and return the number
+    // of records read
+    // Invalid records are appended to invalid in the order of positions
+    // The default version calls next() on each record, and readers can
+    // override it with bulk conversion and more specific reasons
+    virtual mf_long next_batch(mf::mf_node* nodes, mf_long len,
+                               std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        mf_long i = 0;
+        for(; i < len && has_next(part); i++)
+        {
+            if(!next(nodes[i].u, nodes[i].v, nodes[i].r, part))
+                invalid.push_back(InvalidRecord{ i, InvalidRecord::BadRecord });
+        }
+        return i;
+    }
 
     // Finish reading
     virtual void close() = 0;
 
+    // Readers whose data are already stored as an array of mf_node can fill
+    // prob directly, without open() and next()
+    // Return false if the reader does not support this
+    virtual bool read_direct(mf::mf_problem& prob) { return false; }
+
+    // Free prob.R created by read_data()
+    virtual void free_data(mf::mf_problem& prob)
+    {
+        delete [] prob.R;
+        prob.R = nullptr;
+    }
+
     virtual ~DataReader() {}
 };
 
@@ -43,14 +201,95 @@ public:
 class DataFileReader: public DataReader
 {
 protected:
-    const std::string path;
-    const int         ind_offset;
-    std::ifstream     in_file;
-    std::string       line;
+    const std::string      path;
+    const int              ind_offset;
+    const bool             with_rating;
+    const bool             string_id;
+    // Plain text files are mapped into memory, and compressed files are
+    // decompressed as one part
+    const bool             compressed;
+    Reco::MappedFile       in_file;
+    Reco::DecompressedFile stream;
+    std::vector< Part<const char*> > parts;
+
+    // Move to the next decompressed chunk when the current one is used up
+    bool refill(int part)
+    {
+        while(compressed && stream.next_chunk(parts[part].cursor, parts[part].end))
+        {
+            if(parts[part].cursor < parts[part].end)
+                return true;
+        }
+        return false;
+    }
+
+    void open_stream(Reco::DecompressedFile& f)
+    {
+        if(!f.open(path))
+            throw std::runtime_error("cannot open file '" + path + "': " + f.error());
+    }
+
+    void check_stream(Reco::DecompressedFile& f)
+    {
+        if(f.failed())
+            throw std::runtime_error("cannot decompress file '" + path + "': " + f.error());
+    }
+
+    // Parse the line at the cursor of a part and move the cursor to the
+    // next line
+    // The rating is not read if r is nullptr
+    // Return -1 for a valid line, and the InvalidRecord::Reason otherwise
+    int next_line(mf_int& u, mf_int& v, mf_float* r, int part)
+    {
+        const char*& cursor = parts[part].cursor;
+        const char* end = parts[part].end;
+        if(cursor >= end)
+            return InvalidRecord::BadRecord;
+
+        const char* line_end = Reco::next_line(cursor, end);
+        int reason = -1;
+        if(string_id)
+        {
+            const char *uid, *vid;
+            std::size_t ulen, vlen;
+            if(!Reco::parse_token(cursor, line_end, uid, ulen))
+                reason = InvalidRecord::BadUser;
+            else if(!Reco::parse_token(cursor, line_end, vid, vlen))
+                reason = InvalidRecord::BadItem;
+            else if(r != nullptr && !Reco::parse_float(cursor, line_end, *r))
+                reason = InvalidRecord::BadRating;
+            cursor = line_end;
+
+            // IDs of invalid lines are not added to the dictionaries
+            if(reason < 0)
+            {
+                u = user_index(Reco::StringRef{ uid, ulen });
+                v = item_index(Reco::StringRef{ vid, vlen });
+            }
+            return reason;
+        }
+
+        if(!Reco::parse_int(cursor, line_end, u))
+            reason = InvalidRecord::BadUser;
+        else if(!Reco::parse_int(cursor, line_end, v))
+            reason = InvalidRecord::BadItem;
+        else if(r != nullptr && !Reco::parse_float(cursor, line_end, *r))
+            reason = InvalidRecord::BadRating;
+        cursor = line_end;
+
+        u -= ind_offset;
+        v -= ind_offset;
+
+        return reason;
+    }
 
 public:
-    DataFileReader(const std::string& file_path, bool index1 = false) :
-        path(file_path), ind_offset(index1)
+    // If with_rating is false, the rating column is not read
+    // If string_id is true, the first two columns are string IDs
+    DataFileReader(const std::string& file_path, bool index1 = false,
+                   bool with_rating = true, bool string_id = false) :
+        path(file_path), ind_offset(index1), with_rating(with_rating), string_id(string_id),
+        compressed(Reco::DecompressedFile::detect(file_path) != Reco::DecompressedFile::Plain)
     {
         // Test whether file can be opened
         std::ifstream f(path);
@@ -60,39 +299,96 @@ public:
 
     mf_long count()
     {
-        std::ifstream f(path);
-        if(!f.is_open())
+        if(compressed)
+        {
+            Reco::DecompressedFile f;
+            open_stream(f);
+            mf_long nlines = 0;
+            const char *begin, *end;
+            while(f.next_chunk(begin, end))
+                nlines += Reco::count_lines(begin, end);
+            check_stream(f);
+            return nlines;
+        }
+
+        Reco::MappedFile f;
+        if(!f.open(path))
             throw std::runtime_error("cannot open file '" + path + '\'');
 
-        std::string line;
-        mf_long nlines = 0;
-        while(std::getline(f, line))
-            nlines++;
+        return Reco::count_lines(f.begin(), f.end());
+    }
 
-        f.close();
-        return nlines;
+    // The size of decompressed data is unknown in advance
+    mf_long size_hint()
+    {
+        if(compressed)
+            return 0;
+        return Reco::estimate_lines(in_file.begin(), in_file.end());
     }
 
-    void open()
+    bool string_ids() { return string_id; }
+
+    int open(int nparts = 1)
     {
-        in_file.open(path);
-        if(!in_file.is_open())
+        if(string_id)
+            nparts = 1;
+        if(compressed)
+        {
+            open_stream(stream);
+            parts.resize(1);
+            parts[0].cursor = parts[0].end = nullptr;
+            return 1;
+        }
+
+        if(!in_file.open(path))
             throw std::runtime_error("cannot open file '" + path + '\'');
+        std::vector<const char*> bounds =
+            Reco::split_lines(in_file.begin(), in_file.end(), nparts);
+        parts.resize(bounds.size() - 1);
+        for(std::size_t i = 0; i < parts.size(); i++)
+        {
+            parts[i].cursor = bounds[i];
+            parts[i].end = bounds[i + 1];
+        }
+        return int(parts.size());
     }
 
-    bool next(mf_int& u, mf_int& v, mf_float& r)
+    bool has_next(int part = 0)
     {
-        std::getline(in_file, line);
-        std::stringstream ss(line);
+        return parts[part].cursor < parts[part].end || refill(part);
+    }
 
-        ss >> u >> v >> r;
-        u -= ind_offset;
-        v -= ind_offset;
+    bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0)
+    {
+        return next_line(u, v, with_rating ? &r : nullptr, part) < 0;
+    }
 
-        return !ss.fail();
+    mf_long next_batch(mf::mf_node* nodes, mf_long len,
+                       std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        mf_long i = 0;
+        for(; i < len && (parts[part].cursor < parts[part].end || refill(part)); i++)
+        {
+            mf_float* r = with_rating ? &nodes[i].r : nullptr;
+            int reason = next_line(nodes[i].u, nodes[i].v, r, part);
+            if(reason >= 0)
+                invalid.push_back(InvalidRecord{ i, reason });
+        }
+        return i;
     }
 
-    void close() { in_file.close(); }
+    // Decompression errors are reported here, since the data may be read
+    // by other threads
+    void close()
+    {
+        in_file.close();
+        parts.clear();
+        if(compressed)
+        {
+            stream.close();
+            check_stream(stream);
+        }
+    }
 };
 
 
@@ -104,6 +400,7 @@ protected:
     const int*    pen_itemid;
     const double* pen_rating;
     const mf_int  ind_offset;
+    std::vector< Part<mf_long> > parts;
 
 public:
     DataMemoryReader(Rcpp::IntegerVector user_ind,
@@ -123,32 +420,389 @@ public:
 
     mf_long count() { return len; }
 
-    void open() {}
+    mf_long size_hint() { return len; }
 
-    bool next(mf_int& u, mf_int& v, mf_float& r)
+    int open(int nparts = 1)
     {
-        u = *pen_userid - ind_offset;
-        v = *pen_itemid - ind_offset;
-        r = static_cast<mf_float>(*pen_rating);
+        parts = split_index(len, nparts);
+        return int(parts.size());
+    }
 
-        bool failure = Rcpp::IntegerVector::is_na(*pen_userid) ||
-                       Rcpp::IntegerVector::is_na(*pen_itemid) ||
-                       Rcpp::NumericVector::is_na(*pen_rating);
+    bool has_next(int part = 0) { return parts[part].cursor < parts[part].end; }
 
-        pen_userid++;
-        pen_itemid++;
-        pen_rating++;
+    bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0)
+    {
+        const mf_long i = parts[part].cursor++;
+        u = pen_userid[i] - ind_offset;
+        v = pen_itemid[i] - ind_offset;
+        r = static_cast<mf_float>(pen_rating[i]);
+
+        bool failure = Rcpp::IntegerVector::is_na(pen_userid[i]) ||
+                       Rcpp::IntegerVector::is_na(pen_itemid[i]) ||
+                       Rcpp::NumericVector::is_na(pen_rating[i]);
 
         return !failure;
     }
 
+    mf_long next_batch(mf::mf_node* nodes, mf_long len,
+                       std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        const mf_long start = parts[part].cursor;
+        len = std::min(len, parts[part].end - start);
+        parts[part].cursor += len;
+
+        const int*    pu = pen_userid + start;
+        const int*    pv = pen_itemid + start;
+        const double* pr = pen_rating + start;
+        const int     na = NA_INTEGER;
+
+        // Conversion and NA detection have no branches, so that the compiler
+        // can vectorize the loop. Positions of NAs are only searched for when
+        // there are any
+        int nbad = 0;
+        for(mf_long i = 0; i < len; i++)
+        {
+            nodes[i].u = pu[i] - ind_offset;
+            nodes[i].v = pv[i] - ind_offset;
+            nodes[i].r = static_cast<mf_float>(pr[i]);
+            nbad += (pu[i] == na) | (pv[i] == na) | std::isnan(pr[i]);
+        }
+
+        if(nbad > 0)
+        {
+            for(mf_long i = 0; i < len; i++)
+            {
+                if(pu[i] == na)
+                    invalid.push_back(InvalidRecord{ i, InvalidRecord::BadUser });
+                else if(pv[i] == na)
+                    invalid.push_back(InvalidRecord{ i, InvalidRecord::BadItem });
+                else if(std::isnan(pr[i]))
+                    invalid.push_back(InvalidRecord{ i, InvalidRecord::BadRating });
+            }
+        }
+
+        return len;
+    }
+
+    void close() {}
+};
+
+
+// User and item IDs given as character vectors
+// If with_rating is false, the rating vector is not used
+class DataMemoryStringReader: public DataReader
+{
+protected:
+    const mf_long len;
+    SEXP          user_id;
+    SEXP          item_id;
+    const double* pen_rating;
+    mf_long       cursor;
+
+    static Reco::StringRef string_ref(SEXP str)
+    {
+        return Reco::StringRef{ CHAR(str), std::size_t(LENGTH(str)) };
+    }
+
+public:
+    DataMemoryStringReader(Rcpp::CharacterVector user_id,
+                           Rcpp::CharacterVector item_id,
+                           Rcpp::NumericVector rating,
+                           bool with_rating = true) :
+        len(user_id.length()),
+        user_id(user_id),
+        item_id(item_id),
+        pen_rating(with_rating ? rating.begin() : nullptr),
+        cursor(0)
+    {
+        if(with_rating && rating.length() != len)
+            throw std::logic_error("rating vector must have the same length as user index and item index");
+    }
+
+    mf_long count() { return len; }
+
+    mf_long size_hint() { return len; }
+
+    bool string_ids() { return true; }
+
+    int open(int nparts = 1)
+    {
+        cursor = 0;
+        return 1;
+    }
+
+    bool has_next(int part = 0) { return cursor < len; }
+
+    bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0)
+    {
+        const mf_long i = cursor++;
+        SEXP su = STRING_ELT(user_id, i);
+        SEXP sv = STRING_ELT(item_id, i);
+        r = pen_rating ? static_cast<mf_float>(pen_rating[i]) : 0;
+
+        // IDs of invalid records are not added to the dictionaries
+        if(su == NA_STRING || sv == NA_STRING || std::isnan(r))
+            return false;
+
+        u = user_index(string_ref(su));
+        v = item_index(string_ref(sv));
+        return true;
+    }
+
+    mf_long next_batch(mf::mf_node* nodes, mf_long len,
+                       std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        mf_long i = 0;
+        for(; i < len && cursor < this->len; i++)
+        {
+            if(next(nodes[i].u, nodes[i].v, nodes[i].r, part))
+                continue;
+
+            const mf_long k = cursor - 1;
+            int reason = InvalidRecord::BadRating;
+            if(STRING_ELT(user_id, k) == NA_STRING)
+                reason = InvalidRecord::BadUser;
+            else if(STRING_ELT(item_id, k) == NA_STRING)
+                reason = InvalidRecord::BadItem;
+            invalid.push_back(InvalidRecord{ i, reason });
+        }
+        return i;
+    }
+
     void close() {}
 };
 
+// Sparse matrices in compressed column (dgCMatrix) or compressed row
+// (dgRMatrix) format
+// The records are read in storage order, with the outer index (column for
+// CSC and row for CSR) recovered from the pointer vector
+class DataSparseReader: public DataReader
+{
+protected:
+    const mf_long len;
+    const int     nouter;
+    const int*    pen_ptr;
+    const int*    pen_index;
+    const double* pen_value;
+    const bool    by_col;
+    const bool    with_rating;
+    std::vector< Part<mf_long> > parts;
+
+    // The outer index of the k-th record, i.e., the j with ptr[j] <= k < ptr[j+1]
+    int outer_index(mf_long k) const
+    {
+        return int(std::upper_bound(pen_ptr, pen_ptr + nouter + 1, k) - pen_ptr) - 1;
+    }
+
+public:
+    // If with_rating is false, values of the matrix are not read
+    DataSparseReader(Rcpp::IntegerVector ptr,
+                     Rcpp::IntegerVector index,
+                     Rcpp::NumericVector value,
+                     bool by_col, bool with_rating = true) :
+        len(index.length()),
+        nouter(ptr.length() - 1),
+        pen_ptr(ptr.begin()),
+        pen_index(index.begin()),
+        pen_value(value.begin()),
+        by_col(by_col),
+        with_rating(with_rating)
+    {
+        if(ptr.length() < 1 || ptr[nouter] != len)
+            throw std::logic_error("invalid sparse matrix");
+        // Test whether value vector is valid
+        if(with_rating && value.length() != len)
+            throw std::logic_error("sparse matrix must have values for training data");
+    }
+
+    mf_long count() { return len; }
+
+    mf_long size_hint() { return len; }
+
+    int open(int nparts = 1)
+    {
+        parts = split_index(len, nparts);
+        return int(parts.size());
+    }
+
+    bool has_next(int part = 0) { return parts[part].cursor < parts[part].end; }
+
+    bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0)
+    {
+        const mf_long k = parts[part].cursor++;
+        const int j = outer_index(k);
+        u = by_col ? pen_index[k] : j;
+        v = by_col ? j : pen_index[k];
+        r = with_rating ? static_cast<mf_float>(pen_value[k]) : 0;
+
+        return !(with_rating && Rcpp::NumericVector::is_na(pen_value[k]));
+    }
+
+    mf_long next_batch(mf::mf_node* nodes, mf_long len,
+                       std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        const mf_long start = parts[part].cursor;
+        len = std::min(len, parts[part].end - start);
+        parts[part].cursor += len;
+
+        const int* pi = pen_index + start;
+        int j = outer_index(start);
+        for(mf_long i = 0; i < len; i++)
+        {
+            while(pen_ptr[j + 1] <= start + i)
+                j++;
+            nodes[i].u = by_col ? pi[i] : j;
+            nodes[i].v = by_col ? j : pi[i];
+        }
+
+        if(!with_rating)
+        {
+            for(mf_long i = 0; i < len; i++)
+                nodes[i].r = 0;
+            return len;
+        }
+
+        // See DataMemoryReader::next_batch()
+        const double* pr = pen_value + start;
+        int nbad = 0;
+        for(mf_long i = 0; i < len; i++)
+        {
+            nodes[i].r = static_cast<mf_float>(pr[i]);
+            nbad += std::isnan(pr[i]);
+        }
+
+        if(nbad > 0)
+        {
+            for(mf_long i = 0; i < len; i++)
+            {
+                if(std::isnan(pr[i]))
+                    invalid.push_back(InvalidRecord{ i, InvalidRecord::BadRating });
+            }
+        }
+
+        return len;
+    }
+
+    void close() {}
+};
+
+
+// Binary triplet files written by write_binary()
+// Training data are used in place from a copy-on-write mapping of the file
+class DataBinaryReader: public DataReader
+{
+protected:
+    const std::string         path;
+    Reco::MappedFile          in_file;
+    const Reco::BinaryHeader* header;
+    std::vector< Part<mf_long> > parts;
+
+    const mf::mf_node* nodes() const
+    {
+        return reinterpret_cast<const mf::mf_node*>(in_file.begin() + sizeof(Reco::BinaryHeader));
+    }
+
+    void map_file()
+    {
+        if(!in_file.open(path, true))
+            throw std::runtime_error("cannot open file '" + path + '\'');
+        header = Reco::binary_header(in_file.begin(), in_file.end());
+        if(header == nullptr)
+        {
+            in_file.close();
+            throw std::runtime_error("file '" + path + "' is not a valid binary data file");
+        }
+    }
+
+public:
+    DataBinaryReader(const std::string& file_path) :
+        path(file_path), header(nullptr)
+    {
+        // Test whether file can be opened
+        std::ifstream f(path);
+        if(!f.is_open())
+            throw std::runtime_error("cannot open file '" + path + '\'');
+    }
+
+    mf_long count()
+    {
+        if(!in_file.is_open())
+        {
+            map_file();
+            mf_long nnz = header->nnz;
+            in_file.close();
+            return nnz;
+        }
+        return header->nnz;
+    }
+
+    mf_long size_hint() { return header->nnz; }
+
+    int open(int nparts = 1)
+    {
+        map_file();
+        parts = split_index(header->nnz, nparts);
+        return int(parts.size());
+    }
+
+    bool has_next(int part = 0) { return parts[part].cursor < parts[part].end; }
+
+    bool next(mf_int& u, mf_int& v, mf_float& r, int part = 0)
+    {
+        const mf::mf_node& N = nodes()[parts[part].cursor++];
+        u = N.u;
+        v = N.v;
+        r = N.r;
+        return true;
+    }
+
+    mf_long next_batch(mf::mf_node* dest, mf_long len,
+                       std::vector<InvalidRecord>& invalid, int part = 0)
+    {
+        const mf_long start = parts[part].cursor;
+        len = std::min(len, parts[part].end - start);
+        parts[part].cursor += len;
+        std::copy(nodes() + start, nodes() + start + len, dest);
+        return len;
+    }
+
+    void close()
+    {
+        in_file.close();
+        parts.clear();
+    }
+
+    // prob.R points into the mapping, which is kept until free_data()
+    bool read_direct(mf::mf_problem& prob)
+    {
+        map_file();
+        prob.m = header->m;
+        prob.n = header->n;
+        prob.nnz = header->nnz;
+        prob.R = reinterpret_cast<mf::mf_node*>(in_file.data() + sizeof(Reco::BinaryHeader));
+        return true;
+    }
+
+    void free_data(mf::mf_problem& prob)
+    {
+        prob.R = nullptr;
+        in_file.close();
+    }
+};
+
 
 DataReader* get_reader(SEXP data_source);
 
-mf::mf_problem read_data(DataReader* reader);
+// Read data using nthread threads
+mf::mf_problem read_data(DataReader* reader, int nthread = 1);
+
+// Dictionaries of user and item IDs in R are stored as
+//   list(user = <IDs of users>, item = <IDs of items>)
+Rcpp::List wrap_ids(const Reco::IdMaps& ids);
+// Load the dictionaries of a model, either from an R list or from the file
+// next to the model
+// Return false if the IDs of the model are not remapped
+bool get_ids(SEXP ids_, const std::string& model_path, Reco::IdMaps& ids);
 
 
 
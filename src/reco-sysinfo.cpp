@@ -0,0 +1,364 @@
+#include <fstream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <thread>
+
+#include "reco-sysinfo.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+namespace Reco
+{
+
+#ifndef __APPLE__
+static void set_level(CacheInfo& info, int level, std::size_t size)
+{
+    if(level == 1)
+        info.l1 = size;
+    else if(level == 2)
+        info.l2 = size;
+    else if(level == 3)
+        info.l3 = size;
+}
+#endif
+
+#ifdef _WIN32
+
+CacheInfo cache_info()
+{
+    CacheInfo info = { 0, 0, 0 };
+
+    DWORD len = 0;
+    GetLogicalProcessorInformation(NULL, &len);
+    if(len == 0)
+        return info;
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> procs(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) + 1);
+    if(!GetLogicalProcessorInformation(&procs[0], &len))
+        return info;
+
+    const std::size_t nprocs = len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+    for(std::size_t i = 0; i < nprocs; i++)
+    {
+        if(procs[i].Relationship != RelationCache)
+            continue;
+        const CACHE_DESCRIPTOR& cache = procs[i].Cache;
+        if(cache.Type == CacheData || cache.Type == CacheUnified)
+            set_level(info, cache.Level, cache.Size);
+    }
+    return info;
+}
+
+int nr_physical_cores()
+{
+    DWORD len = 0;
+    GetLogicalProcessorInformation(NULL, &len);
+    if(len == 0)
+        return nr_cores();
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> procs(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) + 1);
+    if(!GetLogicalProcessorInformation(&procs[0], &len))
+        return nr_cores();
+
+    int cores = 0;
+    const std::size_t nprocs = len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+    for(std::size_t i = 0; i < nprocs; i++)
+    {
+        if(procs[i].Relationship == RelationProcessorCore)
+            cores++;
+    }
+    return cores > 0 ? cores : nr_cores();
+}
+
+#elif defined(__APPLE__)
+
+static std::size_t sysctl_size(const char* name)
+{
+    std::uint64_t value = 0;
+    std::size_t len = sizeof(value);
+    if(sysctlbyname(name, &value, &len, NULL, 0) != 0)
+        return 0;
+    return std::size_t(value);
+}
+
+CacheInfo cache_info()
+{
+    CacheInfo info;
+    info.l1 = sysctl_size("hw.l1dcachesize");
+    info.l2 = sysctl_size("hw.l2cachesize");
+    info.l3 = sysctl_size("hw.l3cachesize");
+    return info;
+}
+
+int nr_physical_cores()
+{
+    const std::size_t cores = sysctl_size("hw.physicalcpu");
+    return cores > 0 ? int(cores) : nr_cores();
+}
+
+#else
+
+// Sizes such as "48K" or "32M" in /sys
+static std::size_t parse_size(const std::string& str)
+{
+    char* end;
+    std::size_t size = std::strtoul(str.c_str(), &end, 10);
+    if(*end == 'K')
+        size <<= 10;
+    else if(*end == 'M')
+        size <<= 20;
+    return size;
+}
+
+CacheInfo cache_info()
+{
+    CacheInfo info = { 0, 0, 0 };
+
+    // Each directory index0, index1, ... describes one cache of CPU 0
+    const std::string dir = "/sys/devices/system/cpu/cpu0/cache/index";
+    for(int i = 0; i < 16; i++)
+    {
+        std::string level, type, size;
+        std::ifstream f_level(dir + std::to_string(i) + "/level");
+        std::ifstream f_type(dir + std::to_string(i) + "/type");
+        std::ifstream f_size(dir + std::to_string(i) + "/size");
+        if(!(f_level >> level) || !(f_type >> type) || !(f_size >> size))
+            break;
+        if(type == "Data" || type == "Unified")
+            set_level(info, std::atoi(level.c_str()), parse_size(size));
+    }
+
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+    // glibc knows the sizes on systems without /sys
+    long size;
+    if(info.l1 == 0 && (size = sysconf(_SC_LEVEL1_DCACHE_SIZE)) > 0)
+        info.l1 = std::size_t(size);
+    if(info.l2 == 0 && (size = sysconf(_SC_LEVEL2_CACHE_SIZE)) > 0)
+        info.l2 = std::size_t(size);
+    if(info.l3 == 0 && (size = sysconf(_SC_LEVEL3_CACHE_SIZE)) > 0)
+        info.l3 = std::size_t(size);
+#endif
+
+    return info;
+}
+
+int nr_physical_cores()
+{
+    // The hardware threads of a core have the same package and core IDs
+    std::set< std::pair<int, int> > cores;
+    const std::string dir = "/sys/devices/system/cpu/cpu";
+    for(int cpu = 0; cpu < nr_cores(); cpu++)
+    {
+        std::ifstream f_package(dir + std::to_string(cpu) + "/topology/physical_package_id");
+        std::ifstream f_core(dir + std::to_string(cpu) + "/topology/core_id");
+        int package, core;
+        if(!(f_package >> package) || !(f_core >> core))
+            return nr_cores();
+        cores.insert(std::make_pair(package, core));
+    }
+    return int(cores.size());
+}
+
+#endif
+
+int nr_cores()
+{
+    const unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? int(n) : 1;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+static CpuFeatures detect_cpu_features()
+{
+    // The checks of AVX include the support of the operating system for
+    // saving the registers
+    __builtin_cpu_init();
+    CpuFeatures features;
+    features.sse3 = __builtin_cpu_supports("sse3");
+    features.avx = __builtin_cpu_supports("avx");
+    features.avx2 = __builtin_cpu_supports("avx2");
+    features.fma = __builtin_cpu_supports("fma");
+    features.avx512f = __builtin_cpu_supports("avx512f");
+    return features;
+}
+
+#else
+
+static CpuFeatures detect_cpu_features()
+{
+    CpuFeatures features = { false, false, false, false, false };
+    return features;
+}
+
+#endif
+
+CpuFeatures cpu_features()
+{
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
+
+#if defined(__linux__)
+
+// CPU lists such as "0-3,8-11" in /sys
+static std::vector<int> parse_cpu_list(const std::string& str)
+{
+    std::vector<int> cpus;
+    const char* p = str.c_str();
+    while(*p)
+    {
+        char* end;
+        const long first = std::strtol(p, &end, 10);
+        if(end == p)
+            break;
+        long last = first;
+        p = end;
+        if(*p == '-')
+        {
+            last = std::strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for(long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(int(cpu));
+        if(*p == ',')
+            p++;
+    }
+    return cpus;
+}
+
+std::vector< std::vector<int> > numa_nodes()
+{
+    std::vector< std::vector<int> > nodes;
+    // The list of a node without CPUs, such as a memory-only node, is an
+    // empty line
+    const std::string dir = "/sys/devices/system/node/node";
+    for(int i = 0; i < 1024; i++)
+    {
+        std::ifstream f(dir + std::to_string(i) + "/cpulist");
+        if(!f.is_open())
+            break;
+        std::string list;
+        std::getline(f, list);
+        nodes.push_back(parse_cpu_list(list));
+    }
+
+    if(nodes.empty())
+    {
+        nodes.resize(1);
+        for(int cpu = 0; cpu < nr_cores(); cpu++)
+            nodes[0].push_back(cpu);
+    }
+    return nodes;
+}
+
+bool pin_thread(int cpu)
+{
+    if(cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool unpin_thread()
+{
+    // The ID of the main thread is the process ID
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(getpid(), sizeof(set), &set) != 0)
+        return false;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool move_to_node(void* ptr, std::size_t len, int node)
+{
+#ifdef SYS_move_pages
+    const long page = sysconf(_SC_PAGESIZE);
+    if(page <= 0 || len == 0)
+        return false;
+
+    // Pages are moved in batches, and pages that cannot be moved are
+    // left where they are
+    const std::uintptr_t first = std::uintptr_t(ptr) / page * page;
+    const std::uintptr_t last = std::uintptr_t(ptr) + len;
+    const std::size_t batch = 1024;
+    std::vector<void*> pages;
+    std::vector<int> nodes(batch, node), status(batch);
+    pages.reserve(batch);
+    bool ok = true;
+    for(std::uintptr_t addr = first; addr < last; addr += page)
+    {
+        pages.push_back((void*) addr);
+        if(pages.size() == batch || addr + page >= last)
+        {
+            // MPOL_MF_MOVE == 2 in <numaif.h>, which is part of libnuma
+            if(syscall(SYS_move_pages, 0, pages.size(), &pages[0], &nodes[0], &status[0], 2) != 0)
+                ok = false;
+            pages.clear();
+        }
+    }
+    return ok;
+#else
+    return false;
+#endif
+}
+
+#else
+
+std::vector< std::vector<int> > numa_nodes()
+{
+    std::vector< std::vector<int> > nodes(1);
+    for(int cpu = 0; cpu < nr_cores(); cpu++)
+        nodes[0].push_back(cpu);
+    return nodes;
+}
+
+bool pin_thread(int cpu)
+{
+#ifdef _WIN32
+    if(cpu < 0 || cpu >= int(8 * sizeof(DWORD_PTR)))
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+    // macOS has no interface to bind threads to CPUs
+    (void) cpu;
+    return false;
+#endif
+}
+
+bool unpin_thread()
+{
+#ifdef _WIN32
+    DWORD_PTR process_mask, system_mask;
+    if(!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), process_mask) != 0;
+#else
+    return false;
+#endif
+}
+
+bool move_to_node(void*, std::size_t, int)
+{
+    return false;
+}
+
+#endif
+
+
+} // namespace Reco
@@ -0,0 +1,64 @@
+#ifndef RECO_SYSINFO_H
+#define RECO_SYSINFO_H
+
+#include <cstddef>
+#include <vector>
+
+namespace Reco
+{
+
+// Sizes of the data caches of one core in bytes
+// A level that cannot be detected has size 0. The L3 cache is usually
+// shared by several cores
+struct CacheInfo
+{
+    std::size_t l1;
+    std::size_t l2;
+    std::size_t l3;
+};
+
+// The platform-specific code lives in reco-sysinfo.cpp
+CacheInfo cache_info();
+
+// Number of hardware threads, at least one
+int nr_cores();
+
+// Number of physical cores, at least one. The hardware threads of a core
+// share its caches. Same as nr_cores() if the topology cannot be detected
+int nr_physical_cores();
+
+// The logical CPUs of each NUMA node, indexed by the node number. Nodes
+// without CPUs have empty lists, and machines without NUMA information
+// have one node with all the CPUs
+std::vector< std::vector<int> > numa_nodes();
+
+// The x86 instruction sets that the CPU and the operating system support
+struct CpuFeatures
+{
+    bool sse3;
+    bool avx;
+    bool avx2;
+    bool fma;
+    bool avx512f;
+};
+
+// Detected once and cached. All false on other architectures
+CpuFeatures cpu_features();
+
+// Bind the calling thread to a logical CPU. Returns false if the binding
+// is not supported on the platform or fails
+bool pin_thread(int cpu);
+
+// Allow the calling thread to run on the CPUs of the main thread again,
+// after pin_thread(). Returns false if this is not supported or fails
+bool unpin_thread();
+
+// Move the memory pages that overlap [ptr, ptr + len) to a NUMA node.
+// Only supported on Linux, elsewhere nothing is done and false is returned
+bool move_to_node(void* ptr, std::size_t len, int node);
+
+
+} // namespace Reco
+
+
+#endif // RECO_SYSINFO_H
@@ -5,11 +5,13 @@
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <cstdio>
 
 #include <Rcpp.h>
 #include <Rcpp/unwindProtect.h>
 #include "mf.h"
 #include "reco-read-data.h"
+#include "reco-sysinfo.h"
 
 using namespace mf;
 
@@ -45,15 +47,34 @@ mf_parameter parse_train_option(SEXP opts_)
     if(param.eta <= 0)
         throw std::invalid_argument("learning rate should be greater than zero");
 
-    // Number of threads
+    // Number of threads, or zero to choose it after the data are read
     param.nr_threads = Rcpp::as<mf_int>(opts["nthread"]);
-    if(param.nr_threads <= 0)
+    if(param.nr_threads < 0)
         throw std::invalid_argument("number of threads should be greater than zero");
 
-    // Number of bins
+    // Number of bins, or zero to choose it after the data are read
     param.nr_bins = Rcpp::as<mf_int>(opts["nbin"]);
-    if(param.nr_bins <= 0 || param.nr_bins <= param.nr_threads)
+    if(param.nr_bins < 0 ||
+       (param.nr_bins > 0 && param.nr_threads > 0 && param.nr_bins <= param.nr_threads))
         throw std::invalid_argument("number of bins should be greater than number of threads");
+
+    // Whether to balance the numbers of ratings in the blocks
+    param.balance_bins = Rcpp::as<bool>(opts["balance"]);
+
+    // Whether to use the lock-free block scheduler
+    param.lock_free_scheduler = Rcpp::as<bool>(opts["lockfree"]);
+
+    // Whether threads continue across epochs without waiting for each other
+    param.async_epochs = Rcpp::as<bool>(opts["async"]);
+
+    // Whether to bind the threads to CPUs and place the data on their NUMA nodes
+    param.pin_threads = Rcpp::as<bool>(opts["pin"]);
+
+    // Whether threads prefer blocks in the row or the column of their previous blocks
+    param.locality_scheduling = Rcpp::as<bool>(opts["locality"]);
+
+    // Instruction set of the solver kernels, SIMD_AUTO to detect it
+    param.simd = Rcpp::as<mf_int>(opts["simd"]);
     
     // Whether to perform NMF or not
     param.do_nmf = Rcpp::as<bool>(opts["nmf"]);
@@ -67,6 +88,37 @@ mf_parameter parse_train_option(SEXP opts_)
     return param;
 }
 
+// One row for each thread in each iteration
+Rcpp::DataFrame wrap_stats(const std::vector<mf_thread_stats>& stats)
+{
+    const std::size_t n = stats.size();
+    Rcpp::IntegerVector iter(n), thread(n);
+    Rcpp::NumericVector blocks(n), ratings(n), reused(n), compute(n), schedule(n), lock(n), barrier(n);
+    for(std::size_t i = 0; i < n; i++)
+    {
+        iter[i] = stats[i].iter;
+        thread[i] = stats[i].thread;
+        blocks[i] = double(stats[i].blocks);
+        ratings[i] = double(stats[i].ratings);
+        reused[i] = double(stats[i].reused);
+        compute[i] = stats[i].compute_time;
+        schedule[i] = stats[i].schedule_time;
+        lock[i] = stats[i].lock_time;
+        barrier[i] = stats[i].barrier_time;
+    }
+    return Rcpp::DataFrame::create(
+        Rcpp::Named("iter") = iter,
+        Rcpp::Named("thread") = thread,
+        Rcpp::Named("blocks") = blocks,
+        Rcpp::Named("ratings") = ratings,
+        Rcpp::Named("reused") = reused,
+        Rcpp::Named("compute") = compute,
+        Rcpp::Named("schedule") = schedule,
+        Rcpp::Named("lock") = lock,
+        Rcpp::Named("barrier") = barrier
+    );
+}
+
 SEXP safe_mat(void *size_)
 {
     int *size = (int*) size_;
@@ -91,17 +143,47 @@ BEGIN_RCPP
         model_path = Rcpp::as<std::string>(model_path_);
     mf_parameter param = parse_train_option(opts_);
 
-    mf_problem tr = read_data(data_reader);
+    // Map sparse user and item IDs to dense indices, so that the model only
+    // has rows for the IDs that appear in the data
+    // String IDs are always mapped, and the readers do it while parsing
+    Reco::IdMaps ids;
+    ids.strings = data_reader->string_ids();
+    data_reader->set_dict(&ids, true);
+    mf_problem tr = read_data(data_reader, param.nr_threads > 0 ? param.nr_threads : Reco::nr_cores());
+
+    bool remap = ids.strings || Rcpp::as<bool>(Rcpp::List(opts_)["remap"]);
+    if(remap && !ids.strings)
+    {
+        mf_int offset = Rcpp::as<bool>(Rcpp::S4(train_data_).slot("index1"));
+        Reco::remap_ids(tr, ids, offset);
+    }
+
+    // Choose the number of threads and bins if they are automatic
+    mf_auto_grid(&tr, &param, Rcpp::as<bool>(Rcpp::List(opts_)["probe"]));
+
+    // Counters of the solver threads
+    std::vector<mf_thread_stats> stats;
+    if(Rcpp::as<bool>(Rcpp::List(opts_)["stats"]))
+        param.stats = &stats;
+
     mf_model* model = mf_train(&tr, param);
     mf_int status = 0;
-    // If model_path_ is not NULL, save the model matrices to hard disk
+    // If model_path_ is not NULL, save the model matrices to hard disk,
+    // together with the dictionaries of IDs. An old dictionary file is
+    // removed, since it does not belong to the new model
     if(model_path_ != R_NilValue)
+    {
         status = mf_save_model(model, model_path.c_str());
+        if(status == 0 && remap && !Reco::write_ids(Reco::ids_path(model_path), ids))
+            status = 1;
+        if(status == 0 && !remap)
+            std::remove(Reco::ids_path(model_path).c_str());
+    }
 
     if(status != 0)
     {
         mf_destroy_model(&model);
-        delete[] tr.R;
+        data_reader->free_data(tr);
         delete data_reader;
 
         std::string msg = "cannot save model to " + model_path;
@@ -112,7 +194,12 @@ BEGIN_RCPP
         Rcpp::Named("nuser") = Rcpp::wrap(model->m),
         Rcpp::Named("nitem") = Rcpp::wrap(model->n),
         Rcpp::Named("nfac")  = Rcpp::wrap(model->k),
-        Rcpp::Named("matrices") = Rcpp::List::create()
+        Rcpp::Named("remap") = Rcpp::wrap(remap),
+        Rcpp::Named("nthread") = Rcpp::wrap(param.nr_threads),
+        Rcpp::Named("nbin")  = Rcpp::wrap(param.nr_bins),
+        Rcpp::Named("stats") = wrap_stats(stats),
+        Rcpp::Named("matrices") = Rcpp::List::create(),
+        Rcpp::Named("ids") = Rcpp::List::create()
     );
 
     // Store model matrices in memory
@@ -136,18 +223,20 @@ BEGIN_RCPP
             *((float*) INTEGER(matrices["b"])) = model->b;
 
             model_param["matrices"] = matrices;
+            if(remap)
+                model_param["ids"] = wrap_ids(ids);
         }
         catch(const std::exception& e)
         {
             mf_destroy_model(&model);
-            delete [] tr.R;
+            data_reader->free_data(tr);
             delete data_reader;
             throw e;
         }
     }
 
     mf_destroy_model(&model);
-    delete [] tr.R;
+    data_reader->free_data(tr);
     delete data_reader;
 
     return model_param;
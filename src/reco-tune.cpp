@@ -12,6 +12,7 @@
 
 #include "mf.h"
 #include "reco-read-data.h"
+#include "reco-sysinfo.h"
 
 using namespace mf;
 
@@ -44,15 +45,34 @@ TuneOption parse_tune_option(SEXP opts_)
     if(option.param.nr_iters <= 0)
         throw std::invalid_argument("number of iterations should be greater than zero");
 
-    // Number of threads
+    // Number of threads, or zero to choose it after the data are read
     option.param.nr_threads = Rcpp::as<mf_int>(opts["nthread"]);
-    if(option.param.nr_threads <= 0)
+    if(option.param.nr_threads < 0)
         throw std::invalid_argument("number of threads should be greater than zero");
 
-    // Number of bins
+    // Number of bins, or zero to choose it after the data are read
     option.param.nr_bins = Rcpp::as<mf_int>(opts["nbin"]);
-    if(option.param.nr_bins <= 0 || option.param.nr_bins <= option.param.nr_threads)
+    if(option.param.nr_bins < 0 ||
+       (option.param.nr_bins > 0 && option.param.nr_threads > 0 && option.param.nr_bins <= option.param.nr_threads))
         throw std::invalid_argument("number of bins should be greater than number of threads");
+
+    // Whether to balance the numbers of ratings in the blocks
+    option.param.balance_bins = Rcpp::as<bool>(opts["balance"]);
+
+    // Whether to use the lock-free block scheduler
+    option.param.lock_free_scheduler = Rcpp::as<bool>(opts["lockfree"]);
+
+    // Whether threads continue across epochs without waiting for each other
+    option.param.async_epochs = Rcpp::as<bool>(opts["async"]);
+
+    // Whether to bind the threads to CPUs and place the data on their NUMA nodes
+    option.param.pin_threads = Rcpp::as<bool>(opts["pin"]);
+
+    // Whether threads prefer blocks in the row or the column of their previous blocks
+    option.param.locality_scheduling = Rcpp::as<bool>(opts["locality"]);
+
+    // Instruction set of the solver kernels, SIMD_AUTO to detect it
+    option.param.simd = Rcpp::as<mf_int>(opts["simd"]);
     
     // Whether to perform NMF or not
     option.param.do_nmf = Rcpp::as<bool>(opts["nmf"]);
@@ -88,7 +108,12 @@ BEGIN_RCPP
     TuneOption option = parse_tune_option(opts_other_);
 
     DataReader* data_reader = get_reader(train_data_);
-    mf_problem tr = read_data(data_reader);
+    // String IDs are only mapped to indices here, and the dictionaries are
+    // not needed after the data are read
+    Reco::IdMaps ids;
+    ids.strings = data_reader->string_ids();
+    data_reader->set_dict(&ids, true);
+    mf_problem tr = read_data(data_reader, option.param.nr_threads > 0 ? option.param.nr_threads : Reco::nr_cores());
 
     for(mf_long i = 0; i < n; i++)
     {
@@ -112,13 +137,17 @@ BEGIN_RCPP
         option.param.lambda_q2 = tune_costq_l2[i];
         option.param.eta       = tune_lrate[i];
 
-        rmse[i] = mf_cross_validation(&tr, option.nr_folds, option.param);
+        // The automatic numbers of threads and bins depend on k
+        mf_parameter param = option.param;
+        mf_auto_grid(&tr, &param, false);
+
+        rmse[i] = mf_cross_validation(&tr, option.nr_folds, param);
         
         if(!option.param.quiet)
             Rcpp::Rcout << "============================" << std::endl << std::endl;
     }
 
-    delete [] tr.R;
+    data_reader->free_data(tr);
     delete data_reader;
 
     return rmse;
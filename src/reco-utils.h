@@ -67,6 +67,62 @@ inline int rand_less_than(int i)
     return int(r % i);
 }
 
+// A 64-bit seed drawn from R's RNG, so it follows set.seed()
+// R's RNG is not thread-safe, so this must be called by the master thread
+inline std::uint64_t r_seed()
+{
+    std::uint64_t hi = std::uint64_t(R::unif_rand() * 4294967296.0);
+    std::uint64_t lo = std::uint64_t(R::unif_rand() * 4294967296.0);
+    return (hi << 32) | lo;
+}
+
+// xoshiro256** generator, http://prng.di.unimi.it/
+// Each solver thread owns one of them, so random numbers can be drawn
+// inside the training loops without calling R's RNG or taking a lock
+class Rng
+{
+private:
+    std::uint64_t m_state[4];
+
+    static std::uint64_t rotl(std::uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+public:
+    explicit Rng(std::uint64_t seed)
+    {
+        // Expand the seed with splitmix64, which never gives an all-zero state
+        for(int i = 0; i < 4; i++)
+        {
+            seed += 0x9E3779B97F4A7C15ULL;
+            std::uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            m_state[i] = z ^ (z >> 31);
+        }
+    }
+
+    std::uint64_t next()
+    {
+        const std::uint64_t res = rotl(m_state[1] * 5, 7) * 9;
+        const std::uint64_t t = m_state[1] << 17;
+        m_state[2] ^= m_state[0];
+        m_state[3] ^= m_state[1];
+        m_state[1] ^= m_state[2];
+        m_state[0] ^= m_state[3];
+        m_state[2] ^= t;
+        m_state[3] = rotl(m_state[3], 45);
+        return res;
+    }
+
+    // Uniform on [0, 1), using the top 53 bits
+    double unif_rand()
+    {
+        return double(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
 // On Mac, std::random_shuffle() uses a "backward" implementation,
 // which leads to different results from Windows and Linux
 // Therefore, we use a consistent implementation based on GCC
@@ -4,7 +4,8 @@ static R_CallMethodDef callMethods[] = {
     {"reco_tune",    (DL_FUNC) &reco_tune,    3},
     {"reco_train",   (DL_FUNC) &reco_train,   3},
     {"reco_output",  (DL_FUNC) &reco_output,  3},
-    {"reco_predict", (DL_FUNC) &reco_predict, 4},
+    {"reco_predict", (DL_FUNC) &reco_predict, 5},
+    {"reco_write_binary", (DL_FUNC) &reco_write_binary, 3},
     {NULL, NULL, 0}
 };
 
@@ -13,3 +14,8 @@ void R_init_recosystem(DllInfo *info)
     R_registerRoutines(info, NULL, callMethods, NULL, NULL);
     R_useDynamicSymbols(info, FALSE);
 }
+
+void R_unload_recosystem(DllInfo *info)
+{
+    reco_shutdown_pool();
+}
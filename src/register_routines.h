@@ -9,7 +9,11 @@
 SEXP reco_tune(SEXP train_data_, SEXP opts_tune_, SEXP opts_other_);
 SEXP reco_train(SEXP train_data_, SEXP model_path_, SEXP opts_);
 SEXP reco_output(SEXP model_path_, SEXP P_, SEXP Q_);
-SEXP reco_predict(SEXP test_data_, SEXP model_path_, SEXP output_, SEXP model_inmemory_);
+SEXP reco_predict(SEXP test_data_, SEXP model_path_, SEXP output_, SEXP model_inmemory_, SEXP ids_);
+SEXP reco_write_binary(SEXP data_source_, SEXP path_, SEXP nthread_);
+
+// Joins the threads shared by all the calls, see reco-pool.h
+void reco_shutdown_pool(void);
 
 
 #endif